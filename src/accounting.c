@@ -0,0 +1,231 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * --stats-only: connection accounting, without the payload.  Every
+ * packet is counted against its direction of its connection, but
+ * nothing is reassembled, formatted or written, and no file is ever
+ * opened.  Both directions are listed in the manifest (see manifest.h)
+ * when the connection ends, with a RST or a FIN each way.
+ *
+ * Besides packets and bytes, each direction counts
+ *
+ *   retransmissions  segments whose data we've seen already, or that
+ *                    fill a hole an RTT or more after the data beyond
+ *                    it came
+ *   out of order     segments that fill a hole sooner than that
+ *   zero windows     times the receiver closed its window
+ *
+ * Every packet goes through the flow table (see libtcpflow.h), which
+ * passes on what's new of each to count_segment(), and drops what it
+ * has passed on before.  The RTT is timed
+ * from the handshake, as the time from the SYN to the SYN/ACK (our
+ * round trip to the server) and from there to the ACK of it (to the
+ * client); until it's known, OOO_USECS is used instead.
+ */
+
+#include "tcpflow.h"
+
+extern tcpflow_ctx *flow_table;
+
+#define OOO_USECS	3000	/* the RTT to assume until we know it */
+
+static long long packets_counted;
+static long long connections_ended;
+
+
+static long usecs_between(const struct timeval *from,
+			  const struct timeval *to)
+{
+  return (to->tv_sec - from->tv_sec) * 1000000L +
+    (to->tv_usec - from->tv_usec);
+}
+
+
+/* The state of a packet's flow, started if need be.  A SYN on a
+ * connection that has ended starts it again. */
+static flow_state_t *account_flow(packet_t *packet)
+{
+  flow_state_t *state = find_flow_state(packet->flow);
+
+  if (state != NULL && IS_SET(state->flags, FLOW_LISTED) &&
+      (packet->tcp_flags & TCPFLOW_SYN)) {
+    free(state);
+    state = NULL;
+  }
+
+  /* the data starts after the SYN */
+  if (state == NULL)
+    state = create_flow_state(packet->flow, packet->seq +
+			      ((packet->tcp_flags & TCPFLOW_SYN) ? 1 : 0),
+			      &packet->tv);
+
+  if (state->stats == NULL && !IS_SET(state->flags, FLOW_LISTED)) {
+    state->stats = MALLOC(struct flow_stats, 1);
+    memset(state->stats, 0, sizeof(struct flow_stats));
+  }
+  return state;
+}
+
+
+/* Time the handshake, once the SYN, the SYN/ACK and the ACK of it have
+ * all been seen */
+static void handshake(flow_state_t *state, packet_t *packet)
+{
+  struct flow_stats *stats = state->stats, *other_stats;
+  flow_state_t *other;
+
+  /* a retransmitted SYN is timed from the last copy */
+  if (packet->tcp_flags & TCPFLOW_SYN) {
+    stats->syn = packet->tv;
+    return;
+  }
+
+  /* we sent the SYN, and the SYN/ACK came after it */
+  if (!(packet->tcp_flags & TCPFLOW_ACK) || stats->syn.tv_sec == 0 ||
+      (other = reverse_flow_state(state)) == NULL ||
+      (other_stats = other->stats) == NULL ||
+      !timercmp(&other_stats->syn, &stats->syn, >))
+    return;
+
+  stats->syn_rtt = other_stats->syn_rtt =
+    usecs_between(&stats->syn, &other_stats->syn);
+  stats->ack_rtt = other_stats->ack_rtt =
+    usecs_between(&other_stats->syn, &packet->tv);
+  timerclear(&stats->syn);
+  timerclear(&other_stats->syn);
+}
+
+
+/* libtcpflow's open callback, with --stats-only.  If we've already
+ * seen the other direction, and it's not over, this one is the
+ * reply. */
+void start_counting(void *user, const struct tcpflow_flow *flow,
+		    void **flow_user)
+{
+  flow_state_t *state = new_flow_state(flow), *other;
+
+  other = reverse_flow_state(state);
+  if (other != NULL && !IS_SET(other->flags, FLOW_LISTED))
+    SET_BIT(state->flags, FLOW_REPLY);
+  *flow_user = state;
+}
+
+
+/* libtcpflow's data callback, with --stats-only: the part of a segment
+ * we haven't seen before.  Is it new, or late? */
+u_int32_t count_segment(void *user, const struct tcpflow_flow *flow,
+			void *flow_user, const u_char *data, u_int32_t length,
+			u_int64_t offset, const struct timeval *tv)
+{
+  flow_state_t *state = flow_user;
+  struct flow_stats *stats = state->stats;
+  const struct tcpflow_range *seen;
+  long rtt = stats->syn_rtt + stats->ack_rtt;
+  int count, lost;
+
+  count = tcpflow_passed(flow_table, flow, &seen, &lost);
+  if (count > 0 && offset < seen[count - 1].end) {
+    if (usecs_between(&stats->furthest, tv) < (rtt ? rtt : OOO_USECS))
+      stats->out_of_order++;
+    else
+      stats->retransmissions++;
+  } else {
+    stats->furthest = *tv;
+  }
+
+  return length;
+}
+
+
+/* Feed a packet to the flow table.  A segment with nothing we haven't
+ * seen isn't passed on to count_segment(), just counted in the
+ * table's stats, and here as a retransmission. */
+static void count_data(flow_state_t *state, packet_t *packet)
+{
+  struct tcpflow_stats before, after;
+
+  tcpflow_get_stats(flow_table, &before);
+  feed_packet(packet, packet->data, packet->length);
+  tcpflow_get_stats(flow_table, &after);
+
+  if (after.retransmitted != before.retransmitted)
+    state->stats->retransmissions++;
+}
+
+
+/* List both directions of a connection that's over */
+static void end_connection(flow_state_t *state)
+{
+  flow_state_t *other = reverse_flow_state(state);
+
+  PROBE_FLOW_FINISH(state->flow, state->tcp->packets, state->tcp->bytes,
+		    state->flags);
+  list_flow(state);
+  tcpflow_close_flow(flow_table, state->tcp);
+  free(state->stats);
+  state->stats = NULL;
+
+  if (other != NULL && !IS_SET(other->flags, FLOW_LISTED)) {
+    PROBE_FLOW_FINISH(other->flow, other->tcp->packets, other->tcp->bytes,
+		      other->flags);
+    list_flow(other);
+    tcpflow_close_flow(flow_table, other->tcp);
+    free(other->stats);
+    other->stats = NULL;
+  }
+
+  connections_ended++;
+}
+
+
+/* Count a decoded packet, with or without data */
+void account_packet(packet_t *packet)
+{
+  flow_state_t *state = account_flow(packet), *other;
+  struct flow_stats *stats = state->stats;
+  u_int8_t flags = packet->tcp_flags;
+
+  /* stragglers from a connection that has ended */
+  if (IS_SET(state->flags, FLOW_LISTED))
+    return;
+
+  packets_counted++;
+  stats->segments++;
+
+  handshake(state, packet);
+
+  if (!(flags & (TCPFLOW_SYN | TCPFLOW_RST))) {
+    if (packet->window == 0 && !stats->window_closed) {
+      stats->zero_windows++;
+      stats->window_closed = 1;
+    } else if (packet->window != 0) {
+      stats->window_closed = 0;
+    }
+  }
+
+  count_data(state, packet);
+
+  if (flags & TCPFLOW_RST) {
+    SET_BIT(state->flags, FLOW_SAW_RST);
+    end_connection(state);
+  } else if (flags & TCPFLOW_FIN) {
+    SET_BIT(state->flags, FLOW_SAW_FIN);
+    other = reverse_flow_state(state);
+    if (other == NULL || IS_SET(other->flags, FLOW_SAW_FIN | FLOW_LISTED))
+      end_connection(state);
+  }
+}
+
+
+void print_accounting_stats()
+{
+  if (packets_counted == 0)
+    return;
+
+  DEBUG(10) ("stats only: %lld packets counted; %lld connections ended",
+	     packets_counted, connections_ended);
+}
@@ -0,0 +1,93 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * Batched packet processing (--batch).  Rather than taking each packet
+ * all the way from the datalink header to its flow file before looking
+ * at the next one, we decode packets as libpcap hands them to us and
+ * put them aside, and every 'batch_size' packets handle the whole lot
+ * at once (see handle_batch()), prefetching flow state for all of them
+ * before looking any of it up.  With a big flow table, most lookups
+ * miss the cache; this way the misses overlap instead of being paid
+ * for one after another.
+ *
+ * libpcap may reuse its buffer as soon as our callback returns, so the
+ * payload of each packet is copied into the batch.  Batches are also
+ * handled whenever pcap_dispatch() returns, so a quiet network doesn't
+ * leave packets sitting in a half-full batch.
+ */
+
+#include "tcpflow.h"
+
+extern int batch_size;
+extern long dedup_window;
+
+static packet_t *batch;
+static u_char *payloads;	/* payloads of the batched packets */
+static u_int32_t payload_size;
+static u_int32_t payload_used;
+static int batch_count;
+
+
+void init_batch()
+{
+  if (batch_size <= 1)
+    return;
+
+  batch = MALLOC(packet_t, batch_size);
+  payload_size = batch_size * 2048 + SNAPLEN;
+  payloads = MALLOC(u_char, payload_size);
+  payload_used = 0;
+  batch_count = 0;
+
+  DEBUG(10) ("handling packets in batches of %d", batch_size);
+}
+
+
+/* Decode a packet and add it to the current batch */
+void batch_ip(const u_char *data, u_int32_t caplen, struct timeval *tv)
+{
+  packet_t packet;
+
+  if (!decode_ip(data, caplen, tv, &packet) ||
+      (dedup_window && duplicate_packet(&packet)))
+    return;
+
+  /* keep the payload; libpcap's copy won't last */
+  if (payload_used + packet.length > payload_size)
+    flush_batch();
+  memcpy(payloads + payload_used, packet.data, packet.length);
+  packet.data = payloads + payload_used;
+  payload_used += (packet.length + 7) & ~7;
+
+  batch[batch_count] = packet;
+  if (++batch_count == batch_size)
+    flush_batch();
+}
+
+
+/* Handle everything in the current batch */
+void flush_batch()
+{
+  if (batch_count == 0)
+    return;
+
+  handle_batch(batch, batch_count);
+  batch_count = 0;
+  payload_used = 0;
+}
+
+
+/* pcap_dispatch() (or, for a file read through its index,
+ * index_dispatch()), making sure nothing is left waiting in a batch
+ * when it returns */
+int capture_dispatch(pcap_t *pd, int count, pcap_handler handler)
+{
+  int rc = index_dispatch(pd, count, handler, NULL);
+
+  flush_batch();
+  return rc;
+}
@@ -0,0 +1,557 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * Where packets come from: one or more capture sources (the -i
+ * interfaces, or the -r files), all feeding the same flow table.
+ *
+ * With one source, packets are normally handled, all the way to the
+ * disk, inside libpcap's callback (see main()).  With several, or with
+ * --capture-ring, each source gets a thread of its own that does
+ * nothing but copy packets into a big ring allocated up front, and the
+ * main thread takes them out of the rings and handles them.  Whenever
+ * opening or writing a file stalls, that only fills up the rings
+ * instead of the kernel's buffers.
+ *
+ * Each ring has a single producer (its capture thread) and a single
+ * consumer (the main thread), synchronized the same way as a flow ring
+ * (see flowring.c).  When a ring is full during a live capture, the
+ * packet is dropped and counted; reading files, the capture thread
+ * waits for room instead, and packets from the files are merged in
+ * time order.  The high water mark tells how close we came to
+ * dropping, so rings can be sized against the worst bursts.
+ *
+ * libpcap handles can't be shared between threads, so while the
+ * capture threads are running, new packet filters (see filter.c) are
+ * handed to them to install.
+ */
+
+#include "tcpflow.h"
+
+extern long long capture_ring_size;
+extern int fanout_flags;
+extern volatile sig_atomic_t terminate_requested;
+
+#define LOAD_ACQUIRE(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+#define CAPTURE_IDLE_SLEEP 200	/* usecs to wait for the other side */
+#define CAPTURE_DRAIN	   64	/* packets to take from a ring at a time */
+
+/* A packet in a ring, followed by its bytes and padding up to 8 */
+struct capture_rec {
+  u_int32_t space;		/* bytes taken up, or 0 for padding up to
+				 * the end of the ring */
+  u_int32_t reserved;
+  struct pcap_pkthdr hdr;
+};
+
+#define REC_SPACE(caplen) \
+  ((sizeof(struct capture_rec) + (caplen) + 7) & ~((u_int64_t) 7))
+
+struct capture_source {
+  char *name;			/* interface or file */
+  pcap_t *pd;
+  pcap_handler handler;		/* for its datalink type */
+  int filterable;		/* packet filter can be changed */
+  pcap_t *compile_pd;		/* for compiling new filters */
+
+  /* the ring; each position is only ever written by one side */
+  u_char *ring;
+  u_int64_t size;
+  u_int64_t mask;
+  char pad0[64];
+  u_int64_t head;		/* capture thread's position */
+  char pad1[64 - sizeof(u_int64_t)];
+  u_int64_t tail;		/* main thread's position */
+  char pad2[64 - sizeof(u_int64_t)];
+  int done;			/* capture is over: 1, or -1 on error */
+  int stop;			/* the main thread wants it over */
+
+#ifdef HAVE_PTHREAD_CREATE
+  pthread_t tid;
+
+  /* a filter waiting for the capture thread to install it */
+  pthread_mutex_t filter_lock;
+  struct bpf_program pending_filter;
+  int filter_pending;
+#endif
+
+  /* written by the capture thread only */
+  long long packets_captured;
+  long long bytes_captured;
+  long long packets_dropped;
+  long long bytes_dropped;
+  u_int64_t high_water;
+  struct pcap_stat kernel_stats;
+  int have_kernel_stats;
+};
+
+static struct capture_source sources[MAX_SOURCES];
+static int num_sources;
+static int capture_live;
+static int capture_running;
+
+
+/* Add a source that has been opened and had its filter installed */
+void add_capture_source(pcap_t *pd, char *name, pcap_handler handler,
+			int filterable)
+{
+  struct capture_source *source;
+
+  if (num_sources == MAX_SOURCES)
+    die("can't capture from more than %d sources", MAX_SOURCES);
+
+  source = &sources[num_sources++];
+  memset(source, 0, sizeof(*source));
+  source->name = name;
+  source->pd = pd;
+  source->handler = handler;
+  source->filterable = filterable;
+}
+
+
+/* --fanout: join the capture socket to a Linux packet fanout group.
+ * The kernel then splits the interface's packets between all the
+ * sockets in the group by a hash of the connection, so that several
+ * processes can share a busy interface without sharing any state. */
+void join_fanout(pcap_t *pd, char *name, int group)
+{
+#if defined(HAVE_LINUX_IF_PACKET_H) && defined(PACKET_FANOUT)
+  int arg = PACKET_FANOUT_HASH;
+
+  if (fanout_flags & FANOUT_ROLLOVER)
+    arg |= PACKET_FANOUT_FLAG_ROLLOVER;
+  if (fanout_flags & FANOUT_DEFRAG)
+    arg |= PACKET_FANOUT_FLAG_DEFRAG;
+  arg = (arg << 16) | group;
+
+  if (setsockopt(pcap_fileno(pd), SOL_PACKET, PACKET_FANOUT, &arg,
+		 sizeof(arg)) < 0)
+    die("%s: can't join fanout group %d: %s", name, group, strerror(errno));
+
+  DEBUG(10) ("%s: joined fanout group %d", name, group);
+#endif
+}
+
+
+/* Give every source a ring, if we're using them */
+void init_capture_ring()
+{
+  struct capture_source *source;
+  u_int64_t size;
+
+  if (capture_ring_size == 0)
+    return;
+
+  for (size = 1024 * 1024; size < (u_int64_t) capture_ring_size; size <<= 1)
+    ;
+
+  for (source = sources; source < sources + num_sources; source++) {
+    source->size = size;
+    source->mask = size - 1;
+
+    /* touch all of it now, so the first big burst doesn't have to wait
+     * for the pages */
+    source->ring = MALLOC(u_char, size);
+    memset(source->ring, 0, size);
+  }
+
+  DEBUG(10) ("capturing into %s of %lld bytes",
+	     num_sources > 1 ? "rings" : "a ring", (long long) size);
+}
+
+
+#ifdef HAVE_PTHREAD_CREATE
+
+/* The capture thread's pcap callback: copy the packet into the ring */
+static void capture_packet(u_char *user, const struct pcap_pkthdr *h,
+			   const u_char *p)
+{
+  struct capture_source *source = (struct capture_source *) user;
+  u_int64_t head = source->head, need = REC_SPACE(h->caplen), left, used;
+  struct capture_rec *rec;
+
+  if (LOAD_ACQUIRE(&source->stop)) {
+    pcap_breakloop(source->pd);
+    return;
+  }
+
+  /* records don't wrap; if this one doesn't fit before the end of the
+   * ring, the rest of the ring is padding */
+  left = source->size - (head & source->mask);
+  if (left < need)
+    need += left;
+
+  while (head + need - LOAD_ACQUIRE(&source->tail) > source->size) {
+    if (capture_live || need > source->size) {
+      source->packets_dropped++;
+      source->bytes_dropped += h->caplen;
+      return;
+    }
+    /* nobody is going to make room */
+    if (LOAD_ACQUIRE(&source->stop)) {
+      pcap_breakloop(source->pd);
+      return;
+    }
+    usleep(CAPTURE_IDLE_SLEEP);
+  }
+
+  if (left < REC_SPACE(h->caplen)) {
+    if (left >= sizeof(struct capture_rec))
+      ((struct capture_rec *)
+       (source->ring + (head & source->mask)))->space = 0;
+    head += left;
+  }
+
+  rec = (struct capture_rec *) (source->ring + (head & source->mask));
+  rec->space = REC_SPACE(h->caplen);
+  rec->hdr = *h;
+  memcpy(rec + 1, p, h->caplen);
+  head += rec->space;
+  STORE_RELEASE(&source->head, head);
+
+  source->packets_captured++;
+  source->bytes_captured += h->caplen;
+  used = head - source->tail;
+  if (used > source->high_water)
+    source->high_water = used;
+}
+
+
+/* Put in the filter the main thread gave us, if there is one */
+static void install_pending_filter(struct capture_source *source)
+{
+  pthread_mutex_lock(&source->filter_lock);
+  if (source->filter_pending) {
+    if (pcap_setfilter(source->pd, &source->pending_filter) < 0)
+      DEBUG(1) ("warning: %s: can't install new packet filter: %s",
+		source->name, pcap_geterr(source->pd));
+    free(source->pending_filter.bf_insns);
+    source->filter_pending = 0;
+  }
+  pthread_mutex_unlock(&source->filter_lock);
+}
+
+
+static void *capture_thread(void *arg)
+{
+  struct capture_source *source = (struct capture_source *) arg;
+  struct pcap_stat stats;
+  int rc;
+
+  do {
+    install_pending_filter(source);
+    rc = index_dispatch(source->pd, -1, capture_packet, (u_char *) source);
+    if (capture_live && pcap_stats(source->pd, &stats) == 0) {
+      source->kernel_stats = stats;
+      source->have_kernel_stats = 1;
+    }
+  } while (!LOAD_ACQUIRE(&source->stop) &&
+	   (rc > 0 || (rc == 0 && capture_live)));
+
+  STORE_RELEASE(&source->done,
+		rc < 0 && !LOAD_ACQUIRE(&source->stop) ? -1 : 1);
+  return NULL;
+}
+
+
+/* Hand a packet filter to a source's capture thread, or install it
+ * right away if there isn't one */
+static int install_filter(struct capture_source *source,
+			  struct bpf_program *fcode)
+{
+  if (!capture_running)
+    return pcap_setfilter(source->pd, fcode);
+
+  pthread_mutex_lock(&source->filter_lock);
+  if (source->filter_pending)
+    free(source->pending_filter.bf_insns);
+  source->pending_filter.bf_len = fcode->bf_len;
+  source->pending_filter.bf_insns = MALLOC(struct bpf_insn, fcode->bf_len + 1);
+  memcpy(source->pending_filter.bf_insns, fcode->bf_insns,
+	 fcode->bf_len * sizeof(struct bpf_insn));
+  source->filter_pending = 1;
+  pthread_mutex_unlock(&source->filter_lock);
+
+  return 0;
+}
+
+
+/* The next packet in a source's ring, or NULL if there isn't one yet */
+static struct capture_rec *next_record(struct capture_source *source)
+{
+  u_int64_t tail = source->tail, left;
+  struct capture_rec *rec;
+
+  if (tail == LOAD_ACQUIRE(&source->head))
+    return NULL;
+
+  /* skip over the end of the ring if there's no record there */
+  left = source->size - (tail & source->mask);
+  rec = (struct capture_rec *) (source->ring + (tail & source->mask));
+  if (left < sizeof(struct capture_rec) || rec->space == 0) {
+    tail += left;
+    STORE_RELEASE(&source->tail, tail);
+    if (tail == LOAD_ACQUIRE(&source->head))
+      return NULL;
+    rec = (struct capture_rec *) source->ring;
+  }
+
+  return rec;
+}
+
+
+/* Handle a packet and give its space back to the capture thread */
+static void handle_record(struct capture_source *source,
+			  struct capture_rec *rec)
+{
+  source->handler(NULL, &rec->hdr, (u_char *) (rec + 1));
+  STORE_RELEASE(&source->tail, source->tail + rec->space);
+}
+
+
+/* Returns 1 if the source's capture thread is done and everything it
+ * captured has been handled */
+static int source_finished(struct capture_source *source)
+{
+  int done = LOAD_ACQUIRE(&source->done);
+
+  if (done < 0)
+    die("%s: %s", source->name, pcap_geterr(source->pd));
+
+  return done && next_record(source) == NULL;
+}
+
+
+/* Live: take turns with the sources, a few packets at a time.  Returns
+ * 0 if there was nothing to do. */
+static int drain_live()
+{
+  struct capture_source *source;
+  struct capture_rec *rec;
+  int i, handled = 0;
+
+  for (source = sources; source < sources + num_sources; source++) {
+    if (source_finished(source))
+      continue;
+    for (i = 0; i < CAPTURE_DRAIN && (rec = next_record(source)); i++)
+      handle_record(source, rec);
+    handled += i;
+  }
+
+  return handled;
+}
+
+
+/* Files: handle the earliest packet any of them has next.  Returns 0
+ * if we have to wait for a capture thread, and -1 when all the files
+ * are done. */
+static int drain_files()
+{
+  struct capture_source *source, *earliest = NULL;
+  struct capture_rec *rec, *earliest_rec = NULL;
+  int done, finished = 0;
+
+  for (source = sources; source < sources + num_sources; source++) {
+    done = LOAD_ACQUIRE(&source->done);
+    if (done < 0)
+      die("%s: %s", source->name, pcap_geterr(source->pd));
+
+    if ((rec = next_record(source)) == NULL) {
+      if (!done)
+	return 0;
+      finished++;
+      continue;
+    }
+
+    if (earliest == NULL || timercmp(&rec->hdr.ts, &earliest_rec->hdr.ts, <)) {
+      earliest = source;
+      earliest_rec = rec;
+    }
+  }
+
+  if (finished == num_sources)
+    return -1;
+
+  handle_record(earliest, earliest_rec);
+  return 1;
+}
+
+
+/* Start a capture thread for every source, and handle what they
+ * capture until they're all done */
+void capture_loop(int live)
+{
+  struct capture_source *source;
+  sigset_t all, old;
+  int rc;
+
+  capture_live = live;
+
+  /* signals are for the main thread */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  for (source = sources; source < sources + num_sources; source++) {
+    pthread_mutex_init(&source->filter_lock, NULL);
+    if ((errno = pthread_create(&source->tid, NULL, capture_thread,
+				source)) != 0)
+      die("can't start capture thread for %s: %s", source->name,
+	  strerror(errno));
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  capture_running = 1;
+
+  for (;;) {
+    /* a signal told us to stop; what's still in the rings is lost */
+    if (terminate_requested) {
+      stop_capture();
+      break;
+    }
+
+    rc = live ? drain_live() : drain_files();
+    if (rc < 0)
+      break;
+    if (rc == 0) {
+      /* nothing to do; don't leave anything waiting in a batch */
+      flush_batch();
+      usleep(CAPTURE_IDLE_SLEEP);
+    }
+  }
+  flush_batch();
+
+  for (source = sources; source < sources + num_sources; source++)
+    pthread_join(source->tid, NULL);
+  capture_running = 0;
+}
+
+#else /* HAVE_PTHREAD_CREATE */
+
+/* main() refuses to start capture threads without threads */
+void capture_loop(int live) { }
+
+static int install_filter(struct capture_source *source,
+			  struct bpf_program *fcode)
+{
+  return pcap_setfilter(source->pd, fcode);
+}
+
+#endif /* HAVE_PTHREAD_CREATE */
+
+
+/* Stop capturing, from the main thread: each capture thread finishes
+ * with the packet it's on, and without them, pcap_dispatch() returns
+ * as soon as the packet we're handling is done */
+void stop_capture()
+{
+  struct capture_source *source;
+
+  for (source = sources; source < sources + num_sources; source++) {
+    STORE_RELEASE(&source->stop, 1);
+    if (!capture_running)
+      pcap_breakloop(source->pd);
+  }
+}
+
+
+/* Install a new filter expression on every source that can take one.
+ * Returns -1 if it didn't work out for some of them. */
+int set_capture_filter(char *expression)
+{
+  struct capture_source *source;
+  struct bpf_program fcode;
+  int rc = 0;
+
+  for (source = sources; source < sources + num_sources; source++) {
+    if (!source->filterable)
+      continue;
+
+    /* compile on a handle of our own; the source's belongs to its
+     * capture thread */
+    if (source->compile_pd == NULL)
+      source->compile_pd = pcap_open_dead(pcap_datalink(source->pd),
+					  pcap_snapshot(source->pd));
+
+    if (pcap_compile(source->compile_pd, &fcode, expression, 1, 0) < 0) {
+      DEBUG(1) ("warning: %s: can't compile new packet filter: %s",
+		source->name, pcap_geterr(source->compile_pd));
+      rc = -1;
+      continue;
+    }
+    if (install_filter(source, &fcode) < 0) {
+      DEBUG(1) ("warning: %s: can't install new packet filter: %s",
+		source->name, pcap_geterr(source->pd));
+      rc = -1;
+    }
+    pcap_freecode(&fcode);
+  }
+
+  return rc;
+}
+
+
+/* Packets dropped so far, by the kernel or for want of room in a
+ * ring, on all sources together */
+long long capture_drops()
+{
+  struct capture_source *source;
+  struct pcap_stat stats;
+  long long drops = 0;
+
+  for (source = sources; source < sources + num_sources; source++) {
+    /* the capture thread keeps the kernel's counts for us */
+    if (!capture_running && source->ring == NULL &&
+	pcap_stats(source->pd, &stats) == 0) {
+      source->kernel_stats = stats;
+      source->have_kernel_stats = 1;
+    }
+    drops += source->packets_dropped;
+    if (source->have_kernel_stats)
+      drops += source->kernel_stats.ps_drop;
+  }
+
+  return drops;
+}
+
+
+void print_capture_stats()
+{
+  struct capture_source *source;
+  struct pcap_stat stats;
+  int level;
+
+  for (source = sources; source < sources + num_sources; source++) {
+    /* without a capture thread, we can ask libpcap ourselves */
+    if (!capture_running && source->ring == NULL &&
+	pcap_stats(source->pd, &stats) == 0) {
+      source->kernel_stats = stats;
+      source->have_kernel_stats = 1;
+    }
+
+    /* only bother people if something was dropped */
+    level = (source->packets_dropped ||
+	     (source->have_kernel_stats && (source->kernel_stats.ps_drop ||
+					    source->kernel_stats.ps_ifdrop)))
+      ? 1 : 10;
+
+    if (source->have_kernel_stats)
+      DEBUG(level) ("%s: %u packets received, %u dropped by the kernel, "
+		    "%u by the interface", source->name,
+		    source->kernel_stats.ps_recv, source->kernel_stats.ps_drop,
+		    source->kernel_stats.ps_ifdrop);
+
+    if (source->ring == NULL)
+      continue;
+    DEBUG(level) ("%s: %lld packets (%lld bytes) through the capture ring, "
+		  "%lld (%lld bytes) dropped when it was full", source->name,
+		  source->packets_captured, source->bytes_captured,
+		  source->packets_dropped, source->bytes_dropped);
+    DEBUG(level) ("%s: capture ring high water mark %lld of %lld bytes "
+		  "(%d%%)", source->name, (long long) source->high_water,
+		  (long long) source->size,
+		  (int) (source->high_water * 100 / source->size));
+  }
+}
@@ -0,0 +1,285 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * Checkpoints of the flow table (--checkpoint).  Every so often, and
+ * on the way out, we write down what we know about each flow that has
+ * a file: its addresses and ports, the ISN we settled on, how much of
+ * the file we've written, and its flags.  When tcpflow starts again
+ * with the same checkpoint file, the table is loaded back, so segments
+ * of connections that were already being recorded land at the right
+ * place in their existing files instead of truncating them.
+ *
+ * The file is a fixed header followed by an array of fixed-size
+ * records in host byte order; it's meant for restarting on the same
+ * machine, not for carrying around.  It is written to a temporary file
+ * through a shared mapping, synced to disk and renamed into place, and
+ * then the directory is synced, so a crash or a power cut in the
+ * middle of a checkpoint leaves the previous one intact.
+ */
+
+#include "tcpflow.h"
+
+extern char *checkpoint_file;
+extern int checkpoint_interval;
+
+#ifdef HAVE_SYS_MMAN_H
+
+#define CHECKPOINT_MAGIC   "tcpflck"
+#define CHECKPOINT_VERSION 1
+
+struct checkpoint_header {
+  char magic[8];
+  u_int32_t version;
+  u_int32_t count;		/* records that follow */
+  long long taken;		/* packet time of the checkpoint */
+};
+
+struct checkpoint_record {
+  flow_t flow;
+  tcp_seq isn;
+  u_int32_t flags;
+  u_int32_t unused;
+  long long size;		/* bytes in the flow's file */
+  long long start;		/* when the flow was first seen */
+};
+
+#define SAVED_FLAGS (FLOW_FINISHED | FLOW_FILE_EXISTS | FLOW_FILE_DELETED | \
+		     FLOW_REPLY)
+
+static time_t last_packet;	/* timestamp of the newest packet seen */
+static time_t next_checkpoint;
+
+struct fill_state {
+  struct checkpoint_record *rec;
+  u_int32_t count;
+};
+
+
+/* Only flows that got as far as having a file are worth keeping */
+static int worth_saving(flow_state_t *flow_state)
+{
+  return IS_SET(flow_state->flags, FLOW_FILE_EXISTS | FLOW_FILE_DELETED);
+}
+
+
+static void count_flow(flow_state_t *flow_state, void *arg)
+{
+  if (worth_saving(flow_state))
+    (*(u_int32_t *) arg)++;
+}
+
+
+static void fill_record(flow_state_t *flow_state, void *arg)
+{
+  struct fill_state *fill = (struct fill_state *) arg;
+  struct checkpoint_record *rec;
+
+  if (!worth_saving(flow_state))
+    return;
+
+  rec = &fill->rec[fill->count++];
+  rec->flow = flow_state->flow;
+  rec->isn = flow_state->tcp->isn;
+  rec->flags = flow_state->flags & SAVED_FLAGS;
+  rec->unused = 0;
+  rec->size = flow_state->size;
+  rec->start = flow_state->tcp->start.tv_sec;
+}
+
+
+/* Load the flow table from the checkpoint file, if there is one.
+ * Must be called after the flow table and the writer are set up. */
+void load_checkpoint()
+{
+  struct checkpoint_header *hdr;
+  struct checkpoint_record *rec;
+  flow_state_t *flow_state;
+  struct timeval tv;
+  struct stat st;
+  void *map;
+  u_int32_t i, restored = 0;
+  int fd;
+
+  if (checkpoint_file == NULL)
+    return;
+
+  if ((fd = open(checkpoint_file, O_RDONLY)) < 0) {
+    if (errno != ENOENT)
+      die("can't open checkpoint %s: %s", checkpoint_file, strerror(errno));
+    DEBUG(10) ("no checkpoint in %s yet; starting fresh", checkpoint_file);
+    return;
+  }
+
+  if (fstat(fd, &st) < 0)
+    die("can't stat checkpoint %s: %s", checkpoint_file, strerror(errno));
+
+  if (st.st_size < (off_t) sizeof(*hdr)) {
+    DEBUG(1) ("warning: checkpoint %s is truncated; ignoring it",
+	      checkpoint_file);
+    close(fd);
+    return;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    die("can't map checkpoint %s: %s", checkpoint_file, strerror(errno));
+
+  hdr = (struct checkpoint_header *) map;
+  rec = (struct checkpoint_record *) (hdr + 1);
+
+  if (memcmp(hdr->magic, CHECKPOINT_MAGIC, sizeof(hdr->magic)) ||
+      hdr->version != CHECKPOINT_VERSION ||
+      st.st_size != (off_t) (sizeof(*hdr) + hdr->count * sizeof(*rec))) {
+    DEBUG(1) ("warning: %s is not a usable checkpoint; ignoring it",
+	      checkpoint_file);
+    munmap(map, st.st_size);
+    return;
+  }
+
+  for (i = 0; i < hdr->count; i++, rec++) {
+    if (find_flow_state(rec->flow) != NULL)
+      continue;
+
+    tv.tv_sec = (time_t) rec->start;
+    tv.tv_usec = 0;
+    flow_state = create_flow_state(rec->flow, rec->isn, &tv);
+    flow_state->flags = (rec->flags & SAVED_FLAGS) | FLOW_RESTORED |
+      FLOW_CONTINUED;
+    if (IS_SET(flow_state->flags, FLOW_FINISHED))
+      SET_BIT(flow_state->flags, FLOW_LISTED); /* by the last run */
+    flow_state->size = (long) rec->size;
+    adopt_flow(flow_state);
+    restored++;
+  }
+
+  DEBUG(10) ("restored %u flows from checkpoint %s", restored,
+	     checkpoint_file);
+
+  munmap(map, st.st_size);
+}
+
+
+/* Sync the directory a file is in, so that a rename into it sticks */
+static int sync_directory(char *path)
+{
+  char *slash = strrchr(path, '/');
+  int len = slash ? slash - path + 1 : 0;
+  char *dir = MALLOC(char, len + 2);
+  int fd, rc = -1;
+
+  /* everything up to and including the last slash, or "." */
+  if (len > 0)
+    memcpy(dir, path, len);
+  else
+    dir[len++] = '.';
+  dir[len] = '\0';
+
+  if ((fd = open(dir, O_RDONLY)) >= 0) {
+    rc = fsync(fd);
+    close(fd);
+  }
+  free(dir);
+  return rc;
+}
+
+
+/* Write the flow table out to the checkpoint file */
+void save_checkpoint()
+{
+  struct checkpoint_header *hdr;
+  struct fill_state fill;
+  char *tmpname;
+  u_int32_t count = 0;
+  size_t len;
+  void *map;
+  int fd;
+
+  if (checkpoint_file == NULL)
+    return;
+
+  for_each_flow_state(count_flow, &count);
+  len = sizeof(*hdr) + count * sizeof(struct checkpoint_record);
+
+  tmpname = MALLOC(char, strlen(checkpoint_file) + 5);
+  sprintf(tmpname, "%s.tmp", checkpoint_file);
+
+  if ((fd = open(tmpname, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0) {
+    DEBUG(1) ("can't write checkpoint %s: %s", tmpname, strerror(errno));
+    free(tmpname);
+    return;
+  }
+
+  if (ftruncate(fd, len) < 0 ||
+      (map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0))
+      == MAP_FAILED) {
+    DEBUG(1) ("can't write checkpoint %s: %s", tmpname, strerror(errno));
+    close(fd);
+    unlink(tmpname);
+    free(tmpname);
+    return;
+  }
+
+  hdr = (struct checkpoint_header *) map;
+  fill.rec = (struct checkpoint_record *) (hdr + 1);
+  fill.count = 0;
+  for_each_flow_state(fill_record, &fill);
+
+  hdr->version = CHECKPOINT_VERSION;
+  hdr->count = fill.count;
+  hdr->taken = last_packet;
+  memcpy(hdr->magic, CHECKPOINT_MAGIC, sizeof(hdr->magic));
+
+  /* it all has to be on the disk before it takes the old one's place */
+  if (msync(map, len, MS_SYNC) < 0 || fsync(fd) < 0) {
+    DEBUG(1) ("can't write checkpoint %s: %s", tmpname, strerror(errno));
+    munmap(map, len);
+    close(fd);
+    unlink(tmpname);
+    free(tmpname);
+    return;
+  }
+  munmap(map, len);
+  close(fd);
+
+  if (rename(tmpname, checkpoint_file) < 0) {
+    DEBUG(1) ("can't replace checkpoint %s: %s", checkpoint_file,
+	      strerror(errno));
+    unlink(tmpname);
+  } else {
+    if (sync_directory(checkpoint_file) < 0)
+      DEBUG(1) ("warning: can't sync the directory of %s: %s",
+		checkpoint_file, strerror(errno));
+    DEBUG(20) ("checkpointed %u flows to %s", fill.count, checkpoint_file);
+  }
+
+  free(tmpname);
+}
+
+
+/* Called for every packet; takes a checkpoint whenever another
+ * --checkpoint-interval seconds of packet time have gone by */
+void checkpoint_tick(struct timeval *tv)
+{
+  last_packet = tv->tv_sec;
+
+  if (next_checkpoint == 0) {
+    next_checkpoint = last_packet + checkpoint_interval;
+  } else if (last_packet >= next_checkpoint) {
+    save_checkpoint();
+    next_checkpoint = last_packet + checkpoint_interval;
+  }
+}
+
+#else /* HAVE_SYS_MMAN_H */
+
+/* main() refuses --checkpoint without mmap(), so these never run */
+void load_checkpoint() { }
+void save_checkpoint() { }
+void checkpoint_tick(struct timeval *tv) { }
+
+#endif /* HAVE_SYS_MMAN_H */
@@ -0,0 +1,131 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * The payload on its way out: -s and -o turn what doesn't print into
+ * '.', and -t and -x start every line with the packet's time.  With
+ * -c, that's as far as it goes; each packet is printed to the console
+ * as it comes, and nothing is reassembled or stored.
+ */
+
+#include "tcpflow.h"
+
+extern int console_only;
+extern int strip_nonprint;
+extern int print_time_per_line;
+extern int print_datetime_per_line;
+extern int strip_nr;
+
+#define TM_BUFFER_LENGTH 40
+
+static char tm_buffer[TM_BUFFER_LENGTH];
+
+
+/* A packet's payload, formatted for the console or its file.  The
+ * result is only good until the next packet. */
+const u_char *format_payload(packet_t *packet, u_int32_t *length)
+{
+  if (print_time_per_line) {
+    format_timestamp(tm_buffer, TM_BUFFER_LENGTH, &packet->tv, 0);
+  }
+  else if (print_datetime_per_line) {
+    format_timestamp(tm_buffer, TM_BUFFER_LENGTH, &packet->tv, 1);
+  }
+
+  /* store the length of the data */
+  *length = packet->length;
+  return do_formatting(packet->data, packet->length, length, tm_buffer);
+}
+
+
+/* With -c, print a packet and return 1; otherwise leave it to be
+ * stored, and return 0 */
+int console_packet(packet_t *packet)
+{
+  u_int32_t length;
+  const u_char *data;
+
+  if (!console_only)
+    return 0;
+
+  data = format_payload(packet, &length);
+  print_packet(packet->flow, data, length, tm_buffer);
+  return 1;
+}
+
+
+/* convert all non-printable characters to '.' (period).  not
+ * thread-safe, obviously, but neither is most of the rest of this. */
+u_char *do_formatting(const u_char *data, u_int32_t length, u_int32_t* b_length, const char* tm_buffer)
+{
+  u_int32_t tmp_length = 0;
+  u_int32_t size_of_tm_buffer = strlen(tm_buffer);
+
+  static u_char buf[SNAPLEN];
+  u_char *write_ptr;
+
+  write_ptr = buf;
+  while (length) {
+    if ((strip_nonprint && !(isprint(*data) || *data == '\n' || *data == '\r'))
+      || (strip_nr && (*data == '\n' || *data == '\r'))) {
+      *write_ptr = '.';
+    }
+    else {
+      *write_ptr = *data;
+    }
+    write_ptr++;
+    tmp_length++;
+    if (!strip_nr && ((print_time_per_line || print_datetime_per_line) && (*data == '\n'))) {
+      memcpy(write_ptr, tm_buffer,size_of_tm_buffer);
+      write_ptr += size_of_tm_buffer;
+      tmp_length += size_of_tm_buffer;
+    }
+    data++;
+    length--;
+  }
+
+  *b_length = tmp_length;
+
+  return buf;
+}
+
+/* added timestamp. */
+u_char *print_time(const u_char *data, u_int32_t length, u_int32_t* b_length, const char* tm_buffer)
+{
+  static u_char buf[SNAPLEN];
+  u_char *write_ptr;
+  u_int32_t tmp_length = 0;
+  u_int32_t size_of_tm_buffer = strlen(tm_buffer);
+  write_ptr = buf;
+  while (length) {
+    *write_ptr = *data;
+    write_ptr++;
+    tmp_length++;
+    if (*data == '\n') {
+      memcpy(write_ptr, tm_buffer,size_of_tm_buffer);
+      write_ptr += size_of_tm_buffer;
+      tmp_length += size_of_tm_buffer;
+    }
+    data++;
+    length--;
+  }
+
+  *b_length = tmp_length;
+
+  return buf;
+}
+
+/* print the contents of this packet to the console */
+void print_packet(flow_t flow, const u_char *data, u_int32_t length, const char* tm_buffer)
+{
+  if (print_time_per_line || print_datetime_per_line) {
+    printf("%s", tm_buffer);
+  }
+  printf("%s: ", flow_filename(flow));
+  fwrite(data, length, 1, stdout);
+  putchar('\n');
+  fflush(stdout);
+}
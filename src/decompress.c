@@ -0,0 +1,520 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * Compressed capture files.  A -r file that starts like a gzip or zstd
+ * file is decompressed as it's read, by threads of its own, so that
+ * decompressing it and taking the packets apart go on at the same
+ * time.  The threads put the data into a queue of big chunks, in order,
+ * and libpcap reads it from there through a stdio stream of our own
+ * making (fopencookie()), with no pipe or other process in between.
+ *
+ * A zstd file made of several frames (as written by pzstd, or by
+ * concatenating compressed files) whose frames all say how big they
+ * are is decompressed a frame at a time by several threads at once;
+ * each frame is a chunk.  Anything else is decompressed by one thread
+ * into chunks of CHUNK_SIZE.  The queue holds at most a few chunks
+ * that the reader hasn't got to yet, so memory use is bounded however
+ * big the file.
+ */
+
+#include "tcpflow.h"
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+# include <zlib.h>
+# define READ_GZIP
+#endif
+
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+# include <zstd.h>
+# define READ_ZSTD
+#endif
+
+#if defined(HAVE_PTHREAD_CREATE) && defined(HAVE_FOPENCOOKIE)
+# define READ_COMPRESSED
+#endif
+
+#define FORMAT_GZIP	1
+#define FORMAT_ZSTD	2
+
+#ifdef READ_COMPRESSED
+
+#define CHUNK_SIZE	(1024 * 1024)	/* decompressed by one thread */
+#define QUEUE_LEN	16		/* most chunks waiting to be read */
+#define MAX_WORKERS	8		/* threads for a multi-frame file */
+#define MAX_FRAME	(16 * 1024 * 1024) /* biggest frame done in parallel */
+#define READ_BUFFER	(64 * 1024)	/* stdio's buffer on the stream */
+
+struct chunk {
+  u_char *data;
+  size_t len;
+  long long seq;		/* its place in the file */
+  int full;
+};
+
+typedef struct compressed_input {
+  char *name;
+  int format;
+  int fd;
+  const u_char *map;		/* zstd: all of the file */
+  size_t map_len;
+
+  /* zstd frames, for decompressing in parallel */
+  size_t *frame_start;
+  size_t *frame_len;
+  long long num_frames;
+  long long next_frame;		/* the next one a worker should take */
+
+  pthread_t threads[MAX_WORKERS];
+  int num_threads;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct chunk queue[QUEUE_LEN];
+  int window;			/* chunks allowed ahead of the reader */
+  long long next_read;		/* the chunk the reader wants next */
+  long long total;		/* chunks in the file, once known, or -1 */
+  int error;
+  int closing;
+
+  /* the chunk being read */
+  u_char *cur;
+  size_t cur_len;
+  size_t cur_pos;
+} compressed_input;
+
+#endif /* READ_COMPRESSED */
+
+static int files_read;
+static long long compressed_bytes;
+static long long decompressed_bytes;
+static long long frames_in_parallel;
+
+
+/* gzip, zstd, or neither? */
+static int compression_format(char *path)
+{
+  u_char magic[4];
+  FILE *fp;
+  int n;
+
+  if ((fp = fopen(path, "rb")) == NULL)
+    return 0;
+  n = fread(magic, 1, sizeof(magic), fp);
+  fclose(fp);
+
+  if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+    return FORMAT_GZIP;
+  if (n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f &&
+      magic[3] == 0xfd)
+    return FORMAT_ZSTD;
+  return 0;
+}
+
+
+#ifdef READ_COMPRESSED
+
+/* Hand the reader chunk 'seq', waiting for room in the queue.  Returns
+ * -1 if the reader has gone away. */
+static int put_chunk(compressed_input *z, long long seq, u_char *data,
+		     size_t len)
+{
+  struct chunk *c = &z->queue[seq % QUEUE_LEN];
+
+  pthread_mutex_lock(&z->lock);
+  while (!z->closing && seq >= z->next_read + z->window)
+    pthread_cond_wait(&z->cond, &z->lock);
+  if (z->closing) {
+    pthread_mutex_unlock(&z->lock);
+    free(data);
+    return -1;
+  }
+
+  c->data = data;
+  c->len = len;
+  c->seq = seq;
+  c->full = 1;
+  pthread_cond_broadcast(&z->cond);
+  pthread_mutex_unlock(&z->lock);
+  return 0;
+}
+
+
+/* The decompressing is over: there were 'total' chunks, or an error */
+static void end_chunks(compressed_input *z, long long total, int error)
+{
+  pthread_mutex_lock(&z->lock);
+  if (error)
+    z->error = 1;
+  else
+    z->total = total;
+  pthread_cond_broadcast(&z->cond);
+  pthread_mutex_unlock(&z->lock);
+}
+
+
+#ifdef READ_GZIP
+static void *gzip_thread(void *arg)
+{
+  compressed_input *z = (compressed_input *) arg;
+  long long seq = 0;
+  u_char *data;
+  gzFile gz;
+  int n, error = 0;
+
+  if ((gz = gzdopen(z->fd, "rb")) == NULL) {
+    end_chunks(z, 0, 1);
+    return NULL;
+  }
+  gzbuffer(gz, 256 * 1024);
+
+  for (;;) {
+    data = MALLOC(u_char, CHUNK_SIZE);
+    if ((n = gzread(gz, data, CHUNK_SIZE)) <= 0) {
+      if (n < 0) {
+	DEBUG(1) ("error decompressing %s: %s", z->name, gzerror(gz, &n));
+	error = 1;
+      }
+      free(data);
+      break;
+    }
+    if (put_chunk(z, seq++, data, n) < 0)
+      break;
+  }
+
+  /* a file cut short just runs out */
+  if (!error) {
+    gzerror(gz, &n);
+    if (n == Z_BUF_ERROR)
+      DEBUG(1) ("warning: %s ends in the middle of a compressed block",
+		z->name);
+  }
+
+  gzclose(gz);
+  z->fd = -1;
+  end_chunks(z, seq, error);
+  return NULL;
+}
+#endif /* READ_GZIP */
+
+
+#ifdef READ_ZSTD
+/* One thread, streaming through the file a chunk at a time */
+static void *zstd_thread(void *arg)
+{
+  compressed_input *z = (compressed_input *) arg;
+  ZSTD_DStream *ds = ZSTD_createDStream();
+  ZSTD_inBuffer in;
+  ZSTD_outBuffer out;
+  long long seq = 0;
+  size_t rc = 0;
+  int done = 0, error = 0;
+
+  in.src = z->map;
+  in.size = z->map_len;
+  in.pos = 0;
+  ZSTD_initDStream(ds);
+
+  while (!done) {
+    out.dst = MALLOC(u_char, CHUNK_SIZE);
+    out.size = CHUNK_SIZE;
+    out.pos = 0;
+
+    /* the input is all there; stop when there's no more to come out */
+    while (out.pos < out.size) {
+      rc = ZSTD_decompressStream(ds, &out, &in);
+      if (ZSTD_isError(rc)) {
+	DEBUG(1) ("error decompressing %s: %s", z->name,
+		  ZSTD_getErrorName(rc));
+	error = done = 1;
+	break;
+      }
+      if (in.pos == in.size && out.pos < out.size) {
+	done = 1;
+	break;
+      }
+    }
+
+    if (out.pos == 0) {
+      free(out.dst);
+    } else if (put_chunk(z, seq++, out.dst, out.pos) < 0) {
+      break;
+    }
+  }
+
+  if (done && !error && rc != 0)
+    DEBUG(1) ("warning: %s ends in the middle of a frame", z->name);
+
+  ZSTD_freeDStream(ds);
+  end_chunks(z, seq, error);
+  return NULL;
+}
+
+
+/* One of several threads, each decompressing whole frames */
+static void *zstd_worker(void *arg)
+{
+  compressed_input *z = (compressed_input *) arg;
+  ZSTD_DCtx *dctx = ZSTD_createDCtx();
+  unsigned long long size;
+  long long frame;
+  u_char *data;
+  size_t rc;
+
+  for (;;) {
+    pthread_mutex_lock(&z->lock);
+    frame = z->next_frame++;
+    pthread_mutex_unlock(&z->lock);
+    if (frame >= z->num_frames)
+      break;
+
+    size = ZSTD_getFrameContentSize(z->map + z->frame_start[frame],
+				    z->frame_len[frame]);
+    data = MALLOC(u_char, size ? size : 1);
+    rc = ZSTD_decompressDCtx(dctx, data, size, z->map + z->frame_start[frame],
+			     z->frame_len[frame]);
+    if (ZSTD_isError(rc) || rc != size) {
+      DEBUG(1) ("error decompressing %s: %s", z->name,
+		ZSTD_isError(rc) ? ZSTD_getErrorName(rc) : "wrong size");
+      free(data);
+      end_chunks(z, 0, 1);
+      break;
+    }
+
+    if (put_chunk(z, frame, data, rc) < 0)
+      break;
+  }
+
+  ZSTD_freeDCtx(dctx);
+  return NULL;
+}
+
+
+/* Find the frames of a zstd file.  Returns the number of them if
+ * they can be decompressed in parallel, or 0 if not. */
+static long long find_frames(compressed_input *z)
+{
+  unsigned long long size;
+  size_t offset = 0, len;
+  long long count = 0, room = 0;
+
+  while (offset < z->map_len) {
+    len = ZSTD_findFrameCompressedSize(z->map + offset, z->map_len - offset);
+    if (ZSTD_isError(len))
+      return 0;
+    size = ZSTD_getFrameContentSize(z->map + offset, len);
+    if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR ||
+	size > MAX_FRAME)
+      return 0;
+
+    if (count == room) {
+      room = room ? room * 2 : 64;
+      z->frame_start = realloc(z->frame_start, room * sizeof(size_t));
+      z->frame_len = realloc(z->frame_len, room * sizeof(size_t));
+      if (z->frame_start == NULL || z->frame_len == NULL)
+	die("out of memory reading %s", z->name);
+    }
+    z->frame_start[count] = offset;
+    z->frame_len[count] = len;
+    count++;
+    offset += len;
+  }
+
+  return count;
+}
+#endif /* READ_ZSTD */
+
+
+/* libpcap wants more of the file */
+static ssize_t read_compressed(void *cookie, char *buf, size_t size)
+{
+  compressed_input *z = (compressed_input *) cookie;
+  struct chunk *c;
+  size_t n;
+
+  while (z->cur_pos == z->cur_len) {
+    free(z->cur);
+    z->cur = NULL;
+    z->cur_len = z->cur_pos = 0;
+
+    pthread_mutex_lock(&z->lock);
+    c = &z->queue[z->next_read % QUEUE_LEN];
+    while (!(c->full && c->seq == z->next_read) &&
+	   z->next_read != z->total && !z->error)
+      pthread_cond_wait(&z->cond, &z->lock);
+
+    if (!(c->full && c->seq == z->next_read)) {
+      pthread_mutex_unlock(&z->lock);
+      if (!z->error)
+	return 0;
+      errno = EIO;
+      return -1;
+    }
+
+    z->cur = c->data;
+    z->cur_len = c->len;
+    c->full = 0;
+    c->data = NULL;
+    z->next_read++;
+    pthread_cond_broadcast(&z->cond);
+    pthread_mutex_unlock(&z->lock);
+    decompressed_bytes += z->cur_len;
+  }
+
+  n = z->cur_len - z->cur_pos;
+  if (n > size)
+    n = size;
+  memcpy(buf, z->cur + z->cur_pos, n);
+  z->cur_pos += n;
+  return n;
+}
+
+
+static int close_compressed(void *cookie)
+{
+  compressed_input *z = (compressed_input *) cookie;
+  int i;
+
+  pthread_mutex_lock(&z->lock);
+  z->closing = 1;
+  pthread_cond_broadcast(&z->cond);
+  pthread_mutex_unlock(&z->lock);
+  for (i = 0; i < z->num_threads; i++)
+    pthread_join(z->threads[i], NULL);
+
+  for (i = 0; i < QUEUE_LEN; i++)
+    free(z->queue[i].data);
+  free(z->cur);
+  free(z->frame_start);
+  free(z->frame_len);
+  if (z->map != NULL)
+    munmap((void *) z->map, z->map_len);
+  if (z->fd >= 0)
+    close(z->fd);
+  pthread_mutex_destroy(&z->lock);
+  pthread_cond_destroy(&z->cond);
+  free(z);
+  return 0;
+}
+
+#endif /* READ_COMPRESSED */
+
+
+/* If 'path' is a compressed file, start decompressing it and return a
+ * stream of what comes out, for pcap_fopen_offline().  Returns NULL if
+ * it isn't. */
+FILE *open_compressed(char *path)
+{
+  int format = compression_format(path);
+#ifdef READ_COMPRESSED
+  cookie_io_functions_t io;
+  compressed_input *z;
+  struct stat st;
+  void *(*thread)(void *) = NULL;
+  FILE *fp;
+#endif
+
+  if (format == 0)
+    return NULL;
+
+#ifndef READ_GZIP
+  if (format == FORMAT_GZIP)
+    die("%s is compressed with gzip, and this tcpflow was built without "
+	"zlib", path);
+#endif
+#ifndef READ_ZSTD
+  if (format == FORMAT_ZSTD)
+    die("%s is compressed with zstd, and this tcpflow was built without "
+	"libzstd", path);
+#endif
+
+#ifndef READ_COMPRESSED
+  die("%s is compressed; can't read compressed files on this system", path);
+  return NULL;
+#else
+  z = MALLOC(compressed_input, 1);
+  memset(z, 0, sizeof(*z));
+  z->name = path;
+  z->format = format;
+  z->total = -1;
+  z->window = QUEUE_LEN;
+  pthread_mutex_init(&z->lock, NULL);
+  pthread_cond_init(&z->cond, NULL);
+
+  if ((z->fd = open(path, O_RDONLY)) < 0 || fstat(z->fd, &st) < 0)
+    die("can't open %s: %s", path, strerror(errno));
+  compressed_bytes += st.st_size;
+  files_read++;
+
+#ifdef READ_GZIP
+  if (format == FORMAT_GZIP)
+    thread = gzip_thread;
+#endif
+
+#ifdef READ_ZSTD
+  if (format == FORMAT_ZSTD) {
+    long cpus;
+    int i;
+
+    z->map_len = st.st_size;
+    z->map = mmap(NULL, z->map_len, PROT_READ, MAP_PRIVATE, z->fd, 0);
+    if (z->map == MAP_FAILED)
+      die("can't map %s: %s", path, strerror(errno));
+    madvise((void *) z->map, z->map_len, MADV_SEQUENTIAL);
+    close(z->fd);
+    z->fd = -1;
+
+    /* leave a processor for taking the packets apart */
+    cpus = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    if (cpus > 1 && (z->num_frames = find_frames(z)) > 1) {
+      z->num_threads = cpus < MAX_WORKERS ? cpus : MAX_WORKERS;
+      if (z->num_threads > z->num_frames)
+	z->num_threads = z->num_frames;
+      z->window = z->num_threads + 2;
+      z->total = z->num_frames;
+      frames_in_parallel += z->num_frames;
+      DEBUG(10) ("%s: decompressing %lld frames with %d threads", path,
+		 z->num_frames, z->num_threads);
+      for (i = 0; i < z->num_threads; i++)
+	if (pthread_create(&z->threads[i], NULL, zstd_worker, z) != 0)
+	  die("can't start decompression thread: %s", strerror(errno));
+    } else {
+      thread = zstd_thread;
+    }
+  }
+#endif
+
+  if (thread != NULL) {
+    z->num_threads = 1;
+    if (pthread_create(&z->threads[0], NULL, thread, z) != 0)
+      die("can't start decompression thread: %s", strerror(errno));
+  }
+
+  memset(&io, 0, sizeof(io));
+  io.read = read_compressed;
+  io.close = close_compressed;
+  if ((fp = fopencookie(z, "r", io)) == NULL)
+    die("can't read %s: %s", path, strerror(errno));
+  setvbuf(fp, NULL, _IOFBF, READ_BUFFER);
+
+  DEBUG(10) ("%s: decompressing %s input", path,
+	     format == FORMAT_GZIP ? "gzip" : "zstd");
+  return fp;
+#endif /* READ_COMPRESSED */
+}
+
+
+void print_decompress_stats()
+{
+  if (files_read == 0)
+    return;
+
+  DEBUG(10) ("decompressed %lld bytes from %lld in %d files",
+	     decompressed_bytes, compressed_bytes, files_read);
+  if (frames_in_parallel)
+    DEBUG(10) ("decompressed %lld zstd frames in parallel",
+	       frames_in_parallel);
+}
@@ -0,0 +1,146 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * Duplicate packet suppression (--dedup).  A SPAN port that mirrors
+ * both ingress and egress hands us most packets twice, and every copy
+ * would otherwise be written to its flow file all over again.  As
+ * soon as a packet is decoded, we boil it down to a signature (IP ID,
+ * addresses and ports, sequence number, length and a hash of the
+ * payload) and look for the same signature among those we've seen in
+ * the last 'dedup_window' microseconds.  Copies are dropped before
+ * any flow state is touched.
+ *
+ * The signatures live in a fixed-size open-addressed table; a slot
+ * whose signature is older than the window is free to be reused, and
+ * when all of a signature's candidate slots are busy, the oldest one
+ * loses.  So with a flood of packets we might miss a duplicate, but
+ * never drop a packet we haven't seen.  A retransmission carries a new
+ * IP ID and usually comes long after the window, so it's kept.
+ */
+
+#include "tcpflow.h"
+
+extern long dedup_window;
+
+#define DEDUP_SLOTS	(1 << 16)	/* must be a power of two */
+#define DEDUP_PROBES	4		/* slots a signature may go in */
+
+typedef struct {
+  unsigned long long signature;
+  long long when;		/* microseconds; 0 for an empty slot */
+} dedup_slot;
+
+static dedup_slot *slots;
+
+static long long packets_checked;
+static long long duplicates;
+static long long duplicate_bytes;
+
+
+void init_dedup()
+{
+  int i;
+
+  if (dedup_window == 0)
+    return;
+
+  slots = MALLOC(dedup_slot, DEDUP_SLOTS);
+  for (i = 0; i < DEDUP_SLOTS; i++)
+    slots[i].when = 0;
+
+  DEBUG(10) ("suppressing duplicate packets seen within %ld usec",
+	     dedup_window);
+}
+
+
+/* Mix a word into a 64-bit hash */
+#define MIX(h, w) ((h) = ((h) ^ (w)) * 0x100000001b3ULL)
+
+static unsigned long long packet_signature(packet_t *packet)
+{
+  unsigned long long h = 0xcbf29ce484222325ULL;
+  unsigned long long word;
+  const u_char *p = packet->data;
+  u_int32_t left = packet->length;
+
+  MIX(h, packet->ip_id);
+  MIX(h, ((unsigned long long) packet->flow.src << 32) | packet->flow.dst);
+  MIX(h, ((unsigned long long) packet->flow.sport << 16) | packet->flow.dport);
+  MIX(h, ((unsigned long long) packet->seq << 32) | packet->length);
+
+  /* the payload, a word at a time */
+  for (; left >= sizeof(word); p += sizeof(word), left -= sizeof(word)) {
+    memcpy(&word, p, sizeof(word));
+    MIX(h, word);
+  }
+  if (left > 0) {
+    word = 0;
+    memcpy(&word, p, left);
+    MIX(h, word);
+  }
+
+  /* spread the last few words over the bits we index by */
+  return h ^ (h >> 29);
+}
+
+
+/* Returns 1 if we've seen this packet within the window, in which case
+ * it should be ignored; otherwise remembers it and returns 0. */
+int duplicate_packet(packet_t *packet)
+{
+  unsigned long long signature = packet_signature(packet);
+  long long now = (long long) packet->tv.tv_sec * 1000000 + packet->tv.tv_usec;
+  dedup_slot *slot, *victim = NULL;
+  int victim_live = 0;
+  long long age;
+  int i;
+
+  packets_checked++;
+
+  for (i = 0; i < DEDUP_PROBES; i++) {
+    slot = &slots[(signature + i) & (DEDUP_SLOTS - 1)];
+
+    /* sources merged from several interfaces may be slightly out of
+     * order, so the copy we saw first could look newer */
+    age = now - slot->when;
+    if (age < 0)
+      age = -age;
+
+    if (slot->when == 0 || age > dedup_window) {
+      /* an empty or stale slot is the best place for a new signature */
+      if (victim == NULL || victim_live) {
+	victim = slot;
+	victim_live = 0;
+      }
+    } else if (slot->signature == signature) {
+      duplicates++;
+      duplicate_bytes += packet->length;
+      DEBUG(50) ("dropped duplicate packet on %s",
+		 flow_filename(packet->flow));
+      PROBE_DROP(packet->flow, packet->seq, packet->length,
+		 PROBE_DROP_DUPLICATE);
+      return 1;
+    } else if (victim == NULL || (victim_live && slot->when < victim->when)) {
+      victim = slot;
+      victim_live = 1;
+    }
+  }
+
+  victim->signature = signature;
+  victim->when = now ? now : 1;
+  return 0;
+}
+
+
+void print_dedup_stats()
+{
+  if (dedup_window == 0)
+    return;
+
+  DEBUG(10) ("duplicate packets suppressed: %lld of %lld (%lld bytes)",
+	     duplicates, packets_checked, duplicate_bytes);
+}
@@ -0,0 +1,609 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * Native packet filtering for offline replays (--fast-filter).  When
+ * reading files, libpcap runs the filter program through its BPF
+ * interpreter for every record.  Most of the expressions we see are
+ * made of hosts, nets and ports, so we parse those ourselves into a
+ * little tree and match decoded packets against it directly.  A run
+ * of "or"s over hosts or ports is folded into a single hash set or
+ * port bitmap, so a filter listing a thousand hosts costs one lookup.
+ *
+ * We only understand a subset of the language:
+ *
+ *   [src|dst] host a.b.c.d
+ *   [src|dst] net a.b.c.d/len | net a.b[.c[.d]] | net a.b.c.d mask m.m.m.m
+ *   [tcp] [src|dst] port n | portrange n-m
+ *   tcp, ip
+ *
+ * joined with and, or, not (&&, ||, !) and parentheses.  Anything
+ * else, and we leave the expression to libpcap as before.  Packets
+ * that don't carry TCP data never get this far, so "tcp" and "ip"
+ * always match.
+ */
+
+#include "tcpflow.h"
+
+extern int fast_filter;
+
+#define FF_SRC		(1 << 0)
+#define FF_DST		(1 << 1)
+#define FF_EITHER	(FF_SRC | FF_DST)
+
+enum {
+  FF_TRUE,
+  FF_NOT,
+  FF_AND,
+  FF_OR,
+  FF_NET,		/* host is a net with a /32 mask */
+  FF_PORTRANGE,		/* port is a range of one */
+  FF_HOSTSET,
+  FF_PORTSET
+};
+
+typedef struct ff_node {
+  int type;
+  int dir;			/* FF_SRC, FF_DST or FF_EITHER */
+  u_int32_t addr, mask;		/* FF_NET */
+  u_int16_t lo, hi;		/* FF_PORTRANGE */
+  struct ff_node *left, *right;	/* FF_NOT (left only), FF_AND, FF_OR */
+  u_int32_t *hosts;		/* FF_HOSTSET: open-addressed table */
+  u_int32_t host_mask;		/*   its size - 1 */
+  int host_shift;		/*   32 - log2(size) */
+  int has_zero;			/*   0.0.0.0 is in the set */
+  u_char *ports;		/* FF_PORTSET: bitmap of 65536 ports */
+} ff_node;
+
+static ff_node *root;
+
+static long long packets_checked;
+static long long packets_matched;
+
+/* the expression being parsed, split into words */
+static char **tokens;
+static int num_tokens;
+static int next_token;
+
+
+/*************************************************************************/
+
+/* Split an expression into words; parentheses and '!' are words of
+ * their own even without spaces around them */
+static void tokenize(char *expression)
+{
+  char *p = expression;
+  int max_tokens = strlen(expression) + 1;
+
+  tokens = MALLOC(char *, max_tokens);
+  num_tokens = next_token = 0;
+
+  while (*p != '\0') {
+    char *start = p;
+
+    if (isspace((int) *p)) {
+      p++;
+      continue;
+    }
+    if (*p == '(' || *p == ')' || (*p == '!' && p[1] != '=')) {
+      p++;
+    } else {
+      while (*p != '\0' && !isspace((int) *p) && *p != '(' && *p != ')')
+	p++;
+    }
+    tokens[num_tokens] = MALLOC(char, p - start + 1);
+    memcpy(tokens[num_tokens], start, p - start);
+    tokens[num_tokens][p - start] = '\0';
+    num_tokens++;
+  }
+}
+
+
+static void free_tokens()
+{
+  int i;
+
+  for (i = 0; i < num_tokens; i++)
+    free(tokens[i]);
+  free(tokens);
+  tokens = NULL;
+}
+
+
+static char *peek()
+{
+  return next_token < num_tokens ? tokens[next_token] : "";
+}
+
+
+static int accept_token(char *word)
+{
+  if (strcmp(peek(), word))
+    return 0;
+  next_token++;
+  return 1;
+}
+
+
+/* Parse a dotted quad, or as many leading octets of one as are there.
+ * Returns the number of octets, or 0 if it's not an address. */
+static int parse_addr(char *s, u_int32_t *addr)
+{
+  int octets = 0;
+  long n;
+  char *end;
+
+  *addr = 0;
+  for (;;) {
+    if (!isdigit((int) *s))
+      return 0;
+    n = strtol(s, &end, 10);
+    if (n > 255 || octets == 4)
+      return 0;
+    *addr |= n << (24 - 8 * octets++);
+    if (*end == '\0')
+      return octets;
+    if (*end != '.')
+      return 0;
+    s = end + 1;
+  }
+}
+
+
+static int parse_port(char *s, u_int16_t *port)
+{
+  long n;
+  char *end;
+
+  if (!isdigit((int) *s))
+    return 0;
+  n = strtol(s, &end, 10);
+  if (*end != '\0' || n > 65535)
+    return 0;
+  *port = n;
+  return 1;
+}
+
+
+static ff_node *new_node(int type)
+{
+  ff_node *node = MALLOC(ff_node, 1);
+
+  memset(node, 0, sizeof(ff_node));
+  node->type = type;
+  node->dir = FF_EITHER;
+  return node;
+}
+
+
+static void free_tree(ff_node *node)
+{
+  if (node == NULL)
+    return;
+  free_tree(node->left);
+  free_tree(node->right);
+  if (node->hosts != NULL)
+    free(node->hosts);
+  if (node->ports != NULL)
+    free(node->ports);
+  free(node);
+}
+
+
+/* host, net, port or portrange, after any qualifiers */
+static ff_node *parse_primitive(int dir)
+{
+  ff_node *node;
+  char *word = peek();
+  int octets;
+
+  if (!strcmp(word, "host")) {
+    next_token++;
+    node = new_node(FF_NET);
+    if (parse_addr(peek(), &node->addr) != 4)
+      goto fail;
+    next_token++;
+    node->mask = 0xffffffff;
+  } else if (!strcmp(word, "net")) {
+    char *slash;
+
+    next_token++;
+    node = new_node(FF_NET);
+    word = peek();
+    if ((slash = strchr(word, '/')) != NULL) {
+      char *end;
+      long len = strtol(slash + 1, &end, 10);
+
+      *slash = '\0';
+      octets = parse_addr(word, &node->addr);
+      *slash = '/';
+      if (octets == 0 || *end != '\0' || end == slash + 1 || len > 32)
+	goto fail;
+      node->mask = len ? 0xffffffff << (32 - len) : 0;
+      next_token++;
+    } else {
+      if ((octets = parse_addr(word, &node->addr)) == 0)
+	goto fail;
+      next_token++;
+      if (accept_token("mask")) {
+	if (octets != 4 || parse_addr(peek(), &node->mask) != 4)
+	  goto fail;
+	next_token++;
+      } else {
+	node->mask = 0xffffffff << (32 - 8 * octets);
+      }
+    }
+    /* like libpcap, refuse a net with host bits set */
+    if (node->addr & ~node->mask)
+      goto fail;
+  } else if (!strcmp(word, "port")) {
+    next_token++;
+    node = new_node(FF_PORTRANGE);
+    if (!parse_port(peek(), &node->lo))
+      goto fail;
+    next_token++;
+    node->hi = node->lo;
+  } else if (!strcmp(word, "portrange")) {
+    char *dash;
+    int ok;
+
+    next_token++;
+    node = new_node(FF_PORTRANGE);
+    if ((dash = strchr(peek(), '-')) == NULL)
+      goto fail;
+    *dash = '\0';
+    ok = parse_port(peek(), &node->lo) && parse_port(dash + 1, &node->hi);
+    *dash = '-';
+    if (!ok || node->lo > node->hi)
+      goto fail;
+    next_token++;
+  } else {
+    return NULL;
+  }
+
+  node->dir = dir;
+  return node;
+
+ fail:
+  free(node);
+  return NULL;
+}
+
+
+static ff_node *parse_expression();
+
+/* A primitive (with its qualifiers), a negation or a parenthesized
+ * expression */
+static ff_node *parse_term()
+{
+  ff_node *node, *negated;
+  int dir = FF_EITHER;
+
+  if (accept_token("not") || accept_token("!")) {
+    if ((negated = parse_term()) == NULL)
+      return NULL;
+    node = new_node(FF_NOT);
+    node->left = negated;
+    return node;
+  }
+
+  if (accept_token("(")) {
+    if ((node = parse_expression()) == NULL)
+      return NULL;
+    if (!accept_token(")")) {
+      free_tree(node);
+      return NULL;
+    }
+    return node;
+  }
+
+  /* a protocol qualifier we can ignore, or a protocol by itself */
+  if (!strcmp(peek(), "tcp") || !strcmp(peek(), "ip")) {
+    next_token++;
+    if (strcmp(peek(), "src") && strcmp(peek(), "dst") &&
+	strcmp(peek(), "host") && strcmp(peek(), "net") &&
+	strcmp(peek(), "port") && strcmp(peek(), "portrange"))
+      return new_node(FF_TRUE);
+  }
+
+  if (accept_token("src"))
+    dir = FF_SRC;
+  else if (accept_token("dst"))
+    dir = FF_DST;
+
+  return parse_primitive(dir);
+}
+
+
+/* Terms joined by and/or; like libpcap, these have the same
+ * precedence and group left to right */
+static ff_node *parse_expression()
+{
+  ff_node *node, *right, *joined;
+  int type;
+
+  if ((node = parse_term()) == NULL)
+    return NULL;
+
+  for (;;) {
+    if (accept_token("and") || accept_token("&&"))
+      type = FF_AND;
+    else if (accept_token("or") || accept_token("||"))
+      type = FF_OR;
+    else
+      return node;
+
+    if ((right = parse_term()) == NULL) {
+      free_tree(node);
+      return NULL;
+    }
+    joined = new_node(type);
+    joined->left = node;
+    joined->right = right;
+    node = joined;
+  }
+}
+
+
+/*************************************************************************/
+
+/* the top bits of a multiplicative hash */
+#define HOST_HASH(set, addr) \
+  (((u_int32_t) ((addr) * 2654435761U)) >> (set)->host_shift)
+
+static void add_host(ff_node *set, u_int32_t addr)
+{
+  u_int32_t i;
+
+  if (addr == 0) {
+    set->has_zero = 1;
+    return;
+  }
+  for (i = HOST_HASH(set, addr); set->hosts[i] != 0;
+       i = (i + 1) & set->host_mask)
+    if (set->hosts[i] == addr)
+      return;
+  set->hosts[i] = addr;
+}
+
+
+static int match_host(ff_node *set, u_int32_t addr)
+{
+  u_int32_t i;
+
+  if (addr == 0)
+    return set->has_zero;
+  for (i = HOST_HASH(set, addr); set->hosts[i] != 0;
+       i = (i + 1) & set->host_mask)
+    if (set->hosts[i] == addr)
+      return 1;
+  return 0;
+}
+
+
+/* Gather the operands of a run of "or"s */
+static void collect_or(ff_node *node, ff_node **list, int *count)
+{
+  if (node->type == FF_OR) {
+    collect_or(node->left, list, count);
+    collect_or(node->right, list, count);
+    free(node);
+  } else {
+    list[(*count)++] = node;
+  }
+}
+
+
+static int count_or(ff_node *node)
+{
+  if (node->type == FF_OR)
+    return count_or(node->left) + count_or(node->right);
+  return 1;
+}
+
+
+/* Fold the hosts and ports in a run of "or"s into one set for each
+ * direction, and put the run back together */
+static ff_node *fold_sets(ff_node *node)
+{
+  ff_node **list, *host_sets[FF_EITHER + 1], *port_sets[FF_EITHER + 1];
+  ff_node *result = NULL, *joined;
+  int num_hosts[FF_EITHER + 1], num_ports[FF_EITHER + 1];
+  int count = 0, size, i, dir;
+
+  if (node->type == FF_NOT || node->type == FF_AND) {
+    node->left = fold_sets(node->left);
+    if (node->right != NULL)
+      node->right = fold_sets(node->right);
+    return node;
+  }
+  if (node->type != FF_OR)
+    return node;
+
+  list = MALLOC(ff_node *, count_or(node));
+  collect_or(node, list, &count);
+
+  memset(host_sets, 0, sizeof(host_sets));
+  memset(port_sets, 0, sizeof(port_sets));
+  memset(num_hosts, 0, sizeof(num_hosts));
+  memset(num_ports, 0, sizeof(num_ports));
+
+  /* a set only pays off with more than one member */
+  for (i = 0; i < count; i++)
+    if (list[i]->type == FF_NET && list[i]->mask == 0xffffffff)
+      num_hosts[list[i]->dir]++;
+    else if (list[i]->type == FF_PORTRANGE)
+      num_ports[list[i]->dir]++;
+
+  for (i = 0; i < count; i++) {
+    ff_node *item = list[i];
+
+    dir = item->dir;
+    if (item->type == FF_NET && item->mask == 0xffffffff &&
+	num_hosts[dir] > 1) {
+      if (host_sets[dir] == NULL) {
+	host_sets[dir] = new_node(FF_HOSTSET);
+	for (size = 4, host_sets[dir]->host_shift = 30;
+	     size < 2 * num_hosts[dir]; size *= 2)
+	  host_sets[dir]->host_shift--;
+	host_sets[dir]->dir = dir;
+	host_sets[dir]->hosts = MALLOC(u_int32_t, size);
+	memset(host_sets[dir]->hosts, 0, size * sizeof(u_int32_t));
+	host_sets[dir]->host_mask = size - 1;
+      }
+      add_host(host_sets[dir], item->addr);
+      free(item);
+      list[i] = NULL;
+    } else if (item->type == FF_PORTRANGE && num_ports[dir] > 1) {
+      int port;
+
+      if (port_sets[dir] == NULL) {
+	port_sets[dir] = new_node(FF_PORTSET);
+	port_sets[dir]->dir = dir;
+	port_sets[dir]->ports = MALLOC(u_char, 65536 / 8);
+	memset(port_sets[dir]->ports, 0, 65536 / 8);
+      }
+      for (port = item->lo; port <= item->hi; port++)
+	port_sets[dir]->ports[port >> 3] |= 1 << (port & 7);
+      free(item);
+      list[i] = NULL;
+    } else {
+      list[i] = fold_sets(item);
+    }
+  }
+
+  /* the sets go first; they're the cheapest to check */
+  for (dir = 0; dir <= FF_EITHER; dir++) {
+    ff_node *sets[2];
+
+    sets[0] = host_sets[dir];
+    sets[1] = port_sets[dir];
+    for (i = 0; i < 2; i++) {
+      if (sets[i] == NULL)
+	continue;
+      if (result == NULL) {
+	result = sets[i];
+      } else {
+	joined = new_node(FF_OR);
+	joined->left = result;
+	joined->right = sets[i];
+	result = joined;
+      }
+    }
+  }
+  for (i = 0; i < count; i++) {
+    if (list[i] == NULL)
+      continue;
+    if (result == NULL) {
+      result = list[i];
+    } else {
+      joined = new_node(FF_OR);
+      joined->left = result;
+      joined->right = list[i];
+      result = joined;
+    }
+  }
+
+  free(list);
+  return result;
+}
+
+
+/*************************************************************************/
+
+#define PORT_SET(ports, port) ((ports)[(port) >> 3] & (1 << ((port) & 7)))
+
+static int match_node(ff_node *node, flow_t *flow)
+{
+  switch (node->type) {
+  case FF_TRUE:
+    return 1;
+  case FF_NOT:
+    return !match_node(node->left, flow);
+  case FF_AND:
+    return match_node(node->left, flow) && match_node(node->right, flow);
+  case FF_OR:
+    return match_node(node->left, flow) || match_node(node->right, flow);
+  case FF_NET:
+    return ((node->dir & FF_SRC) && (flow->src & node->mask) == node->addr) ||
+      ((node->dir & FF_DST) && (flow->dst & node->mask) == node->addr);
+  case FF_PORTRANGE:
+    return ((node->dir & FF_SRC) &&
+	    flow->sport >= node->lo && flow->sport <= node->hi) ||
+      ((node->dir & FF_DST) &&
+       flow->dport >= node->lo && flow->dport <= node->hi);
+  case FF_HOSTSET:
+    return ((node->dir & FF_SRC) && match_host(node, flow->src)) ||
+      ((node->dir & FF_DST) && match_host(node, flow->dst));
+  case FF_PORTSET:
+    return ((node->dir & FF_SRC) && PORT_SET(node->ports, flow->sport)) ||
+      ((node->dir & FF_DST) && PORT_SET(node->ports, flow->dport));
+  }
+
+  return 0;
+}
+
+
+/* Try to compile the user's filter expression (NULL if there isn't
+ * one) for matching here.  Returns 1 if we can take over from libpcap;
+ * otherwise turns --fast-filter off and returns 0. */
+int init_fast_filter(char *expression)
+{
+  if (!fast_filter)
+    return 0;
+
+  if (expression == NULL) {
+    root = new_node(FF_TRUE);
+  } else {
+    tokenize(expression);
+    root = parse_expression();
+    if (root != NULL && next_token < num_tokens) {
+      free_tree(root);
+      root = NULL;
+    }
+    free_tokens();
+  }
+
+  if (root == NULL) {
+    DEBUG(1) ("warning: expression is too complex to match natively; "
+	      "leaving it to libpcap");
+    fast_filter = 0;
+    return 0;
+  }
+
+  root = fold_sets(root);
+  DEBUG(10) ("matching packets against the filter expression natively");
+  return 1;
+}
+
+
+/* Would the filter pass this flow's packets?  (For choosing flows out
+ * of an index, so not counted as packets checked.) */
+int fast_filter_wants(flow_t *flow)
+{
+  return match_node(root, flow);
+}
+
+
+/* Does this packet pass the filter? */
+int fast_filter_match(flow_t *flow)
+{
+  packets_checked++;
+  if (!match_node(root, flow))
+    return 0;
+  packets_matched++;
+  return 1;
+}
+
+
+void print_fast_filter_stats()
+{
+  if (!fast_filter)
+    return;
+
+  DEBUG(10) ("packets matching the filter expression: %lld of %lld",
+	     packets_matched, packets_checked);
+}
@@ -0,0 +1,215 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * Packets of finished flows.  Once a flow has all we want of it (-b,
+ * or the writer gave up on it), handle_packet() drops the rest of its
+ * packets before doing anything with their payload, and we count them
+ * here.
+ *
+ * With --refilter n, we also go one step further: every
+ * REFILTER_INTERVAL seconds, the n finished flows that have sent us
+ * the most lately are written into the packet filter as exceptions,
+ * so that the kernel stops handing them to us at all.  What each flow
+ * has sent is halved every time, so a flow that's busy now can take
+ * the place of one that was busy a while ago (including one that's
+ * been left out, and so has sent us nothing since).  Flows that have
+ * seen a FIN or RST won't be sending much more, and aren't chosen.
+ */
+
+#include "tcpflow.h"
+
+extern int refilter_flows;
+
+static char *base_expression;	/* the filter we were started with */
+static char *current_expression; /* what's installed now, or NULL */
+static flow_state_t **heaviest;
+static int num_heaviest;
+static time_t next_refilter;
+
+static long long late_packets;	/* packets of finished flows */
+static long long late_bytes;
+static int refilters;		/* times we've installed a new filter */
+static int flows_excluded;	/* flows in the filter we installed last */
+
+
+/* Remember what the packet filter started out as, if we're going to
+ * be changing it.  'expression' is NULL if none of our capture sources
+ * can be filtered. */
+void init_refilter(char *expression)
+{
+  if (refilter_flows == 0)
+    return;
+
+  if (expression == NULL) {
+    DEBUG(1) ("warning: packet filter can't be used here; --refilter ignored");
+    refilter_flows = 0;
+    return;
+  }
+
+  base_expression = expression;
+  heaviest = MALLOC(flow_state_t *, refilter_flows);
+
+  DEBUG(10) ("excluding up to %d finished flows in the packet filter",
+	     refilter_flows);
+}
+
+
+/* A packet arrived for a flow that's already finished */
+void count_late_packet(flow_state_t *flow_state, u_int32_t length)
+{
+  flow_state->late_bytes += length;
+  late_packets++;
+  late_bytes += length;
+}
+
+
+/* Keep the refilter_flows heaviest finished flows in 'heaviest' */
+static void rank_flow(flow_state_t *flow_state, void *arg)
+{
+  flow_state_t *other = reverse_flow_state(flow_state);
+  int i, lightest;
+
+  if (!IS_SET(flow_state->flags, FLOW_FINISHED) ||
+      flow_state->late_bytes == 0 ||
+      IS_SET(flow_state->flags, FLOW_SAW_FIN | FLOW_SAW_RST) ||
+      (other != NULL && IS_SET(other->flags, FLOW_SAW_RST)))
+    return;
+
+  if (num_heaviest < refilter_flows) {
+    heaviest[num_heaviest++] = flow_state;
+    return;
+  }
+
+  lightest = 0;
+  for (i = 1; i < num_heaviest; i++)
+    if (heaviest[i]->late_bytes < heaviest[lightest]->late_bytes)
+      lightest = i;
+
+  if (flow_state->late_bytes > heaviest[lightest]->late_bytes)
+    heaviest[lightest] = flow_state;
+}
+
+
+/* Make what a flow sent before count half as much as what it sends
+ * from now on */
+static void decay_flow(flow_state_t *flow_state, void *arg)
+{
+  flow_state->late_bytes /= 2;
+}
+
+
+/* Order flows by address, so the same set always makes the same
+ * expression */
+static int compare_flows(const void *a, const void *b)
+{
+  const flow_t *fa = &(*(flow_state_t **) a)->flow;
+  const flow_t *fb = &(*(flow_state_t **) b)->flow;
+
+  return memcmp(fa, fb, sizeof(flow_t));
+}
+
+
+static char *format_ip(u_int32_t addr, char *buf)
+{
+  sprintf(buf, "%u.%u.%u.%u", (addr >> 24) & 0xff, (addr >> 16) & 0xff,
+	  (addr >> 8) & 0xff, addr & 0xff);
+  return buf;
+}
+
+
+/* Build the filter expression that leaves out the flows in 'heaviest' */
+static char *build_expression()
+{
+  char src[16], dst[16];
+  char *expression, *p;
+  int i;
+
+  /* the flows we left out have all ended */
+  if (num_heaviest == 0) {
+    expression = MALLOC(char, strlen(base_expression) + 1);
+    return strcpy(expression, base_expression);
+  }
+
+  expression = MALLOC(char, strlen(base_expression) + 20 +
+		      num_heaviest * 100);
+  p = expression + sprintf(expression, "(%s) and not (", base_expression);
+
+  for (i = 0; i < num_heaviest; i++) {
+    flow_t *flow = &heaviest[i]->flow;
+
+    p += sprintf(p, "%s(src host %s and dst host %s and "
+		 "src port %d and dst port %d)", i ? " or " : "",
+		 format_ip(flow->src, src), format_ip(flow->dst, dst),
+		 (int) flow->sport, (int) flow->dport);
+  }
+  strcpy(p, ")");
+
+  return expression;
+}
+
+
+/* Install a new packet filter if the heaviest finished flows have
+ * changed since the last one */
+static void refilter()
+{
+  char *expression;
+
+  num_heaviest = 0;
+  for_each_flow_state(rank_flow, NULL);
+  for_each_flow_state(decay_flow, NULL);
+  if (num_heaviest == 0 && current_expression == NULL)
+    return;
+
+  qsort(heaviest, num_heaviest, sizeof(flow_state_t *), compare_flows);
+  expression = build_expression();
+
+  if (current_expression != NULL && !strcmp(expression, current_expression)) {
+    free(expression);
+    return;
+  }
+
+  /* if the new filter doesn't work out, we'll try again next time */
+  if (set_capture_filter(expression) < 0) {
+    free(expression);
+    return;
+  }
+
+  DEBUG(20) ("new filter expression: '%s'", expression);
+  DEBUG(5) ("packet filter now excludes %d finished flows", num_heaviest);
+
+  if (current_expression != NULL)
+    free(current_expression);
+  current_expression = expression;
+  flows_excluded = num_heaviest;
+  refilters++;
+}
+
+
+/* Called for every packet; looks at the filter again whenever another
+ * REFILTER_INTERVAL seconds of packet time have gone by */
+void refilter_tick(struct timeval *tv)
+{
+  if (next_refilter == 0) {
+    next_refilter = tv->tv_sec + REFILTER_INTERVAL;
+  } else if (tv->tv_sec >= next_refilter) {
+    refilter();
+    next_refilter = tv->tv_sec + REFILTER_INTERVAL;
+  }
+}
+
+
+void print_filter_stats()
+{
+  if (late_packets == 0 && refilters == 0)
+    return;
+
+  DEBUG(10) ("packets of finished flows ignored: %lld (%lld bytes)",
+	     late_packets, late_bytes);
+  if (refilter_flows)
+    DEBUG(10) ("packet filter replaced %d times, now excludes %d flows",
+	       refilters, flows_excluded);
+}
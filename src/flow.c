@@ -17,101 +17,300 @@
 
 #include "tcpflow.h"
 
+extern int bytes_per_flow;
+extern int stats_only;
+
+/* The flow table is libtcpflow's; each flow's flow_user is its
+ * flow_state_t.  Flows are remembered for as long as we run. */
+tcpflow_ctx *flow_table;
+
 static int max_fds;
 static int next_slot;
 static int current_time;
 static flow_state_t **fd_ring;
-static flow_state_t *flow_hash[HASH_SIZE];
 
 
 /* Initialize our structures */
 void init_flow_state()
 {
+  struct tcpflow_callbacks callbacks;
   int i;
 
   /* Find out how many files we can have open safely...subtract 4 for
    * stdin, stdout, stderr, and the packet filter; one for breathing
    * room (we open new files before closing old ones), and one more to
-   * be safe. */
+   * be safe.  Directories we keep open for the output tree count too. */
   max_fds = get_max_fds() - NUM_RESERVED_FDS;
+  max_fds -= reserve_dir_fds(max_fds);
 
   fd_ring = MALLOC(flow_state_t *, max_fds);
 
   for (i = 0; i < max_fds; i++)
     fd_ring[i] = NULL;
 
-  for (i = 0; i < HASH_SIZE; i++)
-    flow_hash[i] = NULL;
+  /* each segment is passed on as soon as it comes, at its offset:
+   * stored (tcpip.c), or with --stats-only, counted (accounting.c) */
+  memset(&callbacks, 0, sizeof(callbacks));
+  if (stats_only) {
+    callbacks.open = start_counting;
+    callbacks.data = count_segment;
+  } else {
+    callbacks.open = start_flow;
+    callbacks.data = store_segment;
+    callbacks.close = finish_flow;
+  }
+
+  if ((flow_table = tcpflow_new(&callbacks, NULL)) == NULL)
+    die("out of memory");
+  tcpflow_set_unordered(flow_table, 1);
+  tcpflow_set_linger(flow_table, -1);
+  if (!stats_only)
+    tcpflow_set_max_bytes(flow_table, bytes_per_flow);
 
   next_slot = -1;
   current_time = 0;
 }
 
 
+/* The other direction of a flow */
+static flow_t reverse_flow(flow_t flow)
+{
+  flow_t reverse;
+
+  reverse.src = flow.dst;
+  reverse.dst = flow.src;
+  reverse.sport = flow.dport;
+  reverse.dport = flow.sport;
+
+  return reverse;
+}
+
 
-/* Create a new flow state structure, initialize its contents, and add
- * it to its hash bucket.  It is prepended to the hash bucket because
- * 1) doing so is fast (requiring constant time regardless of bucket
- * size; and 2) it'll tend to make lookups faster for more recently
- * added state, which will probably be more often used state.
+/* Create a new flow state structure for a flow libtcpflow has just
+ * started, and initialize its contents.  Called from the open
+ * callbacks, which set it as the flow's flow_user.
  *
  * Returns a pointer to the new state. */
-flow_state_t *create_flow_state(flow_t flow, tcp_seq isn)
+flow_state_t *new_flow_state(const struct tcpflow_flow *tcp)
 {
-  /* create space for the new state */
   flow_state_t *new_flow = MALLOC(flow_state_t, 1);
-
-  /* determine where in the hash this goes */
-  int index = HASH_FLOW(flow);
-
-  /* link it in to the hash bucket at the beginning */
-  new_flow->next = flow_hash[index];
-  flow_hash[index] = new_flow;
+  flow_state_t *other;
 
   /* initialize contents of the state structure */
-  new_flow->flow = flow;
-  new_flow->isn = isn;
+  new_flow->tcp = tcp;
+  new_flow->flow.src = tcp->src;
+  new_flow->flow.dst = tcp->dst;
+  new_flow->flow.sport = tcp->sport;
+  new_flow->flow.dport = tcp->dport;
   new_flow->fp = NULL;
   new_flow->pos = 0;
+  new_flow->size = 0;
+  new_flow->allocated = 0;
+  new_flow->direct = NULL;
   new_flow->flags = 0;
   new_flow->last_access = current_time++;
+  new_flow->filename = NULL;
+  new_flow->shard = -1;
+  new_flow->next_done = NULL;
+  new_flow->late_bytes = 0;
+  new_flow->ngrams = NULL;
+  new_flow->stats = NULL;
+
+  /* the connection's --combined file, if the other direction has
+   * started one */
+  other = reverse_flow_state(new_flow);
+  new_flow->combined = other != NULL ? other->combined : NULL;
+
+  DEBUG(5) ("%s: new flow", flow_filename(new_flow->flow));
+
+  return new_flow;
+}
+
+
+/* Start a flow at 'isn', as if its SYN had come at 'tv', starting
+ * over if we've seen it before.  Returns a pointer to its new
+ * state. */
+flow_state_t *create_flow_state(flow_t flow, tcp_seq isn, struct timeval *tv)
+{
+  void *new_flow;
 
-  DEBUG(5) ("%s: new flow", flow_filename(flow));
+  if (tcpflow_add_flow(flow_table, flow.src, flow.dst, flow.sport,
+		       flow.dport, isn, tv, &new_flow) == NULL)
+    die("out of memory");
 
   return new_flow;
 }
 
 
+/* The state of the other direction of a flow's connection, if we've
+ * seen it */
+flow_state_t *reverse_flow_state(flow_state_t *flow_state)
+{
+  void *other;
+
+  if (tcpflow_reverse_flow(flow_table, flow_state->tcp, &other) == NULL)
+    return NULL;
+  return other;
+}
+
+
+/* With --combined, the state of the one file both directions of a
+ * connection go into.  It's named after the direction we saw first. */
+flow_state_t *combined_flow_state(flow_state_t *flow_state)
+{
+  flow_state_t *combined = flow_state->combined;
+  flow_state_t *other;
+
+  if (combined == NULL) {
+    combined = flow_state->combined = MALLOC(flow_state_t, 1);
+    *combined = *flow_state;
+    if (IS_SET(flow_state->flags, FLOW_REPLY))
+      combined->flow = reverse_flow(flow_state->flow);
+    combined->fp = NULL;
+    combined->pos = 0;
+    combined->size = 0;
+    combined->allocated = 0;
+    combined->direct = NULL;
+    combined->flags = 0;
+    combined->filename = NULL;
+    combined->shard = -1;
+    combined->next_done = NULL;
+    combined->late_bytes = 0;
+    combined->combined = NULL;
+    combined->ngrams = NULL;
+    combined->stats = NULL;
+
+    if ((other = reverse_flow_state(flow_state)) != NULL)
+      other->combined = combined;
+  }
+
+  combined->last_access = current_time++;
+  return combined;
+}
+
+
+/* Start pulling a flow's hash bucket into the cache, ahead of
+ * find_flow_state() */
+void prefetch_flow_bucket(flow_t flow)
+{
+  tcpflow_prefetch_bucket(flow_table, flow.src, flow.dst, flow.sport,
+			  flow.dport);
+}
+
+
+/* ...and then the first connection in the bucket.  Best done a while
+ * after prefetch_flow_bucket(), since we have to read the bucket to
+ * know where the connection is. */
+void prefetch_flow_state(flow_t flow)
+{
+  tcpflow_prefetch_flow(flow_table, flow.src, flow.dst, flow.sport,
+			flow.dport);
+}
+
+
+struct each_flow {
+  void (*fn)(flow_state_t *, void *);
+  void *arg;
+};
+
+static void call_each_flow(const struct tcpflow_flow *tcp, void *flow_user,
+			   void *arg)
+{
+  struct each_flow *each = arg;
+
+  each->fn(flow_user, each->arg);
+}
+
+
+/* Call fn on every flow we know about, in no particular order */
+void for_each_flow_state(void (*fn)(flow_state_t *, void *), void *arg)
+{
+  struct each_flow each;
+
+  each.fn = fn;
+  each.arg = arg;
+  tcpflow_for_each_flow(flow_table, call_each_flow, &each);
+}
+
+
 /* Find previously a previously created flow state structure by
- * jumping to its hash bucket, and linearly searching everything in
- * the bucket.  Returns NULL if the state is not found. */
+ * finding its connection, with one lookup for both directions.
+ * Returns NULL if the state is not found. */
 flow_state_t *find_flow_state(flow_t flow)
 {
-  flow_state_t *ptr;
-  int index = HASH_FLOW(flow);
+  void *state;
+
+  if (tcpflow_find_flow(flow_table, flow.src, flow.dst, flow.sport,
+			flow.dport, &state) == NULL)
+    return NULL;
+
+  ((flow_state_t *) state)->last_access = current_time++;
+  return state;
+}
 
-  for (ptr = flow_hash[index]; ptr != NULL; ptr = ptr->next)
-    if (!memcmp((char *) &flow, (char *) &(ptr->flow), sizeof(flow))) {
-      ptr->last_access = current_time++;
-      return ptr;
-    }
 
-  return NULL;
+/* Hand a packet to the flow table, with 'data' for its payload (as
+ * formatted, perhaps), to be passed on to the callbacks */
+void feed_packet(packet_t *packet, const u_char *data, u_int32_t length)
+{
+  struct tcpflow_segment seg;
+
+  memset(&seg, 0, sizeof(seg));
+  seg.src = packet->flow.src;
+  seg.dst = packet->flow.dst;
+  seg.sport = packet->flow.sport;
+  seg.dport = packet->flow.dport;
+  seg.seq = packet->seq;
+  seg.ip_id = packet->ip_id;
+  seg.flags = packet->tcp_flags;
+  seg.window = packet->window;
+  seg.data = data;
+  seg.length = length;
+
+  if (tcpflow_feed_segment(flow_table, &seg, &packet->tv) < 0)
+    die("out of memory");
 }
 
 
+/* How much the flow table has had to cut out of retransmissions */
+void print_flow_stats()
+{
+  struct tcpflow_stats stats;
+
+  tcpflow_get_stats(flow_table, &stats);
+  DEBUG(10) ("retransmissions: %llu segments dropped (%llu bytes), "
+	     "%llu trimmed (%llu bytes)",
+	     (unsigned long long) stats.retransmitted,
+	     (unsigned long long) stats.retransmitted_bytes,
+	     (unsigned long long) stats.trimmed,
+	     (unsigned long long) stats.trimmed_bytes);
+}
+
 
 FILE *attempt_fopen(flow_state_t *flow_state, char *filename)
 {
+  int fd;
+
   /* If we've opened this file already, reopen it.  Otherwise create a
    * new file.  We purposefully overwrite files from previous runs of
    * the program. */
   if (IS_SET(flow_state->flags, FLOW_FILE_EXISTS)) {
     DEBUG(5) ("%s: re-opening output file", filename);
-    flow_state->fp = fopen(filename, "r+");
+    fd = open_flow_file(flow_state, O_RDWR);
+    /* a flow restored from a checkpoint may have lost its file since */
+    if (fd < 0 && errno == ENOENT)
+      fd = open_flow_file(flow_state, O_RDWR | O_CREAT);
   } else {
     DEBUG(5) ("%s: opening new output file", filename);
-    flow_state->fp = fopen(filename, "w");
+    fd = open_flow_file(flow_state, O_RDWR | O_CREAT | O_TRUNC);
+  }
+
+  if (fd < 0) {
+    flow_state->fp = NULL;
+  } else if ((flow_state->fp = fdopen(fd, "r+")) == NULL) {
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
   }
 
   return flow_state->fp;
@@ -120,7 +319,7 @@ FILE *attempt_fopen(flow_state_t *flow_state, char *filename)
 
 FILE *open_file(flow_state_t *flow_state)
 {
-  char *filename = flow_filename(flow_state->flow);
+  char *filename = flow_path(flow_state);
   int done;
 
   /* This shouldn't be called if the file is already open */
@@ -178,16 +377,21 @@ FILE *open_file(flow_state_t *flow_state)
   }
 
   /* close the next one in line */
-  if (fd_ring[next_slot] != NULL)
-    close_file(fd_ring[next_slot]);
+  if (fd_ring[next_slot] != NULL && close_file(fd_ring[next_slot])) {
+    PROBE_FILE_EVICT(fd_ring[next_slot]->flow, max_fds);
+  }
 
   /* put ourslves in its place */
   fd_ring[next_slot] = flow_state;
+  PROBE_FILE_OPEN(flow_state->flow, filename, next_slot);
 
   /* set flags and remember where in the file we are */
   SET_BIT(flow_state->flags, FLOW_FILE_EXISTS);
   FGETPOS(flow_state->fp, &(flow_state->pos));
 
+  /* let the writer set up preallocation and direct I/O */
+  prepare_flow_file(flow_state);
+
   return flow_state->fp;
 }
 
@@ -200,8 +404,10 @@ int close_file(flow_state_t *flow_state)
   if (flow_state->fp == NULL)
     return 0;
 
-  DEBUG(5) ("%s: closing file", flow_filename(flow_state->flow));
-  /* close the file and remember that it's closed */
+  DEBUG(5) ("%s: closing file", flow_path(flow_state));
+  /* write out anything the writer is holding, then close the file
+   * and remember that it's closed */
+  release_flow_file(flow_state);
   fclose(flow_state->fp);
   flow_state->fp = NULL;
   flow_state->pos = 0;
@@ -268,7 +474,9 @@ void contract_fd_ring()
   }
 
   /* close the oldest FD */
-  close_file(fd_ring[0]);
+  if (close_file(fd_ring[0])) {
+    PROBE_FILE_EVICT(fd_ring[0]->flow, max_fds);
+  }
 
   /* shift everything forward by one and count */
   for (i = 1; i < max_fds && fd_ring[i] != NULL; i++)
@@ -282,3 +490,24 @@ void contract_fd_ring()
 }
 
 
+/* Call fn on every flow that has its file open */
+void for_each_open_file(void (*fn)(flow_state_t *))
+{
+  int i;
+
+  for (i = 0; i < max_fds; i++)
+    if (fd_ring[i] != NULL && fd_ring[i]->fp != NULL)
+      fn(fd_ring[i]);
+}
+
+
+/* Close every file we have open.  Called on the way out, so that
+ * nothing the writer is holding on to gets lost. */
+void close_all_files()
+{
+  int i;
+
+  for (i = 0; i < max_fds; i++)
+    if (fd_ring[i] != NULL)
+      close_file(fd_ring[i]);
+}
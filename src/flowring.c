@@ -0,0 +1,309 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * Flow rings in POSIX shared memory; see flowring.h.
+ *
+ * The producer owns 'head' and the consumer owns 'tail'.  Each side
+ * reads the other's with acquire semantics and publishes its own with
+ * release semantics, which is all the synchronization a
+ * single-producer, single-consumer ring needs.  A record never wraps
+ * around the end of the data area: if it doesn't fit in what's left,
+ * the rest of the area is covered with a FLOWRING_PAD record (or, if
+ * there isn't even room for a header, simply skipped by both sides).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "conf.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "flowring.h"
+
+#define LOAD_ACQUIRE(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+#define REC_SPACE(len) \
+  ((sizeof(struct flowring_rec) + (len) + FLOWRING_ALIGN - 1) & \
+   ~((uint64_t) FLOWRING_ALIGN - 1))
+
+#if !defined(HAVE_CONFIG_H) || defined(HAVE_SHM_OPEN)
+
+static flowring_t *map_ring(int fd, size_t maplen, int producer)
+{
+  flowring_t *ring;
+  void *map;
+
+  map = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  if ((ring = malloc(sizeof(*ring))) == NULL) {
+    munmap(map, maplen);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  ring->ctl = (struct flowring_ctl *) map;
+  ring->data = (unsigned char *) map + sizeof(struct flowring_ctl);
+  ring->maplen = maplen;
+  ring->producer = producer;
+  ring->next = 0;
+  return ring;
+}
+
+
+/* Create the ring 'name' (as for shm_open) with at least 'size' bytes
+ * of data area, replacing any ring of that name.  Returns NULL with
+ * errno set on failure. */
+flowring_t *flowring_create(const char *name, size_t size)
+{
+  struct flowring_ctl *ctl;
+  flowring_t *ring;
+  uint64_t actual = 4096;
+  size_t maplen;
+  int fd, saved_errno;
+
+  while (actual < size)
+    actual <<= 1;
+  maplen = sizeof(struct flowring_ctl) + actual;
+
+  shm_unlink(name);
+  if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0)
+    return NULL;
+
+  if (ftruncate(fd, maplen) < 0 || (ring = map_ring(fd, maplen, 1)) == NULL) {
+    saved_errno = errno;
+    close(fd);
+    shm_unlink(name);
+    errno = saved_errno;
+    return NULL;
+  }
+  close(fd);
+
+  ctl = ring->ctl;
+  memset(&ctl->info, 0, sizeof(ctl->info));
+  ctl->info.version = FLOWRING_VERSION;
+  ctl->info.size = actual;
+  ctl->head = ctl->tail = 0;
+  ring->mask = actual - 1;
+  STORE_RELEASE(&ctl->info.magic, FLOWRING_MAGIC);
+
+  return ring;
+}
+
+
+/* Append a record.  rec->len bytes of payload are copied from
+ * 'payload'; rec->type is filled in for you.  Returns 0 on success,
+ * or -1 if the record was dropped because the ring is full. */
+int flowring_publish(flowring_t *ring, const struct flowring_rec *rec,
+		     const void *payload)
+{
+  struct flowring_ctl *ctl = ring->ctl;
+  struct flowring_rec *dst;
+  uint64_t size = ctl->info.size;
+  uint64_t head = ctl->head;
+  uint64_t space = REC_SPACE(rec->len);
+  uint64_t left = size - (head & ring->mask);
+  uint64_t need = space;
+
+  /* not enough room before the end of the area: skip to the start */
+  if (left < space)
+    need += left;
+
+  if (space > size || need > size - (head - LOAD_ACQUIRE(&ctl->tail))) {
+    ctl->info.dropped_records++;
+    ctl->info.dropped_bytes += rec->len;
+    return -1;
+  }
+
+  if (left < space) {
+    if (left >= sizeof(struct flowring_rec)) {
+      dst = (struct flowring_rec *) (ring->data + (head & ring->mask));
+      memset(dst, 0, sizeof(*dst));
+      dst->type = FLOWRING_PAD;
+      dst->len = left - sizeof(struct flowring_rec);
+    }
+    head += left;
+  }
+
+  dst = (struct flowring_rec *) (ring->data + (head & ring->mask));
+  memcpy(dst, rec, sizeof(*dst));
+  dst->type = FLOWRING_DATA;
+  memcpy(dst + 1, payload, rec->len);
+
+  ctl->info.records++;
+  ctl->info.bytes += rec->len;
+  STORE_RELEASE(&ctl->head, head + space);
+
+  return 0;
+}
+
+
+/* Attach to an existing ring as its consumer.  Returns NULL with errno
+ * set on failure (EAGAIN if the producer hasn't finished setting it up
+ * yet). */
+flowring_t *flowring_open(const char *name)
+{
+  struct flowring_ctl *ctl;
+  flowring_t *ring;
+  struct stat st;
+  int fd, saved_errno;
+
+  if ((fd = shm_open(name, O_RDWR, 0)) < 0)
+    return NULL;
+
+  if (fstat(fd, &st) < 0) {
+    saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return NULL;
+  }
+
+  if (st.st_size < (off_t) sizeof(struct flowring_ctl)) {
+    close(fd);
+    errno = EAGAIN;
+    return NULL;
+  }
+
+  ring = map_ring(fd, st.st_size, 0);
+  saved_errno = errno;
+  close(fd);
+  if (ring == NULL) {
+    errno = saved_errno;
+    return NULL;
+  }
+
+  ctl = ring->ctl;
+  if (LOAD_ACQUIRE(&ctl->info.magic) != FLOWRING_MAGIC) {
+    flowring_close(ring);
+    errno = EAGAIN;
+    return NULL;
+  }
+  if (ctl->info.version != FLOWRING_VERSION ||
+      sizeof(struct flowring_ctl) + ctl->info.size != (uint64_t) st.st_size) {
+    flowring_close(ring);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  ring->mask = ctl->info.size - 1;
+  ring->next = ctl->tail;
+  return ring;
+}
+
+
+/* Look at the oldest unread record.  Returns 1 and fills in rec and
+ * payload if there is one; it stays valid until flowring_done().
+ * Returns 0 if the ring is empty, or -1 if it's empty and the producer
+ * has closed it. */
+int flowring_next(flowring_t *ring, const struct flowring_rec **rec,
+		  const void **payload)
+{
+  struct flowring_ctl *ctl = ring->ctl;
+  uint64_t size = ctl->info.size;
+  uint64_t tail = ctl->tail;
+  uint64_t head = LOAD_ACQUIRE(&ctl->head);
+  const struct flowring_rec *r;
+  uint64_t left;
+
+  for (;;) {
+    if (tail == head) {
+      /* tail and head are published once the producer is done, so a
+       * closed ring whose head we've caught up with is finished */
+      if (LOAD_ACQUIRE(&ctl->info.closed) &&
+	  LOAD_ACQUIRE(&ctl->head) == tail)
+	return -1;
+      if (tail != ctl->tail)
+	STORE_RELEASE(&ctl->tail, tail);
+      return 0;
+    }
+
+    left = size - (tail & ring->mask);
+    if (left < sizeof(struct flowring_rec)) {
+      tail += left;
+      continue;
+    }
+
+    r = (const struct flowring_rec *) (ring->data + (tail & ring->mask));
+    if (r->type == FLOWRING_PAD) {
+      tail += REC_SPACE(r->len);
+      continue;
+    }
+
+    /* skipped padding is given back along with this record */
+    if (tail != ctl->tail)
+      STORE_RELEASE(&ctl->tail, tail);
+    ring->next = tail + REC_SPACE(r->len);
+    *rec = r;
+    *payload = r + 1;
+    return 1;
+  }
+}
+
+
+/* Give back the record returned by the last flowring_next() */
+void flowring_done(flowring_t *ring)
+{
+  STORE_RELEASE(&ring->ctl->tail, ring->next);
+}
+
+
+/* Bytes of the data area in use, i.e. published but not yet consumed */
+uint64_t flowring_used(flowring_t *ring)
+{
+  return LOAD_ACQUIRE(&ring->ctl->head) - LOAD_ACQUIRE(&ring->ctl->tail);
+}
+
+
+/* Detach from the ring.  When the producer closes it, consumers see
+ * the end of the stream once they've read everything before it. */
+void flowring_close(flowring_t *ring)
+{
+  if (ring->producer)
+    STORE_RELEASE(&ring->ctl->info.closed, 1);
+  munmap(ring->ctl, ring->maplen);
+  free(ring);
+}
+
+
+int flowring_unlink(const char *name)
+{
+  return shm_unlink(name);
+}
+
+#else /* no shm_open() */
+
+flowring_t *flowring_create(const char *name, size_t size)
+{
+  errno = ENOSYS;
+  return NULL;
+}
+
+flowring_t *flowring_open(const char *name)
+{
+  errno = ENOSYS;
+  return NULL;
+}
+
+int flowring_publish(flowring_t *ring, const struct flowring_rec *rec,
+		     const void *payload) { return -1; }
+int flowring_next(flowring_t *ring, const struct flowring_rec **rec,
+		  const void **payload) { return -1; }
+void flowring_done(flowring_t *ring) { }
+uint64_t flowring_used(flowring_t *ring) { return 0; }
+void flowring_close(flowring_t *ring) { }
+int flowring_unlink(const char *name) { errno = ENOSYS; return -1; }
+
+#endif /* HAVE_SHM_OPEN */
@@ -0,0 +1,115 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * Flow rings: a single-producer, single-consumer ring of flow data in
+ * POSIX shared memory.  With --shm-ring, tcpflow publishes each
+ * segment it would have written to a flow file as a record here
+ * instead, and a program on the same machine reads them out with the
+ * consumer half of this interface (see tcpflow-shmcat.c for an
+ * example).
+ *
+ * This header doesn't depend on the rest of tcpflow, so consumers can
+ * take it and flowring.c and build them into their own programs.
+ *
+ * The producer never waits for the consumer.  If a record doesn't fit,
+ * it's dropped and counted, and the next record of the same flow that
+ * does make it carries FLOWRING_GAP.  A consumer that falls behind
+ * loses data instead of holding up the capture; it can see how far
+ * behind it is with flowring_used() and what it has lost in the
+ * counters in the control block.
+ */
+
+#ifndef __FLOWRING_H__
+#define __FLOWRING_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FLOWRING_MAGIC		0x74636672	/* "tcfr" */
+#define FLOWRING_VERSION	1
+#define FLOWRING_ALIGN		8	/* records start on this boundary */
+
+/* Record types */
+#define FLOWRING_DATA		1	/* payload of one flow */
+#define FLOWRING_PAD		2	/* filler up to the end of the ring */
+
+/* Record flags */
+#define FLOWRING_GAP		(1 << 0) /* records of this flow were dropped
+					  * before this one */
+#define FLOWRING_LAST		(1 << 1) /* no more data will follow for
+					  * this flow */
+#define FLOWRING_REPLY		(1 << 2) /* this flow is the second direction
+					  * of its connection we saw */
+
+/* Every record starts with this header, followed by 'len' bytes of
+ * payload and padding up to FLOWRING_ALIGN.  Addresses and ports are
+ * in host byte order. */
+struct flowring_rec {
+  uint32_t len;			/* payload bytes that follow */
+  uint16_t type;		/* FLOWRING_DATA or FLOWRING_PAD */
+  uint16_t flags;		/* FLOWRING_GAP etc. */
+  uint32_t src;			/* source address */
+  uint32_t dst;			/* destination address */
+  uint16_t sport;		/* source port */
+  uint16_t dport;		/* destination port */
+  uint32_t reserved;
+  uint64_t offset;		/* where the payload goes in the flow */
+  uint64_t ts_sec;		/* capture time of the segment */
+  uint32_t ts_usec;
+  uint32_t reserved2;
+};
+
+/* Things only the producer writes, on their own cache line */
+struct flowring_info {
+  uint32_t magic;		/* written last, once the ring is ready */
+  uint32_t version;
+  uint64_t size;		/* bytes in the data area; a power of two */
+  uint32_t closed;		/* the producer is gone for good */
+  uint32_t reserved;
+  uint64_t records;		/* records published */
+  uint64_t bytes;		/* payload bytes published */
+  uint64_t dropped_records;	/* records that didn't fit */
+  uint64_t dropped_bytes;	/* payload bytes that didn't fit */
+};
+
+/* Start of the shared memory object.  The data area follows it. */
+struct flowring_ctl {
+  struct flowring_info info;
+  char pad0[128 - sizeof(struct flowring_info)];
+  uint64_t head;		/* producer position (bytes, unwrapped) */
+  char pad1[64 - sizeof(uint64_t)];
+  uint64_t tail;		/* consumer position (bytes, unwrapped) */
+  char pad2[64 - sizeof(uint64_t)];
+};
+
+typedef struct flowring {
+  struct flowring_ctl *ctl;
+  unsigned char *data;		/* the data area */
+  uint64_t mask;		/* size - 1 */
+  size_t maplen;
+  int producer;
+  uint64_t next;		/* consumer: position after the current record */
+} flowring_t;
+
+
+/* Producer side */
+flowring_t *flowring_create(const char *name, size_t size);
+int flowring_publish(flowring_t *ring, const struct flowring_rec *rec,
+		     const void *payload);
+
+/* Consumer side */
+flowring_t *flowring_open(const char *name);
+int flowring_next(flowring_t *ring, const struct flowring_rec **rec,
+		  const void **payload);
+void flowring_done(flowring_t *ring);
+
+/* Either side */
+uint64_t flowring_used(flowring_t *ring);
+void flowring_close(flowring_t *ring);
+int flowring_unlink(const char *name);
+
+#endif /* __FLOWRING_H__ */
@@ -0,0 +1,942 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * libtcpflow: in-process TCP stream reassembly (see libtcpflow.h).
+ *
+ * A context keeps a hash table of connections, each holding the state
+ * of both of its directions.  For each direction we know how much of
+ * the flow we've passed on so far; a segment that starts there goes
+ * straight to the data callback, and one that starts further on is
+ * copied into a list, in order of offset, until what comes before it
+ * has been passed on.
+ *
+ * Unordered, every segment goes straight to the data callback, and
+ * what we keep of a direction is which ranges of its bytes have been
+ * passed on, as a short sorted list of disjoint [start, end) offsets; a
+ * flow that arrives in order has exactly one.  Before a segment goes
+ * anywhere, the part of it that's been passed on is cut off, and if
+ * there's nothing left it's dropped, so a retransmission costs the
+ * caller neither a seek nor a write.
+ *
+ * A segment is only ever trimmed at its ends, since it's passed on in
+ * one piece; if it straddles a range, the bytes in the middle go again.
+ * The list is capped at MAX_RANGES; when it's full, the lowest range is
+ * forgotten.  Forgetting is always safe: the worst it costs is passing
+ * the same bytes on twice.
+ *
+ * Nothing here uses the rest of tcpflow, apart from its tracepoints
+ * (probes.h), or keeps any global state.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "conf.h"
+#endif
+
+#include "sysdep.h"
+#include "libtcpflow.h"
+#include "probes.h"
+
+#define INITIAL_TABLE	1024	/* connections; a power of two */
+#define DEFAULT_BUFFER	(1024 * 1024)
+#define DEFAULT_LINGER	60	/* seconds closed connections are remembered,
+				 * so their stragglers aren't new flows */
+#define FIRST_RANGES	4	/* room allocated for a flow's first range */
+#define MAX_RANGES	64	/* most ranges remembered per flow */
+
+#define HALF_UNUSED	0
+#define HALF_OPEN	1
+#define HALF_CLOSED	2
+
+/* Which half of its connection a flow is: the direction from the
+ * lower address (and port) is half 0 */
+#define WHICH_HALF(src, dst, sport, dport) \
+  ((src) > (dst) || ((src) == (dst) && (sport) > (dport)))
+
+#ifdef __GNUC__
+# define PREFETCH(addr) __builtin_prefetch(addr)
+#else
+# define PREFETCH(addr)
+#endif
+
+/* Data that arrived before its turn */
+struct pending {
+  struct pending *next;
+  uint64_t offset;
+  uint32_t length;
+  unsigned char data[1];
+};
+
+struct half {
+  struct tcpflow_flow flow;	/* first, so a flow leads to its half */
+  void *flow_user;
+  int state;			/* HALF_UNUSED etc. */
+  uint64_t delivered;		/* offset of the next byte to pass on;
+				 * unordered, the end of the furthest
+				 * segment seen */
+  uint64_t fin_offset;		/* where the FIN is, once we know */
+  int have_fin;
+  struct pending *pending;
+  uint32_t pending_bytes;
+  struct tcpflow_range *passed;	/* unordered: what's been passed on */
+  int passed_count;
+  int passed_size;
+  int passed_lost;		/* some of 'passed' was forgotten */
+  int busy;			/* in its data callback */
+  int stopping;			/* tcpflow_close_flow() was called then */
+};
+
+struct connection {
+  struct connection *next;
+  uint32_t addr[2];		/* the lower address (and port) first */
+  uint16_t port[2];
+  struct half half[2];		/* half[i] is from addr[i] */
+};
+
+struct tcpflow_ctx {
+  struct tcpflow_callbacks cb;
+  void *user;
+
+  uint64_t max_bytes;
+  uint32_t max_buffer;
+  int idle_timeout;
+  int linger;
+  int unordered;
+
+  struct connection **table;
+  uint32_t table_size;		/* a power of two */
+  uint32_t count;
+  time_t last_expire;
+
+  struct tcpflow_stats stats;
+};
+
+
+/*************************************************************************/
+
+int tcpflow_decode_ip(const unsigned char *data, uint32_t caplen,
+		      struct tcpflow_segment *seg)
+{
+  const struct ip *ip_header = (const struct ip *) data;
+  const struct tcphdr *tcp_header;
+  uint32_t ip_header_len, tcp_header_len, length;
+
+  if (caplen < sizeof(struct ip))
+    return TCPFLOW_SHORT_IP;
+  if (ip_header->ip_v != 4)
+    return TCPFLOW_NOT_IPV4;
+  if (ip_header->ip_p != IPPROTO_TCP)
+    return TCPFLOW_NOT_TCP;
+
+  /* we may have captured less than the datagram, or more than it
+   * (ethernet padding) */
+  seg->ip_len = ntohs(ip_header->ip_len);
+  seg->partial = caplen < seg->ip_len;
+  length = seg->partial ? caplen : seg->ip_len;
+
+  /* only the first fragment has the TCP header */
+  if (ntohs(ip_header->ip_off) & 0x1fff)
+    return TCPFLOW_FRAGMENT;
+
+  ip_header_len = ip_header->ip_hl * 4;
+  if (ip_header_len > seg->ip_len)
+    return TCPFLOW_BAD_IP_HEADER;
+  if (ip_header_len + sizeof(struct tcphdr) > length)
+    return TCPFLOW_SHORT_TCP;
+
+  tcp_header = (const struct tcphdr *) (data + ip_header_len);
+  tcp_header_len = tcp_header->th_off * 4;
+  if (tcp_header_len < sizeof(struct tcphdr))
+    return TCPFLOW_SHORT_TCP;
+
+  seg->src = ntohl(ip_header->ip_src.s_addr);
+  seg->dst = ntohl(ip_header->ip_dst.s_addr);
+  seg->sport = ntohs(tcp_header->th_sport);
+  seg->dport = ntohs(tcp_header->th_dport);
+  seg->seq = ntohl(tcp_header->th_seq);
+  seg->ip_id = ntohs(ip_header->ip_id);
+
+  seg->flags = 0;
+  if (tcp_header->th_flags & TH_FIN)
+    seg->flags |= TCPFLOW_FIN;
+  if (tcp_header->th_flags & TH_SYN)
+    seg->flags |= TCPFLOW_SYN;
+  if (tcp_header->th_flags & TH_RST)
+    seg->flags |= TCPFLOW_RST;
+  if (tcp_header->th_flags & TH_ACK)
+    seg->flags |= TCPFLOW_ACK;
+  seg->window = ntohs(tcp_header->th_win);
+
+  /* the payload, if there is any */
+  length -= ip_header_len;
+  seg->data = (const unsigned char *) tcp_header + tcp_header_len;
+  seg->length = length > tcp_header_len ? length - tcp_header_len : 0;
+
+  return TCPFLOW_OK;
+}
+
+
+/*************************************************************************/
+
+tcpflow_ctx *tcpflow_new(const struct tcpflow_callbacks *callbacks,
+			 void *user)
+{
+  tcpflow_ctx *ctx;
+
+  if ((ctx = calloc(1, sizeof(tcpflow_ctx))) == NULL)
+    return NULL;
+  if ((ctx->table = calloc(INITIAL_TABLE, sizeof(struct connection *))) ==
+      NULL) {
+    free(ctx);
+    return NULL;
+  }
+
+  if (callbacks != NULL)
+    ctx->cb = *callbacks;
+  ctx->user = user;
+  ctx->max_buffer = DEFAULT_BUFFER;
+  ctx->linger = DEFAULT_LINGER;
+  ctx->table_size = INITIAL_TABLE;
+
+  return ctx;
+}
+
+
+void tcpflow_set_max_bytes(tcpflow_ctx *ctx, uint64_t max_bytes)
+{
+  ctx->max_bytes = max_bytes;
+}
+
+
+void tcpflow_set_max_buffer(tcpflow_ctx *ctx, uint32_t max_buffer)
+{
+  ctx->max_buffer = max_buffer;
+}
+
+
+void tcpflow_set_idle_timeout(tcpflow_ctx *ctx, int seconds)
+{
+  ctx->idle_timeout = seconds;
+}
+
+
+void tcpflow_set_linger(tcpflow_ctx *ctx, int seconds)
+{
+  ctx->linger = seconds;
+}
+
+
+void tcpflow_set_unordered(tcpflow_ctx *ctx, int unordered)
+{
+  ctx->unordered = unordered;
+}
+
+
+uint32_t tcpflow_connection_hash(uint32_t a, uint32_t b, uint16_t aport,
+				 uint16_t bport)
+{
+  uint32_t h = (a ^ b) * 2654435761U ^ (uint32_t) (aport ^ bport) * 40503U;
+
+  /* we index by the low bits */
+  return h ^ (h >> 16);
+}
+
+
+/* Make the table twice as big */
+static int grow_table(tcpflow_ctx *ctx)
+{
+  uint32_t size = ctx->table_size * 2, i;
+  struct connection **table, *conn, *next;
+
+  if ((table = calloc(size, sizeof(struct connection *))) == NULL)
+    return -1;
+
+  for (i = 0; i < ctx->table_size; i++)
+    for (conn = ctx->table[i]; conn != NULL; conn = next) {
+      uint32_t index = tcpflow_connection_hash(conn->addr[0],
+					       conn->addr[1], conn->port[0],
+					       conn->port[1]) & (size - 1);
+
+      next = conn->next;
+      conn->next = table[index];
+      table[index] = conn;
+    }
+
+  free(ctx->table);
+  ctx->table = table;
+  ctx->table_size = size;
+  return 0;
+}
+
+
+/* Find the connection the flow from src:sport to dst:dport belongs
+ * to, and which half of it the flow is.  Returns NULL if there isn't
+ * one and 'create' is 0, or if we're out of memory. */
+static struct connection *find_connection(tcpflow_ctx *ctx, uint32_t src,
+					  uint32_t dst, uint16_t sport,
+					  uint16_t dport, int create,
+					  int *which)
+{
+  uint32_t index;
+  struct connection *conn;
+  int half = WHICH_HALF(src, dst, sport, dport);
+
+  *which = half;
+  index = tcpflow_connection_hash(src, dst, sport, dport) &
+    (ctx->table_size - 1);
+
+  for (conn = ctx->table[index]; conn != NULL; conn = conn->next)
+    if (conn->addr[half] == src && conn->addr[!half] == dst &&
+	conn->port[half] == sport && conn->port[!half] == dport)
+      return conn;
+
+  if (!create)
+    return NULL;
+
+  if (ctx->count >= ctx->table_size) {
+    if (grow_table(ctx) < 0)
+      return NULL;
+    index = tcpflow_connection_hash(src, dst, sport, dport) &
+      (ctx->table_size - 1);
+  }
+
+  if ((conn = calloc(1, sizeof(struct connection))) == NULL)
+    return NULL;
+  conn->addr[half] = src;
+  conn->addr[!half] = dst;
+  conn->port[half] = sport;
+  conn->port[!half] = dport;
+
+  conn->next = ctx->table[index];
+  ctx->table[index] = conn;
+  ctx->count++;
+
+  return conn;
+}
+
+
+/* The connection a flow is half of, and which half */
+static struct connection *flow_connection(const struct tcpflow_flow *flow,
+					  int *which)
+{
+  const struct half *h = (const struct half *) flow;
+
+  *which = WHICH_HALF(flow->src, flow->dst, flow->sport, flow->dport);
+  return (struct connection *) ((char *) (h - *which) -
+				offsetof(struct connection, half));
+}
+
+
+static void open_half(tcpflow_ctx *ctx, struct connection *conn, int which,
+		      uint32_t isn, const struct timeval *tv)
+{
+  struct half *h = &conn->half[which];
+
+  h->state = HALF_OPEN;
+  h->flow.src = conn->addr[which];
+  h->flow.dst = conn->addr[!which];
+  h->flow.sport = conn->port[which];
+  h->flow.dport = conn->port[!which];
+  h->flow.reply = conn->half[!which].state != HALF_UNUSED;
+  h->flow.isn = isn;
+  h->flow.max_bytes = ctx->max_bytes;
+  h->flow.start = *tv;
+  h->flow.last = *tv;
+
+  PROBE_FLOW_CREATE(h->flow, isn);
+  if (ctx->cb.open != NULL)
+    ctx->cb.open(ctx->user, &h->flow, &h->flow_user);
+}
+
+
+static void free_pending(struct half *h)
+{
+  struct pending *p, *next;
+
+  for (p = h->pending; p != NULL; p = next) {
+    next = p->next;
+    free(p);
+  }
+  h->pending = NULL;
+  h->pending_bytes = 0;
+}
+
+
+/* The close callback can still ask what was passed on */
+static void close_half(tcpflow_ctx *ctx, struct half *h, int reason)
+{
+  h->state = HALF_CLOSED;
+  if (ctx->cb.close != NULL)
+    ctx->cb.close(ctx->user, &h->flow, h->flow_user, reason);
+  free_pending(h);
+  free(h->passed);
+  h->passed = NULL;
+  h->passed_count = h->passed_size = 0;
+}
+
+
+static void deliver(tcpflow_ctx *ctx, struct half *h,
+		    const unsigned char *data, uint32_t length,
+		    uint64_t offset, const struct timeval *tv)
+{
+  if (ctx->cb.data != NULL) {
+    h->busy = 1;
+    ctx->cb.data(ctx->user, &h->flow, h->flow_user, data, length, offset,
+		 tv);
+    h->busy = 0;
+  }
+  h->delivered = offset + length;
+}
+
+
+/* Pass on whatever was waiting for the data we've just passed on */
+static void drain_pending(tcpflow_ctx *ctx, struct half *h,
+			  const struct timeval *tv)
+{
+  struct pending *p;
+
+  while (!h->stopping && (p = h->pending) != NULL &&
+	 p->offset <= h->delivered) {
+    h->pending = p->next;
+    h->pending_bytes -= p->length;
+
+    if (p->offset + p->length > h->delivered) {
+      uint32_t skip = h->delivered - p->offset;
+
+      deliver(ctx, h, p->data + skip, p->length - skip, h->delivered, tv);
+    }
+    free(p);
+  }
+}
+
+
+/* Hold on to data that arrived before its turn.  If that's more than
+ * we're willing to hold, give up on the gaps in front of it, one at a
+ * time, until it isn't. */
+static int add_pending(tcpflow_ctx *ctx, struct half *h,
+		       const unsigned char *data, uint32_t length,
+		       uint64_t offset, const struct timeval *tv)
+{
+  struct pending *p, **pp;
+
+  if ((p = malloc(sizeof(struct pending) + length)) == NULL)
+    return -1;
+  p->offset = offset;
+  p->length = length;
+  memcpy(p->data, data, length);
+
+  for (pp = &h->pending; *pp != NULL && (*pp)->offset <= offset;
+       pp = &(*pp)->next)
+    ;
+  p->next = *pp;
+  *pp = p;
+  h->pending_bytes += length;
+
+  while (!h->stopping && h->pending_bytes > ctx->max_buffer) {
+    h->delivered = h->pending->offset;
+    drain_pending(ctx, h, tv);
+  }
+
+  return 0;
+}
+
+
+/* Unordered: cut off the ends of a segment that have been passed on
+ * already.  Returns 0 if all of it has. */
+static int trim_passed(tcpflow_ctx *ctx, struct half *h,
+		       const unsigned char **data, uint32_t *length,
+		       uint64_t *offset)
+{
+  struct tcpflow_range *r = h->passed;
+  uint64_t start = *offset;
+  uint64_t end = start + *length;
+  int i;
+
+  /* the usual case: the segment is past everything we've passed on */
+  if (h->passed_count == 0 || start >= r[h->passed_count - 1].end)
+    return 1;
+
+  for (i = 0; i < h->passed_count && r[i].start < end; i++) {
+    if (r[i].end <= start)
+      continue;
+    if (r[i].start <= start)
+      start = r[i].end;			/* the front's been passed on */
+    else if (r[i].end >= end)
+      end = r[i].start;			/* so has the back */
+  }
+
+  if (start >= end) {
+    ctx->stats.retransmitted++;
+    ctx->stats.retransmitted_bytes += *length;
+    return 0;
+  }
+
+  if (end - start < *length) {
+    ctx->stats.trimmed++;
+    ctx->stats.trimmed_bytes += *length - (end - start);
+    *data += start - *offset;
+    *length = end - start;
+    *offset = start;
+  }
+
+  return 1;
+}
+
+
+/* Unordered: remember that 'length' bytes at 'offset' have been passed
+ * on.  Returns -1 if out of memory. */
+static int mark_passed(struct half *h, uint64_t offset, uint32_t length)
+{
+  struct tcpflow_range *r = h->passed;
+  uint64_t start = offset;
+  uint64_t end = offset + length;
+  int count = h->passed_count;
+  int first, last;
+
+  /* the usual case again: the new bytes carry on from the last range */
+  if (count > 0 && start <= r[count - 1].end && start >= r[count - 1].start) {
+    if (end > r[count - 1].end)
+      r[count - 1].end = end;
+    return 0;
+  }
+
+  /* find the ranges the new one touches, and merge them */
+  for (first = 0; first < count && r[first].end < start; first++)
+    ;
+  for (last = first; last < count && r[last].start <= end; last++) {
+    if (r[last].start < start)
+      start = r[last].start;
+    if (r[last].end > end)
+      end = r[last].end;
+  }
+
+  if (last > first) {
+    /* r[first..last-1] become one */
+    r[first].start = start;
+    r[first].end = end;
+    memmove(&r[first + 1], &r[last], (count - last) * sizeof(*r));
+    h->passed_count -= last - first - 1;
+    return 0;
+  }
+
+  /* a range of its own, between r[first - 1] and r[first] */
+  if (count == h->passed_size) {
+    if (count == MAX_RANGES) {
+      h->passed_lost = 1;
+      if (first == 0)
+	return 0;
+      memmove(&r[0], &r[1], --count * sizeof(*r));
+      first--;
+    } else {
+      int size = count ? count * 2 : FIRST_RANGES;
+
+      if ((r = realloc(r, size * sizeof(*r))) == NULL)
+	return -1;
+      h->passed = r;
+      h->passed_size = size;
+    }
+  }
+
+  memmove(&r[first + 1], &r[first], (count - first) * sizeof(*r));
+  r[first].start = start;
+  r[first].end = end;
+  h->passed_count = count + 1;
+  return 0;
+}
+
+
+/* Unordered: pass a segment on at its offset, less what's been passed
+ * on before */
+static int feed_unordered(tcpflow_ctx *ctx, struct half *h,
+			  const struct tcpflow_segment *seg, uint32_t seq,
+			  const struct timeval *tv)
+{
+  const unsigned char *data = seg->data;
+  uint32_t length = seg->length, taken;
+  uint64_t max = h->flow.max_bytes;
+  uint64_t offset;
+  int64_t where;
+  int limit = 0;
+
+  if (length == 0)
+    return TCPFLOW_OK;
+
+  /* where the segment goes, relative to the furthest we've seen,
+   * whether or not it was taken */
+  where = (int64_t) h->delivered +
+    (int32_t) (seq - (h->flow.isn + (uint32_t) h->delivered));
+  if (where < 0) {
+    PROBE_DROP(*seg, seg->seq, length, PROBE_DROP_BEFORE_ISN);
+    return TCPFLOW_OK;
+  }
+  offset = where;
+  if (offset + length > h->delivered)
+    h->delivered = offset + length;
+
+  /* nothing past the byte limit is wanted, and reaching it is the end */
+  if (max && offset > max) {
+    PROBE_DROP(*seg, seg->seq, length, PROBE_DROP_LIMIT);
+    return TCPFLOW_OK;
+  }
+  if (max && offset + length >= max) {
+    length = max - offset;
+    limit = 1;
+  }
+
+  if (!trim_passed(ctx, h, &data, &length, &offset)) {
+    if (!limit) {
+      PROBE_DROP(*seg, seg->seq, length, PROBE_DROP_WRITTEN);
+      return TCPFLOW_OK;
+    }
+    offset = max;
+    length = 0;
+  }
+
+  taken = length;
+  if (ctx->cb.data != NULL) {
+    h->busy = 1;
+    taken = ctx->cb.data(ctx->user, &h->flow, h->flow_user, data, length,
+			 offset, tv);
+    h->busy = 0;
+  }
+
+  if (taken > 0 && mark_passed(h, offset, taken < length ? taken : length) <
+      0)
+    return -1;
+  if (limit)
+    close_half(ctx, h, TCPFLOW_CLOSE_LIMIT);
+  else if (h->stopping)
+    close_half(ctx, h, TCPFLOW_CLOSE_STOPPED);
+
+  return TCPFLOW_OK;
+}
+
+
+int tcpflow_feed_segment(tcpflow_ctx *ctx, const struct tcpflow_segment *seg,
+			 const struct timeval *tv)
+{
+  struct connection *conn;
+  struct half *h;
+  const unsigned char *data = seg->data;
+  uint32_t length = seg->length, seq = seg->seq;
+  int64_t offset;
+  int which, i;
+
+  /* close flows that have gone quiet, and forget connections, once a
+   * second, if there's any of that to do */
+  if (tv->tv_sec != ctx->last_expire &&
+      (ctx->idle_timeout || ctx->linger >= 0)) {
+    ctx->last_expire = tv->tv_sec;
+    tcpflow_expire(ctx, tv->tv_sec);
+  }
+
+  /* only a SYN or some data starts a new flow */
+  conn = find_connection(ctx, seg->src, seg->dst, seg->sport, seg->dport,
+			 length > 0 || (seg->flags & TCPFLOW_SYN), &which);
+  if (conn == NULL)
+    return (length > 0 || (seg->flags & TCPFLOW_SYN)) ? -1 : TCPFLOW_OK;
+
+  h = &conn->half[which];
+
+  /* a RST aborts the whole connection, whichever way it came; but not
+   * unordered, where what came before it may still be on its way */
+  if ((seg->flags & TCPFLOW_RST) && !ctx->unordered) {
+    for (i = 0; i < 2; i++)
+      if (conn->half[i].state == HALF_OPEN)
+	close_half(ctx, &conn->half[i], TCPFLOW_CLOSE_RST);
+    return TCPFLOW_OK;
+  }
+
+  /* stragglers of a closed flow are ignored, but a SYN starts over */
+  if (h->state == HALF_CLOSED) {
+    if (!(seg->flags & TCPFLOW_SYN)) {
+      PROBE_DROP(*seg, seg->seq, length, PROBE_DROP_FINISHED);
+      return TCPFLOW_OK;
+    }
+    memset(h, 0, sizeof(struct half));
+  }
+
+  /* the SYN takes up a sequence number of its own */
+  if (seg->flags & TCPFLOW_SYN)
+    seq++;
+
+  if (h->state == HALF_UNUSED) {
+    if (length == 0 && !(seg->flags & TCPFLOW_SYN))
+      return TCPFLOW_OK;
+    open_half(ctx, conn, which, seq, tv);
+
+    /* the open callback may not have wanted it */
+    if (h->state != HALF_OPEN) {
+      PROBE_DROP(*seg, seg->seq, length, PROBE_DROP_FINISHED);
+      return TCPFLOW_OK;
+    }
+  }
+  h->flow.last = *tv;
+  if (length > 0) {
+    h->flow.packets++;
+    h->flow.bytes += length;
+  }
+
+  if (ctx->unordered)
+    return feed_unordered(ctx, h, seg, seq, tv);
+
+  /* where the segment goes, relative to what we've passed on */
+  offset = (int64_t) h->delivered +
+    (int32_t) (seq - (h->flow.isn + (uint32_t) h->delivered));
+
+  if ((seg->flags & TCPFLOW_FIN) && offset + length >= 0 &&
+      (!h->have_fin || (uint64_t) (offset + length) < h->fin_offset)) {
+    h->fin_offset = offset + length;
+    h->have_fin = 1;
+  }
+
+  /* cut off what we've had already, and what's over the limit */
+  if (offset < (int64_t) h->delivered) {
+    int64_t skip = (int64_t) h->delivered - offset;
+
+    if (skip >= length) {
+      if (length > 0) {
+	ctx->stats.retransmitted++;
+	ctx->stats.retransmitted_bytes += length;
+      }
+      length = 0;
+    } else {
+      ctx->stats.trimmed++;
+      ctx->stats.trimmed_bytes += skip;
+      data += skip;
+      length -= skip;
+      offset = h->delivered;
+    }
+  }
+  if (h->flow.max_bytes && length > 0 &&
+      (uint64_t) offset + length > h->flow.max_bytes)
+    length = (uint64_t) offset >= h->flow.max_bytes ? 0 :
+      h->flow.max_bytes - offset;
+
+  if (length > 0) {
+    if ((uint64_t) offset == h->delivered) {
+      deliver(ctx, h, data, length, offset, tv);
+      drain_pending(ctx, h, tv);
+    } else if (add_pending(ctx, h, data, length, offset, tv) < 0) {
+      return -1;
+    }
+  }
+
+  if (h->stopping)
+    close_half(ctx, h, TCPFLOW_CLOSE_STOPPED);
+  else if (h->flow.max_bytes && h->delivered >= h->flow.max_bytes)
+    close_half(ctx, h, TCPFLOW_CLOSE_LIMIT);
+  else if (h->have_fin && h->delivered >= h->fin_offset)
+    close_half(ctx, h, TCPFLOW_CLOSE_FIN);
+
+  return TCPFLOW_OK;
+}
+
+
+int tcpflow_feed_ip(tcpflow_ctx *ctx, const unsigned char *data,
+		    uint32_t caplen, const struct timeval *tv)
+{
+  struct tcpflow_segment seg;
+  int rc;
+
+  if ((rc = tcpflow_decode_ip(data, caplen, &seg)) != TCPFLOW_OK)
+    return rc;
+  return tcpflow_feed_segment(ctx, &seg, tv);
+}
+
+
+/*************************************************************************/
+
+const struct tcpflow_flow *tcpflow_add_flow(tcpflow_ctx *ctx, uint32_t src,
+					    uint32_t dst, uint16_t sport,
+					    uint16_t dport, uint32_t isn,
+					    const struct timeval *tv,
+					    void **flow_user)
+{
+  struct connection *conn;
+  struct half *h;
+  int which;
+
+  conn = find_connection(ctx, src, dst, sport, dport, 1, &which);
+  if (conn == NULL)
+    return NULL;
+
+  h = &conn->half[which];
+  if (h->state == HALF_OPEN)
+    close_half(ctx, h, TCPFLOW_CLOSE_RESTART);
+  memset(h, 0, sizeof(struct half));
+  open_half(ctx, conn, which, isn, tv);
+
+  if (flow_user != NULL)
+    *flow_user = h->flow_user;
+  return &h->flow;
+}
+
+
+const struct tcpflow_flow *tcpflow_find_flow(tcpflow_ctx *ctx, uint32_t src,
+					     uint32_t dst, uint16_t sport,
+					     uint16_t dport, void **flow_user)
+{
+  struct connection *conn;
+  struct half *h;
+  int which;
+
+  conn = find_connection(ctx, src, dst, sport, dport, 0, &which);
+  if (conn == NULL || (h = &conn->half[which])->state == HALF_UNUSED)
+    return NULL;
+
+  if (flow_user != NULL)
+    *flow_user = h->flow_user;
+  return &h->flow;
+}
+
+
+const struct tcpflow_flow *tcpflow_reverse_flow(tcpflow_ctx *ctx,
+						const struct tcpflow_flow *flow,
+						void **flow_user)
+{
+  int which;
+  struct connection *conn = flow_connection(flow, &which);
+  struct half *h = &conn->half[!which];
+
+  if (h->state == HALF_UNUSED)
+    return NULL;
+
+  if (flow_user != NULL)
+    *flow_user = h->flow_user;
+  return &h->flow;
+}
+
+
+void tcpflow_for_each_flow(tcpflow_ctx *ctx,
+			   void (*fn)(const struct tcpflow_flow *flow,
+				      void *flow_user, void *arg),
+			   void *arg)
+{
+  struct connection *conn;
+  uint32_t i;
+  int j;
+
+  for (i = 0; i < ctx->table_size; i++)
+    for (conn = ctx->table[i]; conn != NULL; conn = conn->next)
+      for (j = 0; j < 2; j++)
+	if (conn->half[j].state != HALF_UNUSED)
+	  fn(&conn->half[j].flow, conn->half[j].flow_user, arg);
+}
+
+
+void tcpflow_prefetch_bucket(tcpflow_ctx *ctx, uint32_t src, uint32_t dst,
+			     uint16_t sport, uint16_t dport)
+{
+  PREFETCH(&ctx->table[tcpflow_connection_hash(src, dst, sport, dport) &
+		       (ctx->table_size - 1)]);
+}
+
+
+void tcpflow_prefetch_flow(tcpflow_ctx *ctx, uint32_t src, uint32_t dst,
+			   uint16_t sport, uint16_t dport)
+{
+  struct connection *conn =
+    ctx->table[tcpflow_connection_hash(src, dst, sport, dport) &
+	       (ctx->table_size - 1)];
+
+  if (conn != NULL)
+    PREFETCH(conn);
+}
+
+
+void tcpflow_limit_flow(tcpflow_ctx *ctx, const struct tcpflow_flow *flow,
+			uint64_t max_bytes)
+{
+  ((struct half *) flow)->flow.max_bytes = max_bytes;
+}
+
+
+void tcpflow_close_flow(tcpflow_ctx *ctx, const struct tcpflow_flow *flow)
+{
+  struct half *h = (struct half *) flow;
+
+  /* from its own data callback, once the segment's been dealt with */
+  if (h->state == HALF_OPEN && h->busy)
+    h->stopping = 1;
+  else if (h->state == HALF_OPEN)
+    close_half(ctx, h, TCPFLOW_CLOSE_STOPPED);
+}
+
+
+int tcpflow_passed(tcpflow_ctx *ctx, const struct tcpflow_flow *flow,
+		   const struct tcpflow_range **ranges, int *lost)
+{
+  const struct half *h = (const struct half *) flow;
+
+  *ranges = h->passed;
+  *lost = h->passed_lost;
+  return h->passed_count;
+}
+
+
+/* Close flows that have been idle too long, and forget connections
+ * that have been closed for a while */
+void tcpflow_expire(tcpflow_ctx *ctx, time_t now)
+{
+  struct connection **pp, *conn;
+  uint32_t i;
+  int j, open;
+  time_t last;
+
+  for (i = 0; i < ctx->table_size; i++) {
+    pp = &ctx->table[i];
+    while ((conn = *pp) != NULL) {
+      open = 0;
+      last = 0;
+      for (j = 0; j < 2; j++) {
+	struct half *h = &conn->half[j];
+
+	if (h->state == HALF_OPEN && ctx->idle_timeout &&
+	    now - h->flow.last.tv_sec >= ctx->idle_timeout)
+	  close_half(ctx, h, TCPFLOW_CLOSE_IDLE);
+	if (h->state == HALF_OPEN)
+	  open = 1;
+	if (h->flow.last.tv_sec > last)
+	  last = h->flow.last.tv_sec;
+      }
+
+      if (!open && ctx->linger >= 0 && now - last >= ctx->linger) {
+	*pp = conn->next;
+	free(conn);
+	ctx->count--;
+      } else {
+	pp = &conn->next;
+      }
+    }
+  }
+}
+
+
+void tcpflow_get_stats(tcpflow_ctx *ctx, struct tcpflow_stats *stats)
+{
+  *stats = ctx->stats;
+}
+
+
+void tcpflow_free(tcpflow_ctx *ctx)
+{
+  struct connection *conn, *next;
+  uint32_t i;
+  int j;
+
+  for (i = 0; i < ctx->table_size; i++)
+    for (conn = ctx->table[i]; conn != NULL; conn = next) {
+      next = conn->next;
+      for (j = 0; j < 2; j++)
+	if (conn->half[j].state == HALF_OPEN)
+	  close_half(ctx, &conn->half[j], TCPFLOW_CLOSE_END);
+      free(conn);
+    }
+
+  free(ctx->table);
+  free(ctx);
+}
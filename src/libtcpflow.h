@@ -0,0 +1,261 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * libtcpflow: TCP stream reassembly for programs that want the data
+ * of each flow in-process, rather than in files written by tcpflow and
+ * read back.
+ *
+ * Everything lives in a context made with tcpflow_new(); nothing is
+ * global, so a program can have as many contexts as it likes (one per
+ * thread, say).  Feed it IP datagrams with tcpflow_feed_ip(), and it
+ * calls you back:
+ *
+ *   open   when it sees a new flow (one direction of a connection)
+ *   data   with the flow's payload, in order, as soon as it can; data
+ *          that arrived in order is passed straight out of the packet
+ *          you fed in, without copying
+ *   close  when the flow ends: FIN, RST, the byte limit, idle timeout,
+ *          or tcpflow_free()
+ *
+ * Each data callback gives the offset of the data in its flow.
+ * Segments that arrive early are held back until the gap before them
+ * fills.  If it doesn't fill before tcpflow_set_max_buffer() bytes are
+ * waiting, the gap is skipped and the offset jumps over it.
+ *
+ * A program that puts each flow in a file can have it unordered
+ * instead (tcpflow_set_unordered()): each segment goes to the data
+ * callback as soon as it arrives, at its offset, so nothing is held
+ * back or copied.  What's been passed on is remembered as a few ranges
+ * of each flow, and cut off any segment that brings it again; one with
+ * nothing new in it isn't passed on at all.  Unordered, a FIN or a RST
+ * doesn't close anything, since what was sent before it can still be
+ * on its way; flows stay open until the byte limit, idle timeout,
+ * tcpflow_close_flow() or tcpflow_free().  This is how the tcpflow
+ * program uses it.
+ *
+ * Addresses and ports are in host byte order.  Link-layer headers are
+ * the caller's business.
+ *
+ * This header doesn't depend on the rest of tcpflow; link with
+ * libtcpflow.a.
+ */
+
+#ifndef __LIBTCPFLOW_H__
+#define __LIBTCPFLOW_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <time.h>
+
+/* Results of decoding a datagram */
+#define TCPFLOW_OK		0	/* a TCP segment */
+#define TCPFLOW_SHORT_IP	1	/* too short for an IP header */
+#define TCPFLOW_NOT_IPV4	2
+#define TCPFLOW_NOT_TCP		3
+#define TCPFLOW_FRAGMENT	4	/* a fragment other than the first */
+#define TCPFLOW_BAD_IP_HEADER	5	/* header longer than the datagram */
+#define TCPFLOW_SHORT_TCP	6	/* too short for a TCP header */
+
+/* TCP flags we care about, in tcpflow_segment.flags */
+#define TCPFLOW_FIN		0x01
+#define TCPFLOW_SYN		0x02
+#define TCPFLOW_RST		0x04
+#define TCPFLOW_ACK		0x08
+
+/* Why a flow was closed */
+#define TCPFLOW_CLOSE_FIN	1	/* all data up to the FIN was seen */
+#define TCPFLOW_CLOSE_RST	2	/* a RST, either way */
+#define TCPFLOW_CLOSE_LIMIT	3	/* its byte limit was reached */
+#define TCPFLOW_CLOSE_IDLE	4	/* tcpflow_set_idle_timeout() */
+#define TCPFLOW_CLOSE_END	5	/* tcpflow_free() */
+#define TCPFLOW_CLOSE_STOPPED	6	/* tcpflow_close_flow() */
+#define TCPFLOW_CLOSE_RESTART	7	/* tcpflow_add_flow() started it over */
+
+/* A TCP segment found in an IP datagram */
+struct tcpflow_segment {
+  uint32_t src;			/* source address */
+  uint32_t dst;			/* destination address */
+  uint16_t sport;		/* source port */
+  uint16_t dport;		/* destination port */
+  uint32_t seq;			/* sequence number */
+  uint16_t ip_id;		/* IP identification */
+  uint8_t flags;		/* TCPFLOW_FIN etc. */
+  uint8_t partial;		/* the datagram wasn't captured in full */
+  uint16_t window;		/* advertised window, unscaled */
+  uint32_t ip_len;		/* length of the datagram */
+  const unsigned char *data;	/* payload */
+  uint32_t length;		/* payload bytes actually captured */
+};
+
+/* One direction of a connection.  The context keeps it up to date;
+ * it's only for reading. */
+struct tcpflow_flow {
+  uint32_t src;
+  uint32_t dst;
+  uint16_t sport;
+  uint16_t dport;
+  int reply;			/* the other direction was seen first */
+  uint32_t isn;			/* the sequence number of offset 0 */
+  uint64_t max_bytes;		/* where the flow stops; 0 for nowhere */
+  struct timeval start;		/* when the flow was first seen */
+  struct timeval last;		/* when its last segment came */
+  uint64_t packets;		/* segments with data */
+  uint64_t bytes;		/* all the payload in them, seen before
+				 * or not */
+};
+
+/* Bytes of a flow from 'start' up to but not including 'end' */
+struct tcpflow_range {
+  uint64_t start;
+  uint64_t end;
+};
+
+/* What a context has done so far */
+struct tcpflow_stats {
+  uint64_t retransmitted;	/* segments with nothing new, dropped */
+  uint64_t retransmitted_bytes;
+  uint64_t trimmed;		/* segments partly seen before, cut */
+  uint64_t trimmed_bytes;	/* what was cut off them */
+};
+
+struct tcpflow_callbacks {
+  /* A new flow.  Whatever is put in *flow_user is passed back with
+   * the flow's data and close callbacks. */
+  void (*open)(void *user, const struct tcpflow_flow *flow,
+	       void **flow_user);
+
+  /* 'length' bytes of the flow, starting 'offset' bytes in.  The data
+   * is only good until the callback returns.  Returns how much of it
+   * was taken, from the front; only unordered cares (in order, return
+   * 'length').  What wasn't taken isn't counted as passed on, and can
+   * come again in a retransmission.  Unordered, the segment that takes
+   * a flow to its byte limit is passed on, with its offset and length
+   * adding up to the limit, even if there's nothing left of it; then
+   * the flow is closed. */
+  uint32_t (*data)(void *user, const struct tcpflow_flow *flow,
+		   void *flow_user, const unsigned char *data,
+		   uint32_t length, uint64_t offset,
+		   const struct timeval *tv);
+
+  /* The flow is over; nothing more will be said about it */
+  void (*close)(void *user, const struct tcpflow_flow *flow, void *flow_user,
+		int reason);
+};
+
+typedef struct tcpflow_ctx tcpflow_ctx;
+
+/* Find the TCP segment in an IP datagram.  Returns TCPFLOW_OK, or why
+ * there isn't one.  Doesn't need a context. */
+int tcpflow_decode_ip(const unsigned char *data, uint32_t caplen,
+		      struct tcpflow_segment *seg);
+
+/* A hash of a connection, the same for both of its directions; the
+ * low bits are good for indexing.  Handy for spreading connections
+ * over several contexts (or threads).  Doesn't need a context. */
+uint32_t tcpflow_connection_hash(uint32_t a, uint32_t b, uint16_t aport,
+				 uint16_t bport);
+
+/* Make a context that reports flows through 'callbacks' (any of which
+ * may be NULL), passing them 'user'.  Returns NULL if out of memory. */
+tcpflow_ctx *tcpflow_new(const struct tcpflow_callbacks *callbacks,
+			 void *user);
+
+/* Stop each new flow after this many bytes (0, the default: no limit) */
+void tcpflow_set_max_bytes(tcpflow_ctx *ctx, uint64_t max_bytes);
+
+/* Out-of-order bytes to hold per flow while waiting for a gap to fill;
+ * default 1M */
+void tcpflow_set_max_buffer(tcpflow_ctx *ctx, uint32_t max_buffer);
+
+/* Close flows that have been quiet for this many seconds of packet
+ * time (0, the default: never) */
+void tcpflow_set_idle_timeout(tcpflow_ctx *ctx, int seconds);
+
+/* How long to remember a connection once its flows are closed, so
+ * that its stragglers aren't taken for new flows: 60 seconds by
+ * default, or -1 for as long as the context lasts */
+void tcpflow_set_linger(tcpflow_ctx *ctx, int seconds);
+
+/* Pass segments on unordered, as they come (see above), or not */
+void tcpflow_set_unordered(tcpflow_ctx *ctx, int unordered);
+
+/* Hand the context an IP datagram, captured at 'tv'.  Returns what
+ * tcpflow_decode_ip() said about it, or -1 if out of memory. */
+int tcpflow_feed_ip(tcpflow_ctx *ctx, const unsigned char *data,
+		    uint32_t caplen, const struct timeval *tv);
+
+/* Same, for a segment the caller has decoded already */
+int tcpflow_feed_segment(tcpflow_ctx *ctx, const struct tcpflow_segment *seg,
+			 const struct timeval *tv);
+
+/* Start the flow from src:sport to dst:dport at sequence number 'isn',
+ * as if its SYN had come at 'tv'.  A flow that's open already is
+ * closed first (TCPFLOW_CLOSE_RESTART).  Returns the flow, with its
+ * flow_user in *flow_user if that isn't NULL, or NULL if out of
+ * memory. */
+const struct tcpflow_flow *tcpflow_add_flow(tcpflow_ctx *ctx, uint32_t src,
+					    uint32_t dst, uint16_t sport,
+					    uint16_t dport, uint32_t isn,
+					    const struct timeval *tv,
+					    void **flow_user);
+
+/* The flow from src:sport to dst:dport, open or closed, with its
+ * flow_user in *flow_user if that isn't NULL; NULL if there's no such
+ * flow */
+const struct tcpflow_flow *tcpflow_find_flow(tcpflow_ctx *ctx, uint32_t src,
+					     uint32_t dst, uint16_t sport,
+					     uint16_t dport, void **flow_user);
+
+/* The other direction of a flow's connection, as tcpflow_find_flow()
+ * would find it, but without looking */
+const struct tcpflow_flow *tcpflow_reverse_flow(tcpflow_ctx *ctx,
+						const struct tcpflow_flow *flow,
+						void **flow_user);
+
+/* Call fn on every flow, open or closed, in no particular order */
+void tcpflow_for_each_flow(tcpflow_ctx *ctx,
+			   void (*fn)(const struct tcpflow_flow *flow,
+				      void *flow_user, void *arg),
+			   void *arg);
+
+/* Start loading the table entry that a flow would be found in into the
+ * cache, and then, a while later (the entry has to be there first),
+ * the connection it leads to.  For going through a batch of segments
+ * without waiting on a cache miss for each in turn. */
+void tcpflow_prefetch_bucket(tcpflow_ctx *ctx, uint32_t src, uint32_t dst,
+			     uint16_t sport, uint16_t dport);
+void tcpflow_prefetch_flow(tcpflow_ctx *ctx, uint32_t src, uint32_t dst,
+			   uint16_t sport, uint16_t dport);
+
+/* Stop a flow after this many bytes (0: no limit), whatever the
+ * context's limit was when it started */
+void tcpflow_limit_flow(tcpflow_ctx *ctx, const struct tcpflow_flow *flow,
+			uint64_t max_bytes);
+
+/* Close a flow (TCPFLOW_CLOSE_STOPPED), if it's open.  May be called
+ * from a callback; from the flow's own data callback, it's closed once
+ * the callback returns, and what it took counts as passed on. */
+void tcpflow_close_flow(tcpflow_ctx *ctx, const struct tcpflow_flow *flow);
+
+/* Unordered: what of a flow has been passed on, as ranges in order of
+ * offset, which are good until it's next fed, or until its close
+ * callback returns.  Returns how many there are.  Only the last few
+ * dozen are remembered; *lost is set if any have been forgotten. */
+int tcpflow_passed(tcpflow_ctx *ctx, const struct tcpflow_flow *flow,
+		   const struct tcpflow_range **ranges, int *lost);
+
+/* Close flows that have been idle too long.  Feeding packets does
+ * this as their time goes by; call it yourself when things are quiet. */
+void tcpflow_expire(tcpflow_ctx *ctx, time_t now);
+
+void tcpflow_get_stats(tcpflow_ctx *ctx, struct tcpflow_stats *stats);
+
+/* Close every flow (TCPFLOW_CLOSE_END) and free the context */
+void tcpflow_free(tcpflow_ctx *ctx);
+
+#endif /* __LIBTCPFLOW_H__ */
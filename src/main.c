@@ -69,9 +69,119 @@ int strip_nonprint = 0;
 int print_time_per_line = 0;
 int print_datetime_per_line = 0;
 int strip_nr = 0;
+long long max_disk_bytes = 0;
+long long max_write_rate = 0;
+int limit_policy = LIMIT_STOP;
+long long prealloc_extent = 0;
+int direct_io = 0;
+char *output_dir = NULL;
+int shard_mode = SHARD_NONE;
+long shard_param = 0;
+char *checkpoint_file = NULL;
+int checkpoint_interval = 60;
+char *shm_ring_name = NULL;
+long long shm_ring_size = 16 * 1024 * 1024;
+char *serve_path = NULL;
+long long serve_queue_size = 1024 * 1024;
+int serve_clients = 0;
+int batch_size = 32;
+int refilter_flows = 0;
+long long capture_ring_size = 0;
+int fanout_group = -1;
+int fanout_flags = 0;
+int combined_output = 0;
+long dedup_window = 0;
+int fast_filter = 0;
+char *stream_path = NULL;
+char *manifest_path = NULL;
+char *manifest_csv_path = NULL;
+char *ngram_index_path = NULL;
+int stats_only = 0;
+int build_indexes = 0;
+int no_index = 0;
+time_t time_range_from = 0;
+time_t time_range_to = 0;
+int shed_lag = 2;
+
+volatile sig_atomic_t stats_requested = 0;
+volatile sig_atomic_t terminate_requested = 0;
 
 char error[PCAP_ERRBUF_SIZE];
 
+/* Options that only have a long form */
+enum {
+  OPT_MAX_DISK = 256,
+  OPT_MAX_RATE,
+  OPT_LIMIT_POLICY,
+  OPT_PREALLOC,
+  OPT_DIRECT_IO,
+  OPT_OUTPUT_DIR,
+  OPT_SHARD,
+  OPT_CHECKPOINT,
+  OPT_CHECKPOINT_INTERVAL,
+  OPT_SHM_RING,
+  OPT_SHM_RING_SIZE,
+  OPT_SERVE,
+  OPT_SERVE_QUEUE,
+  OPT_SERVE_CLIENTS,
+  OPT_BATCH,
+  OPT_REFILTER,
+  OPT_CAPTURE_RING,
+  OPT_FANOUT,
+  OPT_COMBINED,
+  OPT_DEDUP,
+  OPT_FAST_FILTER,
+  OPT_STREAM_BINARY,
+  OPT_MANIFEST,
+  OPT_MANIFEST_CSV,
+  OPT_BUILD_INDEX,
+  OPT_NO_INDEX,
+  OPT_TIME_RANGE,
+  OPT_SHED,
+  OPT_PRIORITY_PORTS,
+  OPT_SHED_LAG,
+  OPT_PACE,
+  OPT_NGRAM_INDEX,
+  OPT_STATS_ONLY
+};
+
+static struct option long_options[] = {
+  { "max-disk", required_argument, NULL, OPT_MAX_DISK },
+  { "max-rate", required_argument, NULL, OPT_MAX_RATE },
+  { "limit-policy", required_argument, NULL, OPT_LIMIT_POLICY },
+  { "prealloc", optional_argument, NULL, OPT_PREALLOC },
+  { "direct-io", no_argument, NULL, OPT_DIRECT_IO },
+  { "output-dir", required_argument, NULL, OPT_OUTPUT_DIR },
+  { "shard", required_argument, NULL, OPT_SHARD },
+  { "checkpoint", required_argument, NULL, OPT_CHECKPOINT },
+  { "checkpoint-interval", required_argument, NULL, OPT_CHECKPOINT_INTERVAL },
+  { "shm-ring", required_argument, NULL, OPT_SHM_RING },
+  { "shm-ring-size", required_argument, NULL, OPT_SHM_RING_SIZE },
+  { "serve", required_argument, NULL, OPT_SERVE },
+  { "serve-queue", required_argument, NULL, OPT_SERVE_QUEUE },
+  { "serve-clients", required_argument, NULL, OPT_SERVE_CLIENTS },
+  { "batch", required_argument, NULL, OPT_BATCH },
+  { "refilter", required_argument, NULL, OPT_REFILTER },
+  { "capture-ring", required_argument, NULL, OPT_CAPTURE_RING },
+  { "fanout", required_argument, NULL, OPT_FANOUT },
+  { "combined", no_argument, NULL, OPT_COMBINED },
+  { "dedup", optional_argument, NULL, OPT_DEDUP },
+  { "fast-filter", no_argument, NULL, OPT_FAST_FILTER },
+  { "stream-binary", required_argument, NULL, OPT_STREAM_BINARY },
+  { "manifest", required_argument, NULL, OPT_MANIFEST },
+  { "manifest-csv", required_argument, NULL, OPT_MANIFEST_CSV },
+  { "build-index", no_argument, NULL, OPT_BUILD_INDEX },
+  { "no-index", no_argument, NULL, OPT_NO_INDEX },
+  { "time-range", required_argument, NULL, OPT_TIME_RANGE },
+  { "shed", required_argument, NULL, OPT_SHED },
+  { "priority-ports", required_argument, NULL, OPT_PRIORITY_PORTS },
+  { "shed-lag", required_argument, NULL, OPT_SHED_LAG },
+  { "pace", required_argument, NULL, OPT_PACE },
+  { "ngram-index", required_argument, NULL, OPT_NGRAM_INDEX },
+  { "stats-only", no_argument, NULL, OPT_STATS_ONLY },
+  { NULL, 0, NULL, 0 }
+};
+
 
 void print_usage(char *progname)
 {
@@ -86,23 +196,200 @@ void print_usage(char *progname)
   fprintf(stderr, "        -f: maximum number of file descriptors to use\n");
   fprintf(stderr, "        -h: print this help message\n");
   fprintf(stderr, "        -i: network interface on which to listen\n");
-  fprintf(stderr, "            (type \"ifconfig -a\" for a list of interfaces)\n");
+  fprintf(stderr, "            (type \"ifconfig -a\" for a list of interfaces);\n");
+  fprintf(stderr, "            may be given more than once\n");
   fprintf(stderr, "        -p: don't use promiscuous mode\n");
-  fprintf(stderr, "        -r: read packets from tcpdump output file\n");
+  fprintf(stderr, "        -r: read packets from tcpdump output file; may be given\n");
+  fprintf(stderr, "            more than once\n");
   fprintf(stderr, "        -s: strip non-printable characters (change to '.')\n");
   fprintf(stderr, "        -v: verbose operation equivalent to -d 10\n");
   fprintf(stderr, "        -t: add time to the output\n");
   fprintf(stderr, "        -x: add date & time to the output\n");
   fprintf(stderr, "        -o: strip end-of-line characters (change to '.')\n");
+  fprintf(stderr, "        --max-disk bytes: total bytes of flow data to keep on disk\n");
+  fprintf(stderr, "        --max-rate bytes: max bytes per second written to disk\n");
+  fprintf(stderr, "        --limit-policy stop|truncate|delete: what to do when\n");
+  fprintf(stderr, "            --max-disk or --max-rate is reached; default is stop\n");
+  fprintf(stderr, "        --prealloc[=bytes]: preallocate flow files (up to -b, or in\n");
+  fprintf(stderr, "            growing extents starting at bytes; default 1M)\n");
+  fprintf(stderr, "        --direct-io: write flow files with O_DIRECT\n");
+  fprintf(stderr, "        --output-dir dir: write flow files under dir\n");
+  fprintf(stderr, "        --shard hash[:n]|time[:secs]: spread flow files over n\n");
+  fprintf(stderr, "            hashed subdirectories (default 256), or one per secs\n");
+  fprintf(stderr, "            seconds of start time (default 3600)\n");
+  fprintf(stderr, "        --checkpoint file: save the flow table to file, and pick up\n");
+  fprintf(stderr, "            where we left off if it's already there\n");
+  fprintf(stderr, "        --checkpoint-interval secs: how often to save it; default 60\n");
+  fprintf(stderr, "        --shm-ring name: publish flow data to a shared memory ring\n");
+  fprintf(stderr, "            instead of writing files\n");
+  fprintf(stderr, "        --shm-ring-size bytes: size of the ring; default 16M\n");
+  fprintf(stderr, "        --serve path: stream flow data to subscribers on a Unix\n");
+  fprintf(stderr, "            socket instead of writing files\n");
+  fprintf(stderr, "        --serve-queue bytes: queue per subscriber; default 1M\n");
+  fprintf(stderr, "        --serve-clients n: wait for n subscribers before starting\n");
+  fprintf(stderr, "        --batch n: handle packets n at a time; default 32, 1 for\n");
+  fprintf(stderr, "            one at a time\n");
+  fprintf(stderr, "        --refilter n: keep the n busiest finished flows out of\n");
+  fprintf(stderr, "            the packet filter\n");
+  fprintf(stderr, "        --capture-ring bytes: capture on a separate thread into a\n");
+  fprintf(stderr, "            ring of this size\n");
+  fprintf(stderr, "        --fanout id[:rollover,defrag]: share the interface with\n");
+  fprintf(stderr, "            the other processes in Linux packet fanout group id\n");
+  fprintf(stderr, "        --combined: write both directions of a connection into\n");
+  fprintf(stderr, "            one file, as timestamped records\n");
+  fprintf(stderr, "        --dedup[=usecs]: drop copies of a packet seen again within\n");
+  fprintf(stderr, "            usecs microseconds (default 10000), as from a SPAN port\n");
+  fprintf(stderr, "        --fast-filter: with -r, match simple host/net/port\n");
+  fprintf(stderr, "            expressions natively instead of through libpcap\n");
+  fprintf(stderr, "        --stream-binary file: write flow data to file (- for\n");
+  fprintf(stderr, "            stdout) as binary records instead of writing files\n");
+  fprintf(stderr, "        --manifest file: list every flow, with its times, sizes and\n");
+  fprintf(stderr, "            gaps, in binary file\n");
+  fprintf(stderr, "        --manifest-csv file: the same, as CSV\n");
+  fprintf(stderr, "        --build-index: index each -r file, so later runs can\n");
+  fprintf(stderr, "            read just the flows or times they want, and exit\n");
+  fprintf(stderr, "        --no-index: read -r files in full, even if indexed\n");
+  fprintf(stderr, "        --time-range [from],[to]: only packets captured from\n");
+  fprintf(stderr, "            (and not at or after) these times, in seconds since 1970\n");
+  fprintf(stderr, "        --shed refuse|flows=n|bytes=n[,...]: when falling behind a\n");
+  fprintf(stderr, "            live capture, refuse new flows, refuse them while n\n");
+  fprintf(stderr, "            are active, or keep only their first n bytes\n");
+  fprintf(stderr, "        --priority-ports port[-port][,...]: flows never shed\n");
+  fprintf(stderr, "        --shed-lag secs: how far behind is falling behind;\n");
+  fprintf(stderr, "            default 2\n");
+  fprintf(stderr, "        --pace realtime|Nx|Npps|Nbps: with -r, replay packets at\n");
+  fprintf(stderr, "            the speed they were captured, N times that, or N\n");
+  fprintf(stderr, "            packets or bits a second\n");
+  fprintf(stderr, "        --ngram-index file: index the trigrams in each flow\n");
+  fprintf(stderr, "            file, for searching with tcpflow-search\n");
+  fprintf(stderr, "        --stats-only: don't write flow data; list each connection's\n");
+  fprintf(stderr, "            counts and handshake times in the manifest as it ends\n");
   fprintf(stderr, "expression: tcpdump-like filtering expression\n");
   fprintf(stderr, "\nSee the man page for additional information.\n\n");
 }
 
 
+/* Report what we've been up to */
+void print_stats()
+{
+  print_capture_stats();
+  print_decompress_stats();
+  print_writer_stats();
+  print_flow_stats();
+  print_ring_stats();
+  print_server_stats();
+  print_filter_stats();
+  print_dedup_stats();
+  print_fast_filter_stats();
+  print_stream_stats();
+  print_manifest_stats();
+  print_accounting_stats();
+  print_ngram_stats();
+  print_index_stats();
+  print_shed_stats();
+  print_pace_stats();
+}
+
+
+/* Shutting down isn't safe in a signal handler, and the capture
+ * threads may be busy; the capture loops see this, stop, and main()
+ * finishes up as it does at the end of the files */
 RETSIGTYPE terminate(int sig)
 {
-  DEBUG(1) ("terminating");
-  exit(0); /* libpcap uses onexit to clean up */
+  terminate_requested = 1;
+}
+
+
+/* Statistics are printed from the packet path, not from here */
+RETSIGTYPE request_stats(int sig)
+{
+  stats_requested = 1;
+}
+
+
+/* Parse the argument of --fanout: a group id, optionally followed by
+ * a colon and a comma-separated list of flags */
+static int parse_fanout(char *arg)
+{
+  char *flag, *end;
+
+  fanout_group = strtol(arg, &end, 10);
+  if (end == arg || fanout_group < 0 || fanout_group > 0xffff)
+    return -1;
+  if (*end == '\0')
+    return 0;
+  if (*end != ':')
+    return -1;
+
+  for (flag = strtok(end + 1, ","); flag != NULL; flag = strtok(NULL, ",")) {
+    if (!strcmp(flag, "rollover"))
+      fanout_flags |= FANOUT_ROLLOVER;
+    else if (!strcmp(flag, "defrag"))
+      fanout_flags |= FANOUT_DEFRAG;
+    else
+      return -1;
+  }
+
+  return 0;
+}
+
+
+/* Parse the argument of --time-range: two times in seconds, separated
+ * by a comma, either of which may be left out */
+static int parse_time_range(char *arg)
+{
+  char *comma, *end;
+
+  if ((comma = strchr(arg, ',')) == NULL)
+    return -1;
+
+  if (comma != arg) {
+    time_range_from = strtol(arg, &end, 10);
+    if (end != comma || time_range_from <= 0)
+      return -1;
+  }
+  if (comma[1] != '\0') {
+    time_range_to = strtol(comma + 1, &end, 10);
+    if (*end != '\0' || time_range_to <= 0)
+      return -1;
+  }
+
+  if (time_range_to && time_range_to <= time_range_from)
+    return -1;
+  return 0;
+}
+
+
+/* Install the filter expression in libpcap.  Returns 0 if this source
+ * had to go without one. */
+static int install_filter(pcap_t *pd, char *expression, int user_expression)
+{
+  struct bpf_program fcode;
+
+  /* If DLT_NULL is "broken", giving *any* expression to the pcap
+   * library when we are using a device of type DLT_NULL causes no
+   * packets to be delivered.  In this case, we use no expression, and
+   * print a warning message if there is a user-specified expression */
+#ifdef DLT_NULL_BROKEN
+  if (pcap_datalink(pd) == DLT_NULL && expression != NULL) {
+    expression = NULL;
+    if (user_expression) {
+      DEBUG(1)("warning: DLT_NULL (loopback device) is broken on your system;");
+      DEBUG(1)("         filtering does not work.  Recording *all* packets.");
+    }
+  }
+#endif /* DLT_NULL_BROKEN */
+
+  DEBUG(20) ("filter expression: '%s'",
+	     expression == NULL ? "<NULL>" : expression);
+
+  if (pcap_compile(pd, &fcode, expression, 1, 0) < 0)
+    die("%s", pcap_geterr(pd));
+
+  if (pcap_setfilter(pd, &fcode) < 0)
+    die("%s", pcap_geterr(pd));
+
+  return expression != NULL;
 }
 
 
@@ -112,21 +399,24 @@ int main(int argc, char *argv[])
   extern int opterr;
   extern int optopt;
   extern char *optarg;
-  int arg, dlt, user_expression = 0;
+  int arg, rc, user_expression = 0;
   int need_usage = 0;
+  int i, live, num_sources, filterable = 0;
 
-  char *device = NULL;
-  char *infile = NULL;
+  char *devices[MAX_SOURCES];
+  char *infiles[MAX_SOURCES];
+  int num_devices = 0, num_infiles = 0;
   char *expression = NULL;
   pcap_t *pd;
-  struct bpf_program fcode;
   pcap_handler handler;
+  FILE *fp;
 
   init_debug(argv);
 
   opterr = 0;
 
-  while ((arg = getopt(argc, argv, "b:cd:f:hi:pr:svtxo")) != EOF) {
+  while ((arg = getopt_long(argc, argv, "b:cd:f:hi:pr:svtxo", long_options,
+			    NULL)) != EOF) {
     switch (arg) {
     case 'b':
       if ((bytes_per_flow = atoi(optarg)) < 0) {
@@ -174,18 +464,244 @@ int main(int argc, char *argv[])
       exit(0);
       break;
     case 'i':
-      device = optarg;
+      if (num_devices == MAX_SOURCES)
+	die("can't capture from more than %d interfaces", MAX_SOURCES);
+      devices[num_devices++] = optarg;
       break;
     case 'p':
       no_promisc = 1;
       DEBUG(10) ("NOT turning on promiscuous mode");
       break;
     case 'r':
-      infile = optarg;
+      if (num_infiles == MAX_SOURCES)
+	die("can't read more than %d files", MAX_SOURCES);
+      infiles[num_infiles++] = optarg;
       break;
     case 'v':
       debug_level = 10;
       break;
+    case OPT_MAX_DISK:
+      if ((max_disk_bytes = parse_size(optarg)) <= 0) {
+	DEBUG(1) ("warning: invalid value '%s' used with --max-disk ignored",
+		  optarg);
+	max_disk_bytes = 0;
+      } else {
+	DEBUG(10) ("keeping at most %lld bytes on disk", max_disk_bytes);
+      }
+      break;
+    case OPT_MAX_RATE:
+      if ((max_write_rate = parse_size(optarg)) <= 0) {
+	DEBUG(1) ("warning: invalid value '%s' used with --max-rate ignored",
+		  optarg);
+	max_write_rate = 0;
+      } else {
+	DEBUG(10) ("writing at most %lld bytes per second", max_write_rate);
+      }
+      break;
+    case OPT_LIMIT_POLICY:
+      if (!strcmp(optarg, "stop"))
+	limit_policy = LIMIT_STOP;
+      else if (!strcmp(optarg, "truncate"))
+	limit_policy = LIMIT_TRUNCATE;
+      else if (!strcmp(optarg, "delete"))
+	limit_policy = LIMIT_DELETE;
+      else {
+	DEBUG(1) ("error: unknown --limit-policy '%s'", optarg);
+	need_usage = 1;
+      }
+      break;
+    case OPT_PREALLOC:
+#if !defined(HAVE_FALLOCATE) && !defined(HAVE_POSIX_FALLOCATE)
+      die("--prealloc is not supported on this system");
+#endif
+      if (optarg == NULL) {
+	prealloc_extent = 1024 * 1024;
+      } else if ((prealloc_extent = parse_size(optarg)) <= 0) {
+	DEBUG(1) ("warning: invalid value '%s' used with --prealloc ignored",
+		  optarg);
+	prealloc_extent = 0;
+	break;
+      }
+      DEBUG(10) ("preallocating flow files in extents of %lld bytes",
+		 prealloc_extent);
+      break;
+    case OPT_DIRECT_IO:
+#ifndef O_DIRECT
+      die("--direct-io is not supported on this system");
+#endif
+      direct_io = 1;
+      DEBUG(10) ("writing flow files with direct I/O");
+      break;
+    case OPT_OUTPUT_DIR:
+      output_dir = optarg;
+      break;
+    case OPT_SHARD:
+      if (!strncmp(optarg, "hash", 4)) {
+	shard_mode = SHARD_HASH;
+	shard_param = 256;
+      } else if (!strncmp(optarg, "time", 4)) {
+	shard_mode = SHARD_TIME;
+	shard_param = 3600;
+      } else {
+	DEBUG(1) ("error: unknown --shard mode '%s'", optarg);
+	need_usage = 1;
+	break;
+      }
+      if (optarg[4] == ':')
+	shard_param = atol(optarg + 5);
+      else if (optarg[4] != '\0')
+	shard_param = 0;
+      if (shard_param <= 0 || (shard_mode == SHARD_HASH && shard_param > 4096)) {
+	DEBUG(1) ("error: bad --shard argument '%s'", optarg);
+	need_usage = 1;
+      }
+      break;
+    case OPT_CHECKPOINT:
+#ifndef HAVE_SYS_MMAN_H
+      die("--checkpoint is not supported on this system");
+#endif
+      checkpoint_file = optarg;
+      DEBUG(10) ("checkpointing the flow table to %s", checkpoint_file);
+      break;
+    case OPT_CHECKPOINT_INTERVAL:
+      if ((checkpoint_interval = atoi(optarg)) <= 0) {
+	DEBUG(1) ("warning: invalid value '%s' used with --checkpoint-interval "
+		  "ignored", optarg);
+	checkpoint_interval = 60;
+      }
+      break;
+    case OPT_SHM_RING:
+#ifndef HAVE_SHM_OPEN
+      die("--shm-ring is not supported on this system");
+#endif
+      shm_ring_name = optarg;
+      break;
+    case OPT_SHM_RING_SIZE:
+      if ((shm_ring_size = parse_size(optarg)) <= 0) {
+	DEBUG(1) ("warning: invalid value '%s' used with --shm-ring-size "
+		  "ignored", optarg);
+	shm_ring_size = 16 * 1024 * 1024;
+      }
+      break;
+    case OPT_SERVE:
+#ifndef HAVE_SYS_EPOLL_H
+      die("--serve is not supported on this system");
+#endif
+      serve_path = optarg;
+      break;
+    case OPT_SERVE_QUEUE:
+      if ((serve_queue_size = parse_size(optarg)) < 65536 ||
+	  serve_queue_size > 0x7fffffff) {
+	DEBUG(1) ("warning: invalid value '%s' used with --serve-queue "
+		  "ignored", optarg);
+	serve_queue_size = 1024 * 1024;
+      }
+      break;
+    case OPT_SERVE_CLIENTS:
+      if ((serve_clients = atoi(optarg)) < 0)
+	serve_clients = 0;
+      break;
+    case OPT_BATCH:
+      if ((batch_size = atoi(optarg)) < 1 || batch_size > 1024) {
+	DEBUG(1) ("warning: invalid value '%s' used with --batch ignored",
+		  optarg);
+	batch_size = 32;
+      }
+      break;
+    case OPT_REFILTER:
+      if ((refilter_flows = atoi(optarg)) < 0 || refilter_flows > 1000) {
+	DEBUG(1) ("warning: invalid value '%s' used with --refilter ignored",
+		  optarg);
+	refilter_flows = 0;
+      }
+      break;
+    case OPT_CAPTURE_RING:
+#ifndef HAVE_PTHREAD_CREATE
+      die("--capture-ring is not supported on this system");
+#endif
+      if ((capture_ring_size = parse_size(optarg)) <= 0) {
+	DEBUG(1) ("warning: invalid value '%s' used with --capture-ring "
+		  "ignored", optarg);
+	capture_ring_size = 0;
+      }
+      break;
+    case OPT_FANOUT:
+#if !defined(HAVE_LINUX_IF_PACKET_H) || !defined(PACKET_FANOUT)
+      die("--fanout is not supported on this system");
+#endif
+      if (parse_fanout(optarg) < 0) {
+	DEBUG(1) ("error: bad --fanout argument '%s'", optarg);
+	need_usage = 1;
+      }
+      break;
+    case OPT_COMBINED:
+      combined_output = 1;
+      DEBUG(10) ("writing both directions of each connection to one file");
+      break;
+    case OPT_DEDUP:
+      if (optarg == NULL) {
+	dedup_window = 10000;
+      } else if ((dedup_window = atol(optarg)) <= 0) {
+	DEBUG(1) ("warning: invalid value '%s' used with --dedup ignored",
+		  optarg);
+	dedup_window = 0;
+      }
+      break;
+    case OPT_FAST_FILTER:
+      fast_filter = 1;
+      break;
+    case OPT_STREAM_BINARY:
+      stream_path = optarg;
+      break;
+    case OPT_MANIFEST:
+      manifest_path = optarg;
+      break;
+    case OPT_MANIFEST_CSV:
+      manifest_csv_path = optarg;
+      break;
+    case OPT_BUILD_INDEX:
+      build_indexes = 1;
+      break;
+    case OPT_NO_INDEX:
+      no_index = 1;
+      break;
+    case OPT_SHED:
+      if (parse_shed_policy(optarg) < 0) {
+	DEBUG(1) ("error: bad --shed argument '%s'", optarg);
+	need_usage = 1;
+      }
+      break;
+    case OPT_PRIORITY_PORTS:
+      if (parse_priority_ports(optarg) < 0) {
+	DEBUG(1) ("error: bad --priority-ports argument '%s'", optarg);
+	need_usage = 1;
+      }
+      break;
+    case OPT_SHED_LAG:
+      if ((shed_lag = atoi(optarg)) < 1) {
+	DEBUG(1) ("warning: invalid value '%s' used with --shed-lag ignored",
+		  optarg);
+	shed_lag = 2;
+      }
+      break;
+    case OPT_PACE:
+      if (parse_pace(optarg) < 0) {
+	DEBUG(1) ("error: bad --pace argument '%s'", optarg);
+	need_usage = 1;
+      }
+      break;
+    case OPT_NGRAM_INDEX:
+      ngram_index_path = optarg;
+      break;
+    case OPT_STATS_ONLY:
+      stats_only = 1;
+      break;
+    case OPT_TIME_RANGE:
+      if (parse_time_range(optarg) < 0) {
+	DEBUG(1) ("error: bad --time-range argument '%s'", optarg);
+	need_usage = 1;
+      }
+      break;
     default:
       DEBUG(1) ("error: unrecognized switch '%c'", optopt);
       need_usage = 1;
@@ -193,6 +709,79 @@ int main(int argc, char *argv[])
     }
   }
 
+  /* several sources are read by capture threads, through rings */
+  num_sources = num_infiles ? num_infiles : num_devices;
+  if (num_sources > 1) {
+#ifndef HAVE_PTHREAD_CREATE
+    die("capturing from more than one source is not supported on this system");
+#endif
+    if (serve_path != NULL) {
+      DEBUG(1) ("error: --serve can only capture from one source");
+      need_usage = 1;
+    } else if (capture_ring_size == 0) {
+      capture_ring_size = 16 * 1024 * 1024;
+    }
+  } else if (capture_ring_size && serve_path != NULL) {
+    DEBUG(1) ("error: --capture-ring can't be used with --serve");
+    need_usage = 1;
+  }
+
+  if (build_indexes && num_infiles == 0) {
+    DEBUG(1) ("error: --build-index needs -r");
+    need_usage = 1;
+  }
+
+  /* a live capture is better off with the kernel's filter */
+  if (fast_filter && num_infiles == 0) {
+    DEBUG(1) ("warning: --fast-filter only works with -r; ignored");
+    fast_filter = 0;
+  }
+
+  /* the stream is the output; there's nothing for -c to print */
+  if (stream_path != NULL && console_only) {
+    DEBUG(1) ("error: --stream-binary can't be used with -c");
+    need_usage = 1;
+  }
+
+  /* -c doesn't keep track of flows */
+  if ((manifest_path != NULL || manifest_csv_path != NULL) && console_only) {
+    DEBUG(1) ("error: --manifest can't be used with -c");
+    need_usage = 1;
+  }
+
+  /* the index is of flow files, as they're written */
+  if (ngram_index_path != NULL &&
+      (console_only || shm_ring_name != NULL || serve_path != NULL ||
+       stream_path != NULL)) {
+    DEBUG(1) ("error: --ngram-index can't be used with -c, --shm-ring, "
+	      "--serve or --stream-binary");
+    need_usage = 1;
+  }
+
+  /* combined files are only written by write_packet(), and aren't
+   * part of the checkpoint */
+  if (combined_output &&
+      (checkpoint_file != NULL || shm_ring_name != NULL ||
+       serve_path != NULL || stream_path != NULL)) {
+    DEBUG(1) ("error: --combined can't be used with --checkpoint, --shm-ring, "
+	      "--serve or --stream-binary");
+    need_usage = 1;
+  }
+
+  /* with --stats-only there's no flow data to go anywhere; the counts
+   * go in the manifest, or to stdout as CSV if there isn't one */
+  if (stats_only &&
+      (console_only || checkpoint_file != NULL || shm_ring_name != NULL ||
+       serve_path != NULL || stream_path != NULL || combined_output ||
+       ngram_index_path != NULL)) {
+    DEBUG(1) ("error: --stats-only can't be used with -c, --checkpoint, "
+	      "--shm-ring, --serve, --stream-binary, --combined or "
+	      "--ngram-index");
+    need_usage = 1;
+  }
+  if (stats_only && manifest_path == NULL && manifest_csv_path == NULL)
+    manifest_csv_path = "-";
+
   /* print help and exit if there was an error in the arguments */
   if (need_usage) {
     print_usage(argv[0]);
@@ -204,38 +793,28 @@ int main(int argc, char *argv[])
 	"(patched by Andrey Mukhin <a.mukhin77@gmail.com>)",
 	PACKAGE, VERSION);
 
-  if (infile != NULL) {
-    /* Since we don't need network access, drop root privileges */
-    setuid(getuid());
-
-    /* open the capture file */
-    if ((pd = pcap_open_offline(infile, error)) == NULL)
-      die("%s", error);
-
-    /* get the handler for this kind of packets */
-    dlt = pcap_datalink(pd);
-    handler = find_handler(dlt, infile);
-  } else {
-    /* if the user didn't specify a device, try to find a reasonable one */
-    if (device == NULL)
-      if ((device = pcap_lookupdev(error)) == NULL)
-	die("%s", error);
-
-    /* make sure we can open the device */
-    if ((pd = pcap_open_live(device, SNAPLEN, !no_promisc, 1000, error)) == NULL)
-      die("%s", error);
-
-    /* drop root privileges - we don't need them any more */
-    setuid(getuid());
-
-    /* get the handler for this kind of packets */
-    dlt = pcap_datalink(pd);
-    handler = find_handler(dlt, device);
+  /* index the files, and that's all.  An index covers every flow, so
+   * there's no expression for --fast-filter to match. */
+  if (build_indexes) {
+    fast_filter = 0;
+    for (i = 0; i < num_infiles; i++)
+      build_index(infiles[i]);
+    exit(0);
   }
 
   /* get the user's expression out of argv */
   expression = copy_argv(&argv[optind]);
 
+  /* a file's index can only pick out the flows the expression wants if
+   * we're matching it ourselves */
+  if (expression != NULL && !no_index)
+    for (i = 0; i < num_infiles; i++)
+      if (have_index(infiles[i]))
+	fast_filter = 1;
+
+  /* see if we can do the filtering ourselves */
+  init_fast_filter(expression);
+
   /* add 'ip' to the user-specified filtering expression (if any) to
    * prevent non-ip packets from being delivered. */
   if (expression == NULL) {
@@ -249,46 +828,125 @@ int main(int argc, char *argv[])
     user_expression = 1;
   }
 
-  /* If DLT_NULL is "broken", giving *any* expression to the pcap
-   * library when we are using a device of type DLT_NULL causes no
-   * packets to be delivered.  In this case, we use no expression, and
-   * print a warning message if there is a user-specified expression */
-#ifdef DLT_NULL_BROKEN
-  if (dlt == DLT_NULL && expression != NULL) {
-    free(expression);
-    expression = NULL;
-    if (user_expression) {
-      DEBUG(1)("warning: DLT_NULL (loopback device) is broken on your system;");
-      DEBUG(1)("         filtering does not work.  Recording *all* packets.");
+  if (num_infiles > 0) {
+    /* Since we don't need network access, drop root privileges */
+    setuid(getuid());
+
+    for (i = 0; i < num_infiles; i++) {
+      /* open the capture file, decompressing it on the way in if it
+       * needs it */
+      if ((fp = open_compressed(infiles[i])) != NULL)
+	pd = pcap_fopen_offline(fp, error);
+      else
+	pd = pcap_open_offline(infiles[i], error);
+      if (pd == NULL)
+	die("%s", error);
+
+      /* get the handler for this kind of packets */
+      handler = find_handler(pcap_datalink(pd), infiles[i]);
+
+      /* with --fast-filter, libpcap gets no filter at all */
+      if (!fast_filter)
+	filterable |= rc = install_filter(pd, expression, user_expression);
+      else
+	rc = 0;
+      add_capture_source(pd, infiles[i], handler, rc);
+
+      /* read only what we need, if the file has an index */
+      if (!no_index)
+	select_from_index(pd, infiles[i], fast_filter && user_expression);
+    }
+  } else {
+    /* if the user didn't specify a device, try to find a reasonable one */
+    if (num_devices == 0) {
+      if ((devices[0] = pcap_lookupdev(error)) == NULL)
+	die("%s", error);
+      num_devices = 1;
     }
-  }
-#endif /* DLT_NULL_BROKEN */
 
-  DEBUG(20) ("filter expression: '%s'",
-	     expression == NULL ? "<NULL>" : expression);
+    for (i = 0; i < num_devices; i++) {
+      /* make sure we can open the device */
+      if ((pd = pcap_open_live(devices[i], SNAPLEN, !no_promisc, 1000,
+			       error)) == NULL)
+	die("%s", error);
 
-  /* install the filter expression in libpcap */
-  if (pcap_compile(pd, &fcode, expression, 1, 0) < 0)
-    die("%s", pcap_geterr(pd));
+      /* get the handler for this kind of packets */
+      handler = find_handler(pcap_datalink(pd), devices[i]);
 
-  if (pcap_setfilter(pd, &fcode) < 0)
-    die("%s", pcap_geterr(pd));
+      filterable |= rc = install_filter(pd, expression, user_expression);
+      add_capture_source(pd, devices[i], handler, rc);
+
+      /* each interface needs a group of its own */
+      if (fanout_group >= 0)
+	join_fanout(pd, devices[i], fanout_group + i);
+    }
+
+    /* drop root privileges - we don't need them any more */
+    setuid(getuid());
+  }
+
+  /* we may be changing the filter later on */
+  init_refilter(filterable ? expression : NULL);
 
   /* initialize our flow state structures */
+  init_output_dir();
   init_flow_state();
+  init_writer();
+  load_checkpoint();
+  init_shm_ring();
+  init_server();
+  init_stream();
+  init_manifest();
+  init_ngram_index();
+  init_dedup();
+  init_shed(num_infiles == 0);
+  init_pace(num_infiles == 0);
+  init_batch();
+  init_capture_ring();
 
   /* set up signal handlers for graceful exit (pcap uses onexit to put
      interface back into non-promiscuous mode */
   portable_signal(SIGTERM, terminate);
   portable_signal(SIGINT, terminate);
   portable_signal(SIGHUP, terminate);
+#ifdef SIGUSR1
+  portable_signal(SIGUSR1, request_stats);
+#endif
+
+  /* start listening!  With just one source, pd and handler are
+   * still the ones we opened it with. */
+  live = (num_infiles == 0);
+  if (live)
+    for (i = 0; i < num_devices; i++)
+      DEBUG(1) ("listening on %s", devices[i]);
+  if (serve_path != NULL) {
+    if (serve_loop(pd, handler, live) < 0 && !terminate_requested)
+      die("%s", pcap_geterr(pd));
+  } else if (capture_ring_size) {
+    capture_loop(live);
+  } else {
+    /* like pcap_loop(), but the batch is handled every time
+     * pcap_dispatch() comes back to us, and a live capture's read
+     * timeout brings us back to see if we've been told to stop */
+    do {
+      rc = capture_dispatch(pd, -1, handler);
+    } while (!terminate_requested && (rc > 0 || (rc == 0 && live)));
+    if (rc < 0 && !terminate_requested)
+      die("%s", pcap_geterr(pd));
+  }
 
-  /* start listening! */
-  if (infile == NULL)
-    DEBUG(1) ("listening on %s", device);
-  if (pcap_loop(pd, -1, handler, NULL) < 0)
-    die("%s", pcap_geterr(pd));
-
-  /* NOTREACHED */
+  /* we get here at the end of the files, or when a signal told us to
+   * stop */
+  if (terminate_requested)
+    DEBUG(1) ("terminating");
+  flush_batch();
+  close_all_files();
+  save_checkpoint();
+  close_manifest();
+  close_ngram_index();
+  close_stream();
+  print_stats();
+  close_shm_ring();
+  close_server();
   return 0;
 }
@@ -0,0 +1,270 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * --manifest and --manifest-csv: a list of the flows we've seen, with
+ * their first and last packet times, how much data they carried, how
+ * much of it we wrote, the holes in it and why they ended, in one
+ * file (see manifest.h) rather than spread over a directory tree.
+ *
+ * Each flow is listed when it finishes, when its connection ends with
+ * a RST or a FIN each way, or when we exit if neither happens.  Binary
+ * records are collected in a buffer and written out a batch at a time:
+ * when the buffer fills up, when a minute of packet time has passed
+ * since the last batch, and at exit.  The CSV file goes through stdio,
+ * which batches it for us.
+ */
+
+#include "tcpflow.h"
+#include "manifest.h"
+
+extern char *manifest_path;
+extern char *manifest_csv_path;
+extern int combined_output;
+extern tcpflow_ctx *flow_table;
+
+#define MANIFEST_BATCH	1024	/* records written at a time */
+#define MANIFEST_FLUSH	60	/* most seconds a record waits */
+
+static int manifest_fd = -1;
+static FILE *csv_fp;
+static struct manifest_rec *batch;
+static int batch_used;
+static time_t batch_start;
+
+static long long flows_listed;
+static long long batches;
+
+static const char *reason_names[] = {
+  "open", "fin", "rst", "limit", "output", "shed"
+};
+
+
+/* Open the binary manifest, or check that the one that's already
+ * there is the kind we write */
+static void open_manifest()
+{
+  struct manifest_header hdr;
+  off_t end;
+
+  if ((manifest_fd = open(manifest_path, O_WRONLY | O_CREAT | O_APPEND,
+			  0666)) < 0)
+    die("can't open %s: %s", manifest_path, strerror(errno));
+
+  if ((end = lseek(manifest_fd, 0, SEEK_END)) > 0) {
+    int fd = open(manifest_path, O_RDONLY);
+
+    if (fd < 0 || read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	hdr.magic != MANIFEST_MAGIC || hdr.version != MANIFEST_VERSION ||
+	hdr.record_size != sizeof(struct manifest_rec))
+      die("%s isn't a tcpflow manifest we can add to", manifest_path);
+    close(fd);
+    DEBUG(10) ("adding to manifest %s", manifest_path);
+    return;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = MANIFEST_MAGIC;
+  hdr.version = MANIFEST_VERSION;
+  hdr.record_size = sizeof(struct manifest_rec);
+  if (write(manifest_fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+    die("error writing %s: %s", manifest_path, strerror(errno));
+}
+
+
+void init_manifest()
+{
+  if (manifest_path != NULL) {
+    open_manifest();
+    batch = MALLOC(struct manifest_rec, MANIFEST_BATCH);
+    batch_used = 0;
+  }
+
+  if (manifest_csv_path != NULL) {
+    if (!strcmp(manifest_csv_path, "-"))
+      csv_fp = stdout;
+    else if ((csv_fp = fopen(manifest_csv_path, "a")) == NULL)
+      die("can't open %s: %s", manifest_csv_path, strerror(errno));
+    if (csv_fp == stdout || ftell(csv_fp) == 0)
+      fprintf(csv_fp, "file,src,sport,dst,dport,first,last,packets,bytes,"
+	      "length,gaps,reason,flags,segments,retransmissions,"
+	      "out_of_order,zero_windows,syn_rtt,ack_rtt\n");
+  }
+}
+
+
+/* Write out the records we've collected */
+static void flush_manifest()
+{
+  size_t length = batch_used * sizeof(struct manifest_rec);
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < length) {
+    if ((n = write(manifest_fd, (char *) batch + done, length - done)) < 0) {
+      if (errno == EINTR)
+	continue;
+      die("error writing %s: %s", manifest_path, strerror(errno));
+    }
+    done += n;
+  }
+
+  if (batch_used)
+    batches++;
+  batch_used = 0;
+}
+
+
+static void csv_address(u_int32_t addr)
+{
+  fprintf(csv_fp, "%u.%u.%u.%u,", (addr >> 24) & 0xff, (addr >> 16) & 0xff,
+	  (addr >> 8) & 0xff, addr & 0xff);
+}
+
+
+static void write_csv(flow_state_t *flow_state, struct manifest_rec *rec)
+{
+  /* with --combined, the data went into the connection's file */
+  flow_state_t *file = combined_output ?
+    combined_flow_state(flow_state) : flow_state;
+
+  fprintf(csv_fp, "%s,", flow_path(file));
+  csv_address(rec->src);
+  fprintf(csv_fp, "%u,", rec->sport);
+  csv_address(rec->dst);
+  fprintf(csv_fp, "%u,%lu.%06u,%lu.%06u,%llu,%llu,%llu,%u,%s,%u,",
+	  rec->dport, (unsigned long) rec->first_sec,
+	  (unsigned) rec->first_usec, (unsigned long) rec->last_sec,
+	  (unsigned) rec->last_usec, (unsigned long long) rec->packets,
+	  (unsigned long long) rec->bytes, (unsigned long long) rec->length,
+	  (unsigned) rec->gaps, reason_names[rec->reason],
+	  (unsigned) rec->flags);
+  fprintf(csv_fp, "%llu,%u,%u,%u,%u.%06u,%u.%06u\n",
+	  (unsigned long long) rec->segments, (unsigned) rec->retransmissions,
+	  (unsigned) rec->out_of_order, (unsigned) rec->zero_windows,
+	  (unsigned) rec->syn_rtt_usecs / 1000000,
+	  (unsigned) rec->syn_rtt_usecs % 1000000,
+	  (unsigned) rec->ack_rtt_usecs / 1000000,
+	  (unsigned) rec->ack_rtt_usecs % 1000000);
+}
+
+
+/* Put a flow in the manifest, if it isn't there already */
+void list_flow(flow_state_t *flow_state)
+{
+  struct manifest_rec rec;
+  const struct tcpflow_range *r;
+  int count, lost;
+
+  if ((manifest_fd < 0 && csv_fp == NULL) ||
+      IS_SET(flow_state->flags, FLOW_LISTED))
+    return;
+  SET_BIT(flow_state->flags, FLOW_LISTED);
+  count = tcpflow_passed(flow_table, flow_state->tcp, &r, &lost);
+
+  memset(&rec, 0, sizeof(rec));
+  rec.src = flow_state->flow.src;
+  rec.dst = flow_state->flow.dst;
+  rec.sport = flow_state->flow.sport;
+  rec.dport = flow_state->flow.dport;
+
+  if (IS_SET(flow_state->flags, FLOW_SHED))
+    rec.reason = MANIFEST_SHED;
+  else if (IS_SET(flow_state->flags, FLOW_BYTE_LIMIT))
+    rec.reason = MANIFEST_LIMIT;
+  else if (IS_SET(flow_state->flags, FLOW_FINISHED))
+    rec.reason = MANIFEST_OUTPUT;
+  else if (IS_SET(flow_state->flags, FLOW_SAW_RST))
+    rec.reason = MANIFEST_RST;
+  else if (IS_SET(flow_state->flags, FLOW_SAW_FIN))
+    rec.reason = MANIFEST_FIN;
+  else
+    rec.reason = MANIFEST_OPEN;
+
+  if (IS_SET(flow_state->flags, FLOW_REPLY))
+    rec.flags |= MANIFEST_REPLY;
+  if (lost)
+    rec.flags |= MANIFEST_MORE_GAPS;
+  if (IS_SET(flow_state->flags, FLOW_CONTINUED))
+    rec.flags |= MANIFEST_RESTORED;
+
+  rec.first_sec = flow_state->tcp->start.tv_sec;
+  rec.first_usec = flow_state->tcp->start.tv_usec;
+  rec.last_sec = flow_state->tcp->last.tv_sec;
+  rec.last_usec = flow_state->tcp->last.tv_usec;
+  rec.packets = flow_state->tcp->packets;
+  rec.bytes = flow_state->tcp->bytes;
+  if (flow_state->stats != NULL) {
+    struct flow_stats *stats = flow_state->stats;
+
+    rec.segments = stats->segments;
+    rec.retransmissions = stats->retransmissions;
+    rec.out_of_order = stats->out_of_order;
+    rec.zero_windows = stats->zero_windows;
+    rec.syn_rtt_usecs = stats->syn_rtt;
+    rec.ack_rtt_usecs = stats->ack_rtt;
+  }
+
+  /* the holes between the ranges we've written, and before the first */
+  if (count > 0) {
+    rec.length = r[count - 1].end;
+    rec.gaps = count - 1;
+    if (r[0].start > 0 && !lost)
+      rec.gaps++;
+  }
+
+  if (csv_fp != NULL)
+    write_csv(flow_state, &rec);
+
+  if (manifest_fd >= 0) {
+    if (batch_used == 0)
+      batch_start = flow_state->tcp->last.tv_sec;
+    batch[batch_used++] = rec;
+    if (batch_used == MANIFEST_BATCH ||
+	flow_state->tcp->last.tv_sec - batch_start >= MANIFEST_FLUSH)
+      flush_manifest();
+  }
+
+  flows_listed++;
+}
+
+
+static void list_remaining(flow_state_t *flow_state, void *arg)
+{
+  list_flow(flow_state);
+}
+
+
+/* List the flows that are still going, and finish the files */
+void close_manifest()
+{
+  if (manifest_fd < 0 && csv_fp == NULL)
+    return;
+
+  for_each_flow_state(list_remaining, NULL);
+
+  if (manifest_fd >= 0) {
+    flush_manifest();
+    close(manifest_fd);
+    manifest_fd = -1;
+  }
+
+  if (csv_fp != NULL) {
+    if ((csv_fp == stdout ? fflush(csv_fp) : fclose(csv_fp)) != 0)
+      DEBUG(1) ("error writing %s: %s", manifest_csv_path, strerror(errno));
+    csv_fp = NULL;
+  }
+}
+
+
+void print_manifest_stats()
+{
+  if (manifest_path == NULL && manifest_csv_path == NULL)
+    return;
+
+  DEBUG(10) ("manifest: %lld flows listed (%lld batches written)",
+	     flows_listed, batches);
+}
@@ -0,0 +1,84 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * Flow manifests.  With --manifest, tcpflow lists every flow it has
+ * seen in one file, so that tools can find out what's been captured
+ * without looking at every flow file.  A flow is listed once: when it
+ * finishes, or when tcpflow exits if it never does.
+ *
+ * The file is a struct manifest_header followed by any number of
+ * struct manifest_rec, all of fixed size and in host byte order.  Runs
+ * that use the same file add their records to the end of it.
+ *
+ * With --stats-only, flows are listed when their connection ends (with
+ * a RST, or a FIN each way), nothing is written, and the first and
+ * last times are of any packet, with data or not.  The counts at the
+ * end of the record are only kept in that mode, and are 0 otherwise.
+ *
+ * This header doesn't depend on the rest of tcpflow, so readers can
+ * take it into their own programs.
+ */
+
+#ifndef __MANIFEST_H__
+#define __MANIFEST_H__
+
+#include <stdint.h>
+
+#define MANIFEST_MAGIC		0x7463666d	/* "tcfm" */
+#define MANIFEST_VERSION	2
+
+/* Why a flow was listed */
+#define MANIFEST_OPEN		0	/* tcpflow exited with it still going */
+#define MANIFEST_FIN		1	/* likewise, but a FIN had been seen */
+#define MANIFEST_RST		2	/* likewise, but a RST had been seen */
+#define MANIFEST_LIMIT		3	/* -b was reached */
+#define MANIFEST_OUTPUT		4	/* an output limit or error stopped it */
+#define MANIFEST_SHED		5	/* turned away by --shed */
+
+/* Record flags */
+#define MANIFEST_REPLY		(1 << 0) /* the other direction came first */
+#define MANIFEST_MORE_GAPS	(1 << 1) /* there may be more gaps than
+					  * 'gaps' says */
+#define MANIFEST_RESTORED	(1 << 2) /* picked up from a checkpoint; the
+					  * counts are for this run only */
+
+struct manifest_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t record_size;		/* sizeof(struct manifest_rec) */
+  uint32_t reserved;
+};
+
+/* Addresses and ports are those of the flow's file name */
+struct manifest_rec {
+  uint32_t src;			/* source address */
+  uint32_t dst;			/* destination address */
+  uint16_t sport;		/* source port */
+  uint16_t dport;		/* destination port */
+  uint8_t reason;		/* MANIFEST_OPEN etc. */
+  uint8_t flags;		/* MANIFEST_REPLY etc. */
+  uint16_t reserved;
+  uint64_t first_sec;		/* time of the first packet with data */
+  uint32_t first_usec;
+  uint32_t last_usec;
+  uint64_t last_sec;		/* time of the last one */
+  uint64_t packets;		/* packets with data, retransmissions too */
+  uint64_t bytes;		/* payload bytes in them */
+  uint64_t length;		/* how far into the flow we've written */
+  uint32_t gaps;		/* holes in what we've written */
+  uint32_t reserved2;
+  uint64_t segments;		/* packets, with or without data */
+  uint32_t retransmissions;	/* segments whose data we'd seen, or that
+				 * filled a hole an RTT or more late */
+  uint32_t out_of_order;	/* segments that filled a hole sooner */
+  uint32_t zero_windows;	/* times the window was closed */
+  uint32_t syn_rtt_usecs;	/* SYN to SYN/ACK, or 0 if not seen */
+  uint32_t ack_rtt_usecs;	/* SYN/ACK to the ACK of it */
+  uint32_t reserved3;
+};
+
+#endif /* __MANIFEST_H__ */
@@ -0,0 +1,484 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * --ngram-index: a search index of the flow files (see ngram.h), built
+ * from the data as store_segment() hands it to the writer, so nothing
+ * has to be read back.
+ *
+ * Each flow file collects the set of trigrams in its data, in a small
+ * hash table of its own.  When the flow finishes or its connection
+ * ends (or when we exit), the set is turned into postings and added
+ * to the current segment, which is written out when it's full, when a
+ * minute of packet time has passed since its first flow, and at exit.
+ *
+ * Data doesn't always come in order, so each direction keeps the
+ * stretches of the file it has indexed, with the two bytes at either
+ * end of each: when a hole between them is filled in, that's enough
+ * for the trigrams that cross its edges.
+ *
+ * The cost is bounded: a file keeps at most NGRAM_MAX_GRAMS trigrams,
+ * and one that has more (compressed or encrypted data, mostly) is
+ * listed as NGRAM_ALL instead, and no longer looked at.  So is one
+ * with more than NGRAM_MAX_PIECES holes at once.
+ */
+
+#include "tcpflow.h"
+#include "ngram.h"
+
+extern char *ngram_index_path;
+extern int combined_output;
+
+#define NGRAM_MAX_GRAMS	16384	/* most trigrams kept for one file */
+#define NGRAM_MAX_PAIRS	(4 * 1024 * 1024) /* most postings in a segment */
+#define NGRAM_FLUSH	60	/* most seconds a segment is kept open */
+#define NGRAM_MAX_PIECES 8	/* most stretches apart in one direction */
+#define NGRAM_MIN_SLOTS	256
+
+/* A stretch of a flow's data we've indexed */
+struct piece {
+  tcp_seq start;
+  tcp_seq end;
+  u_char head[2];		/* its first two bytes */
+  u_char tail[2];		/* and its last two */
+  int head_len;			/* which is fewer if it's shorter */
+  int tail_len;
+};
+
+/* Kept for each direction (the data it's given) and for each file
+ * (its trigrams); without --combined, they're one and the same */
+struct ngram_flow {
+  struct piece pieces[NGRAM_MAX_PIECES]; /* in order */
+  int num_pieces;
+
+  u_int32_t *slots;		/* trigram + 1, or 0 for an empty slot */
+  int size;			/* slots, a power of 2 */
+  int shift;			/* 32 - log2(size) */
+  int count;			/* trigrams in them */
+  int all;			/* NGRAM_ALL */
+  long long bytes;		/* data since the file was last listed */
+};
+
+static int index_fd = -1;
+
+/* the segment being put together */
+static u_int64_t *pairs;	/* trigram << 16 | flow, unsorted */
+static long pairs_used;
+static u_char *flags;
+static char *names;
+static long names_used;
+static long names_size;
+static int seg_flows;
+static time_t seg_start;
+
+static long long bytes_indexed;
+static long long usecs_indexing;
+static long long index_bytes;
+static long long flows_indexed;
+static long long flows_all;
+static long long segments;
+
+
+/* Open the index, or check that the one that's already there is the
+ * kind we write */
+void init_ngram_index()
+{
+  struct ngram_header hdr;
+
+  if (ngram_index_path == NULL)
+    return;
+
+  if ((index_fd = open(ngram_index_path, O_WRONLY | O_CREAT | O_APPEND,
+		       0666)) < 0)
+    die("can't open %s: %s", ngram_index_path, strerror(errno));
+
+  if (lseek(index_fd, 0, SEEK_END) > 0) {
+    int fd = open(ngram_index_path, O_RDONLY);
+
+    if (fd < 0 || read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	hdr.magic != NGRAM_MAGIC || hdr.version != NGRAM_VERSION)
+      die("%s isn't a tcpflow search index we can add to", ngram_index_path);
+    close(fd);
+    DEBUG(10) ("adding to search index %s", ngram_index_path);
+  } else {
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = NGRAM_MAGIC;
+    hdr.version = NGRAM_VERSION;
+    if (write(index_fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+      die("error writing %s: %s", ngram_index_path, strerror(errno));
+  }
+
+  pairs = MALLOC(u_int64_t, NGRAM_MAX_PAIRS);
+  flags = MALLOC(u_char, NGRAM_SEGMENT_FLOWS);
+  names_size = 64 * 1024;
+  names = MALLOC(char, names_size);
+}
+
+
+static struct ngram_flow *ngram_flow(flow_state_t *flow_state)
+{
+  if (flow_state->ngrams == NULL) {
+    flow_state->ngrams = MALLOC(struct ngram_flow, 1);
+    memset(flow_state->ngrams, 0, sizeof(struct ngram_flow));
+  }
+  return flow_state->ngrams;
+}
+
+
+/* Stop keeping a file's trigrams: it'll be read for every search */
+static void give_up(struct ngram_flow *file)
+{
+  free(file->slots);
+  file->slots = NULL;
+  file->size = file->count = 0;
+  file->all = 1;
+}
+
+
+static void resize(struct ngram_flow *file, int size)
+{
+  u_int32_t *old = file->slots;
+  int old_size = file->size, i, j;
+
+  file->slots = MALLOC(u_int32_t, size);
+  memset(file->slots, 0, size * sizeof(u_int32_t));
+  file->size = size;
+  for (file->shift = 32; size > 1; size >>= 1)
+    file->shift--;
+
+  for (i = 0; i < old_size; i++) {
+    if (old[i] == 0)
+      continue;
+    j = (old[i] * 2654435761U) >> file->shift;
+    while (file->slots[j] != 0)
+      j = (j + 1) & (file->size - 1);
+    file->slots[j] = old[i];
+  }
+  free(old);
+}
+
+
+static void add_gram(struct ngram_flow *file, u_int32_t gram)
+{
+  u_int32_t key = gram + 1;
+  int i = (key * 2654435761U) >> file->shift;
+
+  if (file->all)
+    return;
+  while (file->slots[i] != 0) {
+    if (file->slots[i] == key)
+      return;
+    i = (i + 1) & (file->size - 1);
+  }
+  file->slots[i] = key;
+
+  if (++file->count > NGRAM_MAX_GRAMS)
+    give_up(file);
+  else if (file->count * 2 > file->size)
+    resize(file, file->size * 2);
+}
+
+
+/* 'a' and 'b' are next to each other: add the trigrams that cross
+ * from one to the other, and make 'a' the two of them */
+static void join(struct ngram_flow *file, struct piece *a, struct piece *b)
+{
+  u_char edge[4];
+  int n, i;
+
+  /* with at most two bytes on each side, every trigram crosses */
+  memcpy(edge, a->tail, a->tail_len);
+  memcpy(edge + a->tail_len, b->head, b->head_len);
+  n = a->tail_len + b->head_len;
+  for (i = 0; i + 2 < n; i++)
+    add_gram(file, NGRAM(edge[i], edge[i + 1], edge[i + 2]));
+
+  if (a->head_len < 2) {
+    memcpy(a->head, edge, 2);
+    a->head_len = 2;
+  }
+  if (b->tail_len < 2) {
+    memcpy(a->tail, edge + n - 2, 2);
+    a->tail_len = 2;
+  } else {
+    memcpy(a->tail, b->tail, 2);
+  }
+  a->end = b->end;
+}
+
+
+/* Put a new piece of a direction's data among the others */
+static void place_piece(struct ngram_flow *dir, struct ngram_flow *file,
+			struct piece *new)
+{
+  struct piece *p = dir->pieces;
+  int n = dir->num_pieces, i;
+
+  /* the usual case: carrying on from the last one */
+  if (n > 0 && p[n - 1].end == new->start) {
+    join(file, &p[n - 1], new);
+    return;
+  }
+
+  for (i = 0; i < n && (int) (p[i].end - new->start) <= 0; i++)
+    ;
+  if (i < n && (int) (p[i].start - new->end) < 0) {
+    give_up(file);		/* overlaps; shouldn't happen */
+    return;
+  }
+
+  if (i > 0 && p[i - 1].end == new->start) {
+    join(file, &p[i - 1], new);
+    if (i < n && p[i].start == new->end) {
+      join(file, &p[i - 1], &p[i]);
+      memmove(&p[i], &p[i + 1], (n - i - 1) * sizeof(*p));
+      dir->num_pieces--;
+    }
+  } else if (i < n && p[i].start == new->end) {
+    join(file, new, &p[i]);
+    p[i] = *new;
+  } else if (n < NGRAM_MAX_PIECES) {
+    memmove(&p[i + 1], &p[i], (n - i) * sizeof(*p));
+    p[i] = *new;
+    dir->num_pieces++;
+  } else {
+    give_up(file);		/* too many holes */
+  }
+}
+
+
+/* Note the trigrams of data about to be written at 'offset' in the
+ * flow's file */
+void index_ngrams(flow_state_t *flow_state, const u_char *data,
+		  u_int32_t length, tcp_seq offset)
+{
+  struct ngram_flow *dir, *file;
+  struct timeval start, end;
+  struct piece new;
+  u_int32_t gram, i;
+  int was_all;
+
+  if (index_fd < 0 || length == 0)
+    return;
+
+  gettimeofday(&start, NULL);
+  dir = ngram_flow(flow_state);
+  file = combined_output ?
+    ngram_flow(combined_flow_state(flow_state)) : dir;
+
+  was_all = file->all;
+
+  /* picked up from a checkpoint: the last run indexed what came before,
+   * but not the trigrams that cross over */
+  if (dir->num_pieces == 0 && IS_SET(flow_state->flags, FLOW_CONTINUED))
+    give_up(file);
+
+  if (!file->all) {
+    if (file->slots == NULL)
+      resize(file, NGRAM_MIN_SLOTS);
+    gram = length > 1 ? (data[0] << 8) | data[1] : 0;
+    for (i = 2; i < length && !file->all; i++) {
+      gram = ((gram << 8) | data[i]) & 0xffffff;
+      add_gram(file, gram);
+    }
+  }
+
+  new.start = offset;
+  new.end = offset + length;
+  new.head_len = new.tail_len = length < 2 ? length : 2;
+  memcpy(new.head, data, new.head_len);
+  memcpy(new.tail, data + length - new.tail_len, new.tail_len);
+  place_piece(dir, file, &new);
+
+  if (file->all && !was_all)
+    DEBUG(5) ("%s: too many trigrams or holes to index",
+	      flow_filename(flow_state->flow));
+  file->bytes += length;
+  bytes_indexed += length;
+  gettimeofday(&end, NULL);
+  usecs_indexing += (end.tv_sec - start.tv_sec) * 1000000LL +
+    (end.tv_usec - start.tv_usec);
+}
+
+
+static void write_all(const void *data, size_t length)
+{
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < length) {
+    if ((n = write(index_fd, (char *) data + done, length - done)) < 0) {
+      if (errno == EINTR)
+	continue;
+      die("error writing %s: %s", ngram_index_path, strerror(errno));
+    }
+    done += n;
+  }
+  index_bytes += length;
+}
+
+
+static void write_padded(const void *data, size_t length)
+{
+  static const char zeros[8];
+
+  write_all(data, length);
+  write_all(zeros, NGRAM_PAD(length) - length);
+}
+
+
+static int pair_compare(const void *a, const void *b)
+{
+  u_int64_t x = *(const u_int64_t *) a, y = *(const u_int64_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+
+/* Write out the segment we've put together */
+static void flush_segment()
+{
+  struct ngram_segment seg;
+  struct ngram_entry *entries;
+  u_int16_t *postings;
+  long i, grams = 0;
+
+  if (seg_flows == 0)
+    return;
+
+  qsort(pairs, pairs_used, sizeof(u_int64_t), pair_compare);
+  for (i = 0; i < pairs_used; i++)
+    if (i == 0 || (pairs[i] >> 16) != (pairs[i - 1] >> 16))
+      grams++;
+
+  entries = MALLOC(struct ngram_entry, grams + 1);
+  postings = MALLOC(u_int16_t, pairs_used ? pairs_used : 1);
+  for (grams = i = 0; i < pairs_used; i++) {
+    if (i == 0 || (pairs[i] >> 16) != (pairs[i - 1] >> 16)) {
+      entries[grams].gram = pairs[i] >> 16;
+      entries[grams].first = i;
+      grams++;
+    }
+    postings[i] = pairs[i] & 0xffff;
+  }
+  entries[grams].gram = 0xffffffff;
+  entries[grams].first = pairs_used;
+
+  memset(&seg, 0, sizeof(seg));
+  seg.magic = NGRAM_SEGMENT_MAGIC;
+  seg.flows = seg_flows;
+  seg.grams = grams;
+  seg.names_len = names_used;
+  seg.postings = pairs_used;
+  seg.length = sizeof(seg) + NGRAM_PAD(seg_flows) + NGRAM_PAD(names_used) +
+    NGRAM_PAD((grams + 1) * sizeof(struct ngram_entry)) +
+    NGRAM_PAD(pairs_used * sizeof(u_int16_t));
+
+  write_all(&seg, sizeof(seg));
+  write_padded(flags, seg_flows);
+  write_padded(names, names_used);
+  write_padded(entries, (grams + 1) * sizeof(struct ngram_entry));
+  write_padded(postings, pairs_used * sizeof(u_int16_t));
+
+  free(entries);
+  free(postings);
+  pairs_used = names_used = 0;
+  seg_flows = 0;
+  segments++;
+}
+
+
+/* A flow has finished, or we're exiting: put what's been found in its
+ * file into the index */
+void index_flow_done(flow_state_t *flow_state)
+{
+  flow_state_t *owner = combined_output ? flow_state->combined :
+    flow_state;
+  struct ngram_flow *file;
+  struct timeval start, end;
+  char *name;
+  int i, len;
+
+  if (index_fd < 0 || owner == NULL || (file = owner->ngrams) == NULL ||
+      file->bytes == 0)
+    return;
+
+  gettimeofday(&start, NULL);
+  if (pairs_used + file->count > NGRAM_MAX_PAIRS)
+    flush_segment();
+  if (seg_flows == 0)
+    seg_start = flow_state->tcp->last.tv_sec;
+
+  name = flow_path(owner);
+  len = strlen(name) + 1;
+  while (names_used + len > names_size) {
+    names_size *= 2;
+    if ((names = realloc(names, names_size)) == NULL)
+      die("out of memory building %s", ngram_index_path);
+  }
+  memcpy(names + names_used, name, len);
+  names_used += len;
+
+  flags[seg_flows] = file->all ? NGRAM_ALL : 0;
+  for (i = 0; i < file->size; i++)
+    if (file->slots[i] != 0)
+      pairs[pairs_used++] = ((u_int64_t) (file->slots[i] - 1) << 16) |
+	seg_flows;
+  seg_flows++;
+
+  flows_indexed++;
+  if (file->all)
+    flows_all++;
+
+  /* anything more that's written to the file starts afresh */
+  free(file->slots);
+  file->slots = NULL;
+  file->size = file->count = 0;
+  file->all = 0;
+  file->bytes = 0;
+
+  if (seg_flows == NGRAM_SEGMENT_FLOWS ||
+      flow_state->tcp->last.tv_sec - seg_start >= NGRAM_FLUSH)
+    flush_segment();
+  gettimeofday(&end, NULL);
+  usecs_indexing += (end.tv_sec - start.tv_sec) * 1000000LL +
+    (end.tv_usec - start.tv_usec);
+}
+
+
+static void index_remaining(flow_state_t *flow_state, void *arg)
+{
+  index_flow_done(flow_state);
+}
+
+
+/* Index the flows that are still going, and finish the file */
+void close_ngram_index()
+{
+  if (index_fd < 0)
+    return;
+
+  for_each_flow_state(index_remaining, NULL);
+  flush_segment();
+  close(index_fd);
+  index_fd = -1;
+}
+
+
+void print_ngram_stats()
+{
+  double mb = bytes_indexed / (1024.0 * 1024.0);
+
+  if (ngram_index_path == NULL)
+    return;
+
+  DEBUG(10) ("search index: %lld files (%lld with too many trigrams or "
+	     "holes to index) in %lld segments", flows_indexed, flows_all,
+	     segments);
+  if (mb > 0)
+    DEBUG(10) ("search index: %.1f MB indexed at %.0f usecs and %.0f bytes "
+	       "of index per MB", mb, usecs_indexing / mb, index_bytes / mb);
+}
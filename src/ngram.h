@@ -0,0 +1,86 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * Search indexes.  With --ngram-index, tcpflow notes every trigram
+ * (three bytes in a row) in the data it writes to each flow file, so
+ * that a search for a string only has to read the files that have
+ * all of the string's trigrams in them (see tcpflow-search).
+ *
+ * The file is a struct ngram_header followed by any number of
+ * segments, each covering the flows that finished over a stretch of
+ * the capture.  A segment is a struct ngram_segment, then
+ *
+ *   uint8_t flags[flows]		NGRAM_ALL etc., one per flow
+ *   char names[names_len]		the flows' file names, relative to
+ *					the output directory, each ending
+ *					in a NUL
+ *   struct ngram_entry entries[grams + 1]
+ *   uint16_t postings[postings]
+ *
+ * with each part padded to a multiple of 8 bytes.  The entries are in
+ * order of trigram, and the flows (numbered from 0, in the order of
+ * the names) that have entries[i].gram are postings[entries[i].first]
+ * up to postings[entries[i + 1].first], in order; the last entry is
+ * there to mark the end.  Everything is in host byte order.  Runs that
+ * use the same file add their segments to the end of it.
+ *
+ * A file can be listed more than once, in the same segment or in
+ * different ones: with --combined, once for each direction that
+ * finishes; when data straggles in after its connection has ended;
+ * or when a run picks up from a checkpoint.  Each listing has only
+ * the trigrams found since the one before, so readers have to put
+ * them together by name: what's been found in any of them has been
+ * found in the file, and a string may have some of its trigrams in
+ * one and the rest in another.
+ *
+ * This header doesn't depend on the rest of tcpflow, so readers can
+ * take it into their own programs.
+ */
+
+#ifndef __NGRAM_H__
+#define __NGRAM_H__
+
+#include <stdint.h>
+
+#define NGRAM_MAGIC		0x7463666e	/* "tcfn" */
+#define NGRAM_VERSION		1
+#define NGRAM_SEGMENT_MAGIC	0x7463666f	/* "tcfo" */
+
+/* The most flows in a segment, so they fit in a posting */
+#define NGRAM_SEGMENT_FLOWS	65535
+
+/* A trigram is its three bytes, first byte highest */
+#define NGRAM(a, b, c)		(((uint32_t) (a) << 16) | ((b) << 8) | (c))
+
+/* Flow flags */
+#define NGRAM_ALL		(1 << 0) /* not all of the flow's trigrams
+					  * are listed: it has to be read
+					  * for every search */
+
+struct ngram_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t reserved[2];
+};
+
+struct ngram_segment {
+  uint32_t magic;		/* NGRAM_SEGMENT_MAGIC */
+  uint32_t flows;
+  uint32_t grams;		/* entries, not counting the last */
+  uint32_t names_len;
+  uint64_t postings;
+  uint64_t length;		/* bytes in the segment, this included */
+};
+
+struct ngram_entry {
+  uint32_t gram;
+  uint32_t first;		/* its first posting */
+};
+
+#define NGRAM_PAD(n)		(((n) + 7) & ~(uint64_t) 7)
+
+#endif /* __NGRAM_H__ */
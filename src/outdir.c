@@ -0,0 +1,246 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * Where flow files live.  By default they go into the current
+ * directory, as they always have.  --output-dir picks another root,
+ * and --shard spreads the files over subdirectories of it, either by
+ * a hash of the connection's addresses and ports or by the time the
+ * flow started, so that no single directory ends up with millions of
+ * entries.
+ *
+ * We keep directory descriptors for recently used shards open and
+ * create files relative to them with openat(), so the kernel doesn't
+ * have to walk the whole path every time a flow file is (re)opened.
+ */
+
+#include "tcpflow.h"
+
+extern char *output_dir;
+extern int shard_mode;
+extern long shard_param;
+
+#define DIR_CACHE_SIZE 64	/* most shard directories we keep open */
+
+static struct {
+  long key;			/* hash bucket, or start of the time bucket */
+  int fd;
+} dir_cache[DIR_CACHE_SIZE];
+
+static int dir_cache_size = DIR_CACHE_SIZE;
+
+static int root_fd;		/* descriptor for the output root */
+
+
+/* Open (creating if need be) the output root, and get the shard
+ * directory cache ready */
+void init_output_dir()
+{
+  int i;
+
+  for (i = 0; i < DIR_CACHE_SIZE; i++)
+    dir_cache[i].fd = -1;
+
+#ifdef HAVE_OPENAT
+  root_fd = AT_FDCWD;
+#else
+  root_fd = -1;
+#endif
+
+  if (output_dir == NULL)
+    return;
+
+  if (mkdir(output_dir, 0777) < 0 && errno != EEXIST)
+    die("can't create output directory %s: %s", output_dir, strerror(errno));
+
+#ifdef HAVE_OPENAT
+  if ((root_fd = open(output_dir, O_RDONLY)) < 0)
+    die("can't open output directory %s: %s", output_dir, strerror(errno));
+#endif
+
+  DEBUG(10) ("writing flow files under %s", output_dir);
+}
+
+
+/* Set aside descriptors for the directories we keep open, out of the
+ * 'available' ones.  Returns how many were taken; the FD ring gets the
+ * rest. */
+int reserve_dir_fds(int available)
+{
+#ifdef HAVE_OPENAT
+  int reserved = output_dir ? 1 : 0;
+
+  if (shard_mode != SHARD_NONE) {
+    /* don't starve the FD ring when we're short on descriptors */
+    dir_cache_size = available / 4;
+    if (dir_cache_size > DIR_CACHE_SIZE)
+      dir_cache_size = DIR_CACHE_SIZE;
+    if (dir_cache_size < 1)
+      dir_cache_size = 1;
+    reserved += dir_cache_size;
+  }
+
+  return reserved;
+#else
+  return 0;
+#endif
+}
+
+
+/* Which shard a flow belongs in.  The hash is symmetric, so both
+ * directions of a connection end up next to each other. */
+static long shard_key(flow_state_t *flow_state)
+{
+  flow_t *f = &flow_state->flow;
+  u_int32_t h;
+
+  switch (shard_mode) {
+  case SHARD_HASH:
+    h = (f->src ^ f->dst) * 2654435761U;
+    h ^= (u_int32_t) (f->sport ^ f->dport) * 2246822519U;
+    h ^= h >> 15;
+    return (long) (h % (u_int32_t) shard_param);
+  case SHARD_TIME:
+    return flow_state->tcp->start.tv_sec -
+      flow_state->tcp->start.tv_sec % shard_param;
+  default:
+    return -1;
+  }
+}
+
+
+/* Name of a shard directory, relative to the output root */
+static void shard_name(long key, char *buf, int buflen)
+{
+  time_t t;
+
+  if (shard_mode == SHARD_HASH) {
+    snprintf(buf, buflen, shard_param <= 256 ? "%02lx" : "%03lx", key);
+  } else {
+    t = (time_t) key;
+    strftime(buf, buflen, "%Y%m%d-%H%M%S", gmtime(&t));
+  }
+}
+
+
+/* Render the flow's path (relative to the output root) once, and
+ * keep it in the flow state for every later reopen */
+char *flow_path(flow_state_t *flow_state)
+{
+  char shard[32];
+  char *name;
+  int len;
+
+  if (flow_state->filename != NULL)
+    return flow_state->filename;
+
+  name = flow_filename(flow_state->flow);
+  flow_state->shard = shard_key(flow_state);
+  shard[0] = '\0';
+  if (flow_state->shard != -1)
+    shard_name(flow_state->shard, shard, sizeof(shard));
+
+#ifdef HAVE_OPENAT
+  len = strlen(shard) + strlen(name) + 2;
+  flow_state->filename = MALLOC(char, len);
+  sprintf(flow_state->filename, "%s%s%s", shard, shard[0] ? "/" : "", name);
+#else
+  /* without openat() we need the whole path every time */
+  len = (output_dir ? strlen(output_dir) : 0) + strlen(shard) + strlen(name) + 3;
+  flow_state->filename = MALLOC(char, len);
+  sprintf(flow_state->filename, "%s%s%s%s%s",
+	  output_dir ? output_dir : "", output_dir ? "/" : "",
+	  shard, shard[0] ? "/" : "", name);
+#endif
+
+  return flow_state->filename;
+}
+
+
+#ifdef HAVE_OPENAT
+/* Get a descriptor for a shard directory, creating it if need be */
+static int shard_fd(long key)
+{
+  int slot = (int) (key % dir_cache_size);
+  char name[32];
+
+  if (dir_cache[slot].fd != -1) {
+    if (dir_cache[slot].key == key)
+      return dir_cache[slot].fd;
+    close(dir_cache[slot].fd);
+    dir_cache[slot].fd = -1;
+  }
+
+  shard_name(key, name, sizeof(name));
+  if (mkdirat(root_fd, name, 0777) < 0 && errno != EEXIST)
+    return -1;
+  if ((dir_cache[slot].fd = openat(root_fd, name, O_RDONLY)) < 0)
+    return -1;
+  dir_cache[slot].key = key;
+
+  return dir_cache[slot].fd;
+}
+#else
+/* Make sure the directory a flow file goes into exists */
+static int make_parent(flow_state_t *flow_state)
+{
+  char *slash = strrchr(flow_state->filename, '/');
+  int rc;
+
+  if (slash == NULL)
+    return 0;
+  *slash = '\0';
+  rc = mkdir(flow_state->filename, 0777);
+  *slash = '/';
+  return (rc < 0 && errno != EEXIST) ? -1 : 0;
+}
+#endif
+
+
+/* Open a flow's file with the given open(2) flags.  Returns a file
+ * descriptor, or -1 with errno set. */
+int open_flow_file(flow_state_t *flow_state, int flags)
+{
+  char *path = flow_path(flow_state);
+
+#ifdef HAVE_OPENAT
+  int dir = root_fd;
+  char *leaf;
+
+  if (flow_state->shard != -1) {
+    if ((dir = shard_fd(flow_state->shard)) < 0)
+      return -1;
+    leaf = strrchr(path, '/') + 1;
+  } else {
+    leaf = path;
+  }
+
+  return openat(dir, leaf, flags, 0666);
+#else
+  if ((flags & O_CREAT) && make_parent(flow_state) < 0)
+    return -1;
+  return open(path, flags, 0666);
+#endif
+}
+
+
+/* Remove a flow's file from disk */
+int unlink_flow_file(flow_state_t *flow_state)
+{
+  char *path = flow_path(flow_state);
+
+#ifdef HAVE_OPENAT
+  if (flow_state->shard != -1) {
+    int dir = shard_fd(flow_state->shard);
+    if (dir < 0)
+      return -1;
+    return unlinkat(dir, strrchr(path, '/') + 1, 0);
+  }
+  return unlinkat(root_fd, path, 0);
+#else
+  return unlink(path);
+#endif
+}
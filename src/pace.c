@@ -0,0 +1,192 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * Paced replay (--pace).  Reading files, we normally go as fast as we
+ * can, which says little about how we'd cope with the same traffic
+ * live: how often the descriptor ring turns over, when things get
+ * flushed, how far behind we fall.  With --pace, packets are handed on
+ * no sooner than they would have arrived:
+ *
+ *   realtime  at the times they were captured
+ *   Nx        the same, N times faster (or slower, for N < 1)
+ *   Npps      N packets a second
+ *   Nbps      N bits (of captured data) a second
+ *
+ * N may be fractional, and pps and bps may have a k, M or G in front.
+ *
+ * Whenever we have to wait for the next packet, the current batch is
+ * handled first, as it would be when a live capture goes quiet.  When
+ * we can't keep up, packets are handled as soon as we get to them, and
+ * we keep track of how late the latest one was.
+ */
+
+#include "tcpflow.h"
+
+#define PACE_SPEED	1	/* following the packets' timestamps */
+#define PACE_PPS	2
+#define PACE_BPS	3
+
+static int pace_mode;
+static double pace_target;	/* speed, pps or bps */
+static int pacing;
+
+static struct timeval wall_start;
+static struct timeval packet_start;
+static struct timeval packet_last;
+static long long packets;
+static long long bits;
+static double max_lag;		/* secs */
+static long long waits;
+
+
+/* Parse the argument of --pace */
+int parse_pace(char *arg)
+{
+  char *end;
+  double n;
+
+  if (!strcmp(arg, "realtime")) {
+    pace_mode = PACE_SPEED;
+    pace_target = 1;
+    return 0;
+  }
+
+  n = strtod(arg, &end);
+  if (end == arg || n <= 0)
+    return -1;
+
+  if (!strcmp(end, "x")) {
+    pace_mode = PACE_SPEED;
+    pace_target = n;
+    return 0;
+  }
+
+  switch (*end) {
+  case 'k': case 'K': n *= 1e3; end++; break;
+  case 'm': case 'M': n *= 1e6; end++; break;
+  case 'g': case 'G': n *= 1e9; end++; break;
+  }
+  if (!strcmp(end, "pps"))
+    pace_mode = PACE_PPS;
+  else if (!strcmp(end, "bps"))
+    pace_mode = PACE_BPS;
+  else
+    return -1;
+
+  pace_target = n;
+  return 0;
+}
+
+
+void init_pace(int live)
+{
+  if (pace_mode == 0)
+    return;
+
+  if (live) {
+    DEBUG(1) ("warning: --pace only works with -r; ignored");
+    pace_mode = 0;
+    return;
+  }
+
+  pacing = 1;
+}
+
+
+static double seconds(struct timeval *tv)
+{
+  return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+
+/* Called for every packet read: wait until it's due */
+void pace_packet(struct timeval *tv, u_int32_t caplen)
+{
+  struct timeval now;
+  double due, late;
+
+  if (!pacing)
+    return;
+
+  gettimeofday(&now, NULL);
+  if (packets == 0) {
+    wall_start = now;
+    packet_start = *tv;
+  }
+
+  /* when the packet should be handled, counting from the first */
+  switch (pace_mode) {
+  case PACE_SPEED:
+    due = (seconds(tv) - seconds(&packet_start)) / pace_target;
+    break;
+  case PACE_PPS:
+    due = packets / pace_target;
+    break;
+  default:
+    due = bits / pace_target;
+    break;
+  }
+
+  packets++;
+  bits += caplen * 8;
+  if (timercmp(tv, &packet_last, >))
+    packet_last = *tv;
+
+  late = seconds(&now) - seconds(&wall_start) - due;
+  if (late >= 0) {
+    if (late > max_lag)
+      max_lag = late;
+    return;
+  }
+
+  /* nothing to do until then, as on a quiet network */
+  flush_batch();
+  gettimeofday(&now, NULL);
+  late = seconds(&now) - seconds(&wall_start) - due;
+  if (late < 0) {
+    usleep((useconds_t) (-late * 1e6));
+    waits++;
+  }
+}
+
+
+void print_pace_stats()
+{
+  struct timeval now;
+  double elapsed, span;
+  int level;
+
+  if (!pacing || packets == 0)
+    return;
+
+  gettimeofday(&now, NULL);
+  elapsed = seconds(&now) - seconds(&wall_start);
+  span = seconds(&packet_last) - seconds(&packet_start);
+  if (elapsed <= 0)
+    elapsed = 1e-6;
+
+  switch (pace_mode) {
+  case PACE_SPEED:
+    DEBUG(10) ("replay: %.3f seconds of capture in %.3f: %.2fx "
+	       "(target %.2fx)", span, elapsed, span / elapsed, pace_target);
+    break;
+  case PACE_PPS:
+    DEBUG(10) ("replay: %lld packets in %.3f seconds: %.0f pps "
+	       "(target %.0f)", packets, elapsed, packets / elapsed,
+	       pace_target);
+    break;
+  default:
+    DEBUG(10) ("replay: %lld bits in %.3f seconds: %.0f bps (target %.0f)",
+	       bits, elapsed, bits / elapsed, pace_target);
+    break;
+  }
+
+  /* only bother people if we couldn't keep up */
+  level = max_lag > 1 ? 1 : 10;
+  DEBUG(level) ("replay: %lld packets, waited for %lld, at worst %.3f "
+		"seconds late", packets, waits, max_lag);
+}
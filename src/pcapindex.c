@@ -0,0 +1,551 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * Capture file indexes.  tcpflow --build-index reads each -r file once
+ * and writes an index next to it (the file's name plus ".tfidx")
+ * giving, for every flow, the offset in the file of each of its
+ * packets, and for every minute of capture time, where in the file its
+ * packets are.
+ *
+ * Later runs on the same file that only want some of it -- flows
+ * picked out by a filter expression simple enough for us to match
+ * ourselves (see fastfilter.c), or packets from a --time-range -- look
+ * for the index, and if it's there and the file hasn't changed since,
+ * read just the packets they need, seeking from one to the next.  Then
+ * the filter is matched natively, as with --fast-filter, since it has
+ * to agree with the index about which flows it wants.  If the index
+ * would have us read most of the file anyway, we read all of it.
+ *
+ * Only classic pcap files can be indexed: we need to be able to seek
+ * libpcap to the start of any packet.
+ */
+
+#include "tcpflow.h"
+
+extern int fast_filter;
+extern time_t time_range_from;
+extern time_t time_range_to;
+
+#define INDEX_SUFFIX	".tfidx"
+#define INDEX_MAGIC	0x74636678	/* "tcfx" */
+#define INDEX_VERSION	1
+#define BUCKET_SECS	60		/* capture time per time bucket */
+#define INDEX_HASH	(1 << 16)	/* flow hash buckets while building */
+
+struct index_header {
+  u_int32_t magic;
+  u_int32_t version;
+  u_int32_t bucket_secs;
+  u_int32_t reserved;
+  u_int64_t file_size;		/* of the capture file, when indexed */
+  u_int64_t file_mtime;
+  int64_t bucket_base;		/* start of the first time bucket */
+  u_int64_t num_buckets;
+  u_int64_t num_flows;
+  u_int64_t num_offsets;
+};
+
+/* Where the packets captured in one time bucket are */
+struct index_bucket {
+  u_int64_t first;		/* offset of the first; ~0 for none */
+  u_int64_t end;		/* just past the last */
+};
+
+struct index_flow {
+  u_int32_t src;
+  u_int32_t dst;
+  u_int16_t sport;
+  u_int16_t dport;
+  u_int32_t count;		/* packets in the flow */
+  u_int64_t first_offset;	/* its first in the offsets table */
+  int64_t first_sec;		/* time of its first packet */
+  int64_t last_sec;		/* ...and of its last */
+};
+
+/* After the header: the buckets, the flows, then the offsets of each
+ * flow's packets, flow by flow, in file order. */
+
+/* A flow while we're building an index */
+typedef struct build_flow {
+  struct build_flow *next;
+  struct index_flow entry;
+  u_int64_t *offsets;
+  u_int32_t size;
+} build_flow;
+
+static build_flow **build_hash;
+static u_int64_t build_flows;
+static u_int64_t build_offsets;
+static off_t record_offset;	/* of the packet being indexed */
+int building_index = 0;
+
+/* The part of a capture file we're going to read */
+struct selection {
+  pcap_t *pd;
+  u_int64_t *offsets;		/* packets to read, in order, or NULL for */
+  u_int64_t start;		/* ...everything from here */
+  u_int64_t end;		/* ...to here */
+  u_int64_t count;		/* entries in offsets */
+  u_int64_t next;		/* the next one to read */
+  off_t pos;			/* where the file is now */
+};
+
+static struct selection selections[MAX_SOURCES];
+static int num_selections;
+
+static long long records_read;
+static long long seeks;
+
+/* packets read per call, when pcap_dispatch() would read a buffer's worth */
+#define DISPATCH_CHUNK	256
+
+
+/* Is this a capture file we can index? */
+static int classic_pcap(const char *path)
+{
+  u_int32_t magic = 0;
+  FILE *fp;
+
+  if ((fp = fopen(path, "rb")) == NULL)
+    return 0;
+  if (fread(&magic, sizeof(magic), 1, fp) != 1)
+    magic = 0;
+  fclose(fp);
+
+  return magic == 0xa1b2c3d4 || magic == 0xd4c3b2a1 ||	/* usecs */
+         magic == 0xa1b23c4d || magic == 0x4d3cb2a1;	/* nsecs */
+}
+
+
+static char *index_path(const char *path)
+{
+  char *name = MALLOC(char, strlen(path) + sizeof(INDEX_SUFFIX));
+
+  sprintf(name, "%s%s", path, INDEX_SUFFIX);
+  return name;
+}
+
+
+/* Is there an index for this capture file?  (Whether it's any good is
+ * for select_from_index() to find out.) */
+int have_index(char *path)
+{
+  char *name = index_path(path);
+  int rc = (access(name, R_OK) == 0);
+
+  free(name);
+  return rc;
+}
+
+
+/* Called from process_ip() for each segment while we're building */
+void index_packet(packet_t *packet)
+{
+  struct timeval *tv = &packet->tv;
+  flow_t *flow = &packet->flow;
+  u_int32_t h = (flow->src * 2654435761U) ^ (flow->dst * 40503U) ^
+    ((u_int32_t) flow->sport << 16 | flow->dport);
+  build_flow *f;
+
+  h = (h ^ (h >> 16)) & (INDEX_HASH - 1);
+  for (f = build_hash[h]; f != NULL; f = f->next)
+    if (f->entry.src == flow->src && f->entry.dst == flow->dst &&
+	f->entry.sport == flow->sport && f->entry.dport == flow->dport)
+      break;
+
+  if (f == NULL) {
+    f = MALLOC(build_flow, 1);
+    memset(f, 0, sizeof(*f));
+    f->entry.src = flow->src;
+    f->entry.dst = flow->dst;
+    f->entry.sport = flow->sport;
+    f->entry.dport = flow->dport;
+    f->entry.first_sec = tv->tv_sec;
+    f->next = build_hash[h];
+    build_hash[h] = f;
+    build_flows++;
+  }
+
+  if (f->entry.count == f->size) {
+    u_int64_t *offsets;
+
+    f->size = f->size ? f->size * 2 : 4;
+    offsets = MALLOC(u_int64_t, f->size);
+    if (f->entry.count)
+      memcpy(offsets, f->offsets, f->entry.count * sizeof(*offsets));
+    free(f->offsets);
+    f->offsets = offsets;
+  }
+
+  f->offsets[f->entry.count++] = record_offset;
+  if (tv->tv_sec < f->entry.first_sec)
+    f->entry.first_sec = tv->tv_sec;
+  if (tv->tv_sec > f->entry.last_sec)
+    f->entry.last_sec = tv->tv_sec;
+  build_offsets++;
+}
+
+
+static void write_index(const char *path, struct stat *st,
+			struct index_bucket *buckets, u_int64_t num_buckets,
+			time_t base)
+{
+  struct index_header hdr;
+  char *name = index_path(path);
+  char *tmp = MALLOC(char, strlen(name) + 5);
+  build_flow *f;
+  u_int64_t first = 0;
+  FILE *fp;
+  int i, pass;
+
+  /* write it under another name, so a half-written index is never
+   * taken for the real thing */
+  sprintf(tmp, "%s.tmp", name);
+  if ((fp = fopen(tmp, "wb")) == NULL)
+    die("can't create index %s: %s", tmp, strerror(errno));
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = INDEX_MAGIC;
+  hdr.version = INDEX_VERSION;
+  hdr.bucket_secs = BUCKET_SECS;
+  hdr.file_size = st->st_size;
+  hdr.file_mtime = st->st_mtime;
+  hdr.bucket_base = base;
+  hdr.num_buckets = num_buckets;
+  hdr.num_flows = build_flows;
+  hdr.num_offsets = build_offsets;
+  fwrite(&hdr, sizeof(hdr), 1, fp);
+  fwrite(buckets, sizeof(*buckets), num_buckets, fp);
+
+  /* the flows, then their offsets, in the same order */
+  for (pass = 0; pass < 2; pass++)
+    for (i = 0; i < INDEX_HASH; i++)
+      for (f = build_hash[i]; f != NULL; f = f->next)
+	if (pass == 0) {
+	  f->entry.first_offset = first;
+	  first += f->entry.count;
+	  fwrite(&f->entry, sizeof(f->entry), 1, fp);
+	} else {
+	  fwrite(f->offsets, sizeof(*f->offsets), f->entry.count, fp);
+	}
+
+  if (fflush(fp) != 0 || ferror(fp) || fclose(fp) != 0)
+    die("error writing index %s: %s", tmp, strerror(errno));
+  if (rename(tmp, name) < 0)
+    die("can't rename %s to %s: %s", tmp, name, strerror(errno));
+
+  DEBUG(1) ("%s: indexed %llu packets of %llu flows in %s", path,
+	    (unsigned long long) build_offsets,
+	    (unsigned long long) build_flows, name);
+  free(tmp);
+  free(name);
+}
+
+
+/* --build-index: read a capture file and write its index */
+void build_index(char *path)
+{
+  struct index_bucket *buckets = NULL;
+  u_int64_t num_buckets = 0, b;
+  struct pcap_pkthdr *h;
+  const u_char *data;
+  char errbuf[PCAP_ERRBUF_SIZE];
+  pcap_handler handler;
+  time_t base = 0;
+  struct stat st;
+  build_flow *f, *next;
+  pcap_t *pd;
+  FILE *fp;
+  int rc, i;
+
+  if (!classic_pcap(path)) {
+    DEBUG(1) ("%s: only pcap files can be indexed; skipping", path);
+    return;
+  }
+
+  if ((pd = pcap_open_offline(path, errbuf)) == NULL)
+    die("%s", errbuf);
+  if (stat(path, &st) < 0)
+    die("can't stat %s: %s", path, strerror(errno));
+  handler = find_handler(pcap_datalink(pd), path);
+  fp = pcap_file(pd);
+
+  build_hash = MALLOC(build_flow *, INDEX_HASH);
+  memset(build_hash, 0, INDEX_HASH * sizeof(*build_hash));
+  build_flows = build_offsets = 0;
+  building_index = 1;
+
+  while (record_offset = ftello(fp), (rc = pcap_next_ex(pd, &h, &data)) == 1) {
+    /* packets out of time order before the first bucket move it back */
+    if (num_buckets == 0) {
+      base = h->ts.tv_sec - h->ts.tv_sec % BUCKET_SECS;
+    } else if (h->ts.tv_sec < base) {
+      u_int64_t shift = (base - h->ts.tv_sec + BUCKET_SECS - 1) / BUCKET_SECS;
+
+      buckets = realloc(buckets, (num_buckets + shift) * sizeof(*buckets));
+      if (buckets == NULL)
+	die("out of memory indexing %s", path);
+      memmove(buckets + shift, buckets, num_buckets * sizeof(*buckets));
+      memset(buckets, 0xff, shift * sizeof(*buckets));
+      num_buckets += shift;
+      base -= shift * BUCKET_SECS;
+    }
+
+    b = (h->ts.tv_sec - base) / BUCKET_SECS;
+    if (b >= num_buckets) {
+      buckets = realloc(buckets, (b + 1) * sizeof(*buckets));
+      if (buckets == NULL)
+	die("out of memory indexing %s", path);
+      memset(buckets + num_buckets, 0xff,
+	     (b + 1 - num_buckets) * sizeof(*buckets));
+      num_buckets = b + 1;
+    }
+    if (buckets[b].first == ~(u_int64_t) 0)
+      buckets[b].first = record_offset;
+    buckets[b].end = ftello(fp);
+
+    handler(NULL, h, data);
+  }
+
+  building_index = 0;
+  if (rc == -1)
+    die("%s: %s", path, pcap_geterr(pd));
+
+  write_index(path, &st, buckets, num_buckets, base);
+
+  for (i = 0; i < INDEX_HASH; i++)
+    for (f = build_hash[i]; f != NULL; f = next) {
+      next = f->next;
+      free(f->offsets);
+      free(f);
+    }
+  free(build_hash);
+  free(buckets);
+  pcap_close(pd);
+}
+
+
+static int compare_offsets(const void *a, const void *b)
+{
+  u_int64_t x = *(const u_int64_t *) a, y = *(const u_int64_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+
+/* Does a stretch of capture time overlap --time-range? */
+static int in_time_range(int64_t first, int64_t last)
+{
+  return (time_range_from == 0 || last >= time_range_from) &&
+    (time_range_to == 0 || first < time_range_to);
+}
+
+
+/* If there's an up-to-date index for the capture file just opened as
+ * 'pd', and it can save us reading all of it, work out what to read */
+void select_from_index(pcap_t *pd, char *path, int use_flows)
+{
+  struct index_header *hdr;
+  struct index_bucket *buckets;
+  struct index_flow *flows;
+  u_int64_t *offsets, *chosen = NULL;
+  u_int64_t i, count = 0, start = ~(u_int64_t) 0, end = 0;
+  struct selection *sel;
+  struct stat st, ist;
+  char *name;
+  void *map;
+  int fd;
+
+  if (!use_flows && time_range_from == 0 && time_range_to == 0)
+    return;
+
+  name = index_path(path);
+  if ((fd = open(name, O_RDONLY)) < 0) {
+    free(name);
+    return;
+  }
+
+  if (fstat(fd, &ist) < 0 || ist.st_size < (off_t) sizeof(*hdr) ||
+      stat(path, &st) < 0 ||
+      (map = mmap(NULL, ist.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+      MAP_FAILED) {
+    DEBUG(1) ("warning: can't use index %s", name);
+    close(fd);
+    free(name);
+    return;
+  }
+  close(fd);
+
+  hdr = (struct index_header *) map;
+  buckets = (struct index_bucket *) (hdr + 1);
+  flows = (struct index_flow *) (buckets + hdr->num_buckets);
+  offsets = (u_int64_t *) (flows + hdr->num_flows);
+
+  if (hdr->magic != INDEX_MAGIC || hdr->version != INDEX_VERSION ||
+      (u_int64_t) ist.st_size != sizeof(*hdr) +
+      hdr->num_buckets * sizeof(*buckets) +
+      hdr->num_flows * sizeof(*flows) + hdr->num_offsets * sizeof(*offsets)) {
+    DEBUG(1) ("warning: %s is not a usable index; ignoring it", name);
+    goto done;
+  }
+
+  if (hdr->file_size != (u_int64_t) st.st_size ||
+      hdr->file_mtime != (u_int64_t) st.st_mtime) {
+    DEBUG(1) ("warning: %s has changed since %s was built; ignoring it",
+	      path, name);
+    goto done;
+  }
+
+  if (use_flows) {
+    /* the packets of the flows the filter wants, in file order */
+    for (i = 0; i < hdr->num_flows; i++) {
+      flow_t flow;
+
+      flow.src = flows[i].src;
+      flow.dst = flows[i].dst;
+      flow.sport = flows[i].sport;
+      flow.dport = flows[i].dport;
+      if (in_time_range(flows[i].first_sec, flows[i].last_sec) &&
+	  fast_filter_wants(&flow))
+	count += flows[i].count;
+    }
+
+    /* seeking around for most of the file is slower than reading it */
+    if (count > hdr->num_offsets / 2) {
+      DEBUG(10) ("%s: filter wants most of the file; not using index",
+		 path);
+      goto done;
+    }
+
+    chosen = MALLOC(u_int64_t, count ? count : 1);
+    for (count = 0, i = 0; i < hdr->num_flows; i++) {
+      flow_t flow;
+
+      flow.src = flows[i].src;
+      flow.dst = flows[i].dst;
+      flow.sport = flows[i].sport;
+      flow.dport = flows[i].dport;
+      if (in_time_range(flows[i].first_sec, flows[i].last_sec) &&
+	  fast_filter_wants(&flow)) {
+	memcpy(chosen + count, offsets + flows[i].first_offset,
+	       flows[i].count * sizeof(*chosen));
+	count += flows[i].count;
+      }
+    }
+    qsort(chosen, count, sizeof(*chosen), compare_offsets);
+  } else {
+    /* everything from the first packet of the first bucket we want
+     * to the last one of the last */
+    for (i = 0; i < hdr->num_buckets; i++) {
+      int64_t from = hdr->bucket_base + (int64_t) i * hdr->bucket_secs;
+
+      if (buckets[i].first == ~(u_int64_t) 0 ||
+	  !in_time_range(from, from + hdr->bucket_secs - 1))
+	continue;
+      if (buckets[i].first < start)
+	start = buckets[i].first;
+      if (buckets[i].end > end)
+	end = buckets[i].end;
+    }
+    if (start > end)
+      start = end = 0;
+  }
+
+  sel = &selections[num_selections++];
+  sel->pd = pd;
+  sel->offsets = chosen;
+  sel->count = count;
+  sel->next = 0;
+  sel->start = start;
+  sel->end = end;
+  sel->pos = ftello(pcap_file(pd));
+
+  if (chosen != NULL) {
+    DEBUG(10) ("%s: reading %llu of %llu packets, from index %s", path,
+	       (unsigned long long) count,
+	       (unsigned long long) hdr->num_offsets, name);
+  } else {
+    DEBUG(10) ("%s: reading bytes %llu to %llu, from index %s", path,
+	       (unsigned long long) start, (unsigned long long) end, name);
+  }
+
+ done:
+  munmap(map, ist.st_size);
+  free(name);
+}
+
+
+static struct selection *find_selection(pcap_t *pd)
+{
+  int i;
+
+  for (i = 0; i < num_selections; i++)
+    if (selections[i].pd == pd)
+      return &selections[i];
+  return NULL;
+}
+
+
+/* pcap_dispatch(), but for files with an index, only the packets we
+ * picked out of it */
+int index_dispatch(pcap_t *pd, int count, pcap_handler handler,
+		   u_char *user)
+{
+  struct selection *sel = find_selection(pd);
+  struct pcap_pkthdr *h;
+  const u_char *data;
+  u_int64_t offset;
+  int n = 0, rc;
+
+  if (sel == NULL)
+    return pcap_dispatch(pd, count, handler, user);
+
+  if (count <= 0)
+    count = DISPATCH_CHUNK;
+  while (n < count) {
+    if (sel->offsets != NULL) {
+      if (sel->next == sel->count)
+	break;
+      offset = sel->offsets[sel->next++];
+    } else {
+      if (sel->pos < (off_t) sel->start)
+	sel->pos = -1;		/* not there yet */
+      offset = sel->pos < 0 ? sel->start : (u_int64_t) sel->pos;
+      if (offset >= sel->end)
+	break;
+    }
+
+    if ((off_t) offset != sel->pos) {
+      if (fseeko(pcap_file(pd), offset, SEEK_SET) < 0)
+	die("can't seek in capture file: %s", strerror(errno));
+      seeks++;
+    }
+
+    if ((rc = pcap_next_ex(pd, &h, &data)) != 1) {
+      if (rc == -1)
+	return -1;
+      break;
+    }
+    sel->pos = ftello(pcap_file(pd));
+    records_read++;
+
+    handler(user, h, data);
+    n++;
+  }
+
+  return n;
+}
+
+
+void print_index_stats()
+{
+  if (num_selections == 0)
+    return;
+
+  DEBUG(10) ("index: read %lld packets with %lld seeks", records_read,
+	     seeks);
+}
@@ -0,0 +1,83 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * Static tracepoints.  If configure finds systemtap's <sys/sdt.h>,
+ * each of these is a USDT probe of provider "tcpflow", which tracers
+ * such as bpftrace and perf can attach to by name, e.g.
+ *
+ *   bpftrace -e 'usdt:./tcpflow:tcpflow:write { @[arg3] = sum(arg5); }'
+ *
+ * A probe is a single no-op instruction until a tracer attaches, and
+ * its arguments are only values the code around it has at hand.
+ * Without <sys/sdt.h>, they compile to nothing.
+ *
+ * Every probe starts with the flow's four-tuple (source address, source
+ * port, destination address, destination port, in host byte order);
+ * after that come
+ *
+ *   packet		sequence number, payload length, TCP flags
+ *   flow-create	initial sequence number
+ *   flow-finish	packets, payload bytes, FLOW_ flags (see tcpflow.h)
+ *   file-open		file name, FD slot
+ *   file-evict		FDs in the ring (an older file was closed to make
+ *			room, or because we ran out of FDs)
+ *   write		offset in the flow, bytes written
+ *   drop		sequence number, payload length, PROBE_DROP_ reason
+ */
+
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
+
+/* Why a drop probe fired */
+#define PROBE_DROP_FINISHED	1	/* the flow was finished already */
+#define PROBE_DROP_BEFORE_ISN	2	/* from before the start of the flow */
+#define PROBE_DROP_LIMIT	3	/* past -b */
+#define PROBE_DROP_WRITTEN	4	/* a retransmission of what we wrote */
+#define PROBE_DROP_DUPLICATE	5	/* a copy, with --dedup */
+
+/* systemtap's, not the BSD kernel's <sys/sdt.h> */
+#ifdef STAP_PROBE7
+
+#define PROBE_PACKET(flow, seq, length, flags) \
+  STAP_PROBE7(tcpflow, packet, (flow).src, (flow).sport, (flow).dst, \
+	      (flow).dport, seq, length, flags)
+#define PROBE_FLOW_CREATE(flow, isn) \
+  STAP_PROBE5(tcpflow, flow__create, (flow).src, (flow).sport, (flow).dst, \
+	      (flow).dport, isn)
+#define PROBE_FLOW_FINISH(flow, packets, bytes, flags) \
+  STAP_PROBE7(tcpflow, flow__finish, (flow).src, (flow).sport, (flow).dst, \
+	      (flow).dport, packets, bytes, flags)
+#define PROBE_FILE_OPEN(flow, filename, slot) \
+  STAP_PROBE6(tcpflow, file__open, (flow).src, (flow).sport, (flow).dst, \
+	      (flow).dport, filename, slot)
+#define PROBE_FILE_EVICT(flow, fds) \
+  STAP_PROBE5(tcpflow, file__evict, (flow).src, (flow).sport, (flow).dst, \
+	      (flow).dport, fds)
+#define PROBE_WRITE(flow, offset, length) \
+  STAP_PROBE6(tcpflow, write, (flow).src, (flow).sport, (flow).dst, \
+	      (flow).dport, offset, length)
+#define PROBE_DROP(flow, seq, length, reason) \
+  STAP_PROBE7(tcpflow, drop, (flow).src, (flow).sport, (flow).dst, \
+	      (flow).dport, seq, length, reason)
+
+#else
+
+#define PROBE_PACKET(flow, seq, length, flags)
+#define PROBE_FLOW_CREATE(flow, isn)
+#define PROBE_FLOW_FINISH(flow, packets, bytes, flags)
+#define PROBE_FILE_OPEN(flow, filename, slot)
+#define PROBE_FILE_EVICT(flow, fds)
+#define PROBE_WRITE(flow, offset, length)
+#define PROBE_DROP(flow, seq, length, reason)
+
+#endif /* STAP_PROBE7 */
+
+#endif /* __PROBES_H__ */
@@ -0,0 +1,580 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * --serve: stream flow data to local subscribers over a Unix domain
+ * socket, instead of writing flow files.
+ *
+ * A subscriber connects and sends one line saying what it wants:
+ *
+ *   port 80,443		segments to or from any of these ports
+ *   <expression>		a tcpdump-style filter on addresses and ports
+ *   (empty line)		everything
+ *
+ * The server answers "ok" (or "error: ..." and hangs up), and from then
+ * on sends a record for each matching segment: a struct flowring_rec
+ * header (see flowring.h) followed by the payload, padded to
+ * FLOWRING_ALIGN, exactly as they are laid out in a flow ring.
+ *
+ * Every subscriber has a queue of its own.  When a subscriber can't
+ * keep up and its queue fills, records for it are dropped and counted,
+ * and the next one it does get is marked FLOWRING_GAP; nobody else is
+ * held up, and neither is the capture.
+ *
+ * Sockets are serviced with epoll.  For live captures the packet
+ * filter's descriptor is in the same epoll set, so we sleep until
+ * either packets or subscribers need attention; when reading a file we
+ * check in on the subscribers between batches of packets.
+ */
+
+#include "tcpflow.h"
+#include "flowring.h"
+
+extern char *serve_path;
+extern long long serve_queue_size;
+extern int serve_clients;
+extern volatile sig_atomic_t terminate_requested;
+
+#ifdef HAVE_SYS_EPOLL_H
+
+#define MAX_SUBSCRIPTION 1024	/* longest subscription line we'll take */
+#define MAX_EVENTS	 64
+#define BATCH		 64	/* packets between visits, when reading a file */
+#define DRAIN_SECS	 5	/* how long to wait at exit for subscribers
+				 * that have stopped reading */
+
+#define REC_SPACE(len) \
+  ((sizeof(struct flowring_rec) + (len) + FLOWRING_ALIGN - 1) & \
+   ~((u_int32_t) FLOWRING_ALIGN - 1))
+
+typedef struct client {
+  int fd;
+  int subscribed;		/* we've had its subscription line */
+  char line[MAX_SUBSCRIPTION];
+  int line_len;
+
+  u_int16_t *ports;		/* "port" subscriptions */
+  int nports;
+  struct bpf_program prog;	/* expression subscriptions */
+  int has_prog;
+
+  u_char *queue;		/* circular; 'size' bytes */
+  u_int32_t size, head, len;	/* head: oldest unsent byte */
+  int blocked;			/* the socket is full; wait for EPOLLOUT */
+  int gap;			/* we've dropped something since the last
+				 * record that made it */
+
+  long long records, bytes;	/* sent */
+  long long dropped_records, dropped_bytes;
+
+  struct client *next;
+} client_t;
+
+static int listen_fd = -1;
+static int epoll_fd = -1;
+static int pcap_fd = -1;	/* live captures only */
+static pcap_t *dead_pcap;	/* for compiling subscriber filters */
+static client_t *clients;
+static int num_subscribed;
+
+static long long total_clients;
+static long long total_dropped;
+
+
+void init_server()
+{
+  struct sockaddr_un addr;
+  struct epoll_event ev;
+
+  if (serve_path == NULL)
+    return;
+
+  if (strlen(serve_path) >= sizeof(addr.sun_path))
+    die("--serve path %s is too long", serve_path);
+
+  if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    die("can't create socket: %s", strerror(errno));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, serve_path);
+  unlink(serve_path);
+
+  if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+    die("can't bind to %s: %s", serve_path, strerror(errno));
+  if (listen(listen_fd, 16) < 0)
+    die("can't listen on %s: %s", serve_path, strerror(errno));
+  fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+
+  if ((epoll_fd = epoll_create(MAX_EVENTS)) < 0)
+    die("epoll_create: %s", strerror(errno));
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;		/* NULL is the listening socket */
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0)
+    die("epoll_ctl: %s", strerror(errno));
+
+  if ((dead_pcap = pcap_open_dead(DLT_RAW, SNAPLEN)) == NULL)
+    die("can't set up filter compiler");
+
+  /* a subscriber going away shouldn't take us with it */
+  portable_signal(SIGPIPE, SIG_IGN);
+
+  DEBUG(10) ("serving flow data on %s", serve_path);
+}
+
+
+static void drop_client(client_t *c, const char *why)
+{
+  client_t **pp;
+
+  DEBUG(5) ("subscriber %d %s: sent %lld records (%lld bytes), dropped %lld "
+	    "(%lld bytes)", c->fd, why, c->records, c->bytes,
+	    c->dropped_records, c->dropped_bytes);
+
+  for (pp = &clients; *pp != NULL; pp = &(*pp)->next)
+    if (*pp == c) {
+      *pp = c->next;
+      break;
+    }
+
+  if (c->subscribed)
+    num_subscribed--;
+  total_dropped += c->dropped_records;
+
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  if (c->has_prog)
+    pcap_freecode(&c->prog);
+  free(c->ports);
+  free(c->queue);
+  free(c);
+}
+
+
+static void accept_clients()
+{
+  struct epoll_event ev;
+  client_t *c;
+  int fd;
+
+  while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    c = MALLOC(client_t, 1);
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+    c->size = (u_int32_t) serve_queue_size;
+    c->queue = MALLOC(u_char, c->size);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      DEBUG(1) ("epoll_ctl: %s", strerror(errno));
+      close(fd);
+      free(c->queue);
+      free(c);
+      continue;
+    }
+
+    c->next = clients;
+    clients = c;
+    total_clients++;
+    DEBUG(5) ("subscriber %d connected", fd);
+  }
+}
+
+
+/* Make sense of a subscription line.  Returns NULL if it's fine, or
+ * what's wrong with it. */
+static const char *subscribe(client_t *c, char *line)
+{
+  char *p;
+
+  while (isspace((u_char) *line))
+    line++;
+
+  if (!strncmp(line, "port ", 5)) {
+    c->ports = MALLOC(u_int16_t, strlen(line));
+    for (p = strtok(line + 5, ", \t"); p != NULL; p = strtok(NULL, ", \t")) {
+      int port = atoi(p);
+      if (port <= 0 || port > 65535)
+	return "bad port";
+      c->ports[c->nports++] = port;
+    }
+    if (c->nports == 0)
+      return "no ports";
+  } else if (*line != '\0') {
+    if (pcap_compile(dead_pcap, &c->prog, line, 1, 0) < 0)
+      return pcap_geterr(dead_pcap);
+    c->has_prog = 1;
+  }
+
+  return NULL;
+}
+
+
+/* Read what a subscriber has sent us.  All we expect is its
+ * subscription; after that, anything but EOF is ignored. */
+static void read_client(client_t *c)
+{
+  char buf[256], *nl;
+  const char *err;
+  int n;
+
+  while ((n = read(c->fd, buf, sizeof(buf))) > 0) {
+    if (c->subscribed)
+      continue;
+    if (c->line_len + n >= MAX_SUBSCRIPTION) {
+      drop_client(c, "sent too long a subscription");
+      return;
+    }
+    memcpy(c->line + c->line_len, buf, n);
+    c->line_len += n;
+    c->line[c->line_len] = '\0';
+
+    if ((nl = strchr(c->line, '\n')) == NULL)
+      continue;
+    *nl = '\0';
+    if (nl > c->line && nl[-1] == '\r')
+      nl[-1] = '\0';
+
+    DEBUG(5) ("subscriber %d: '%s'", c->fd, c->line);
+    if ((err = subscribe(c, c->line)) != NULL) {
+      char reply[MAX_SUBSCRIPTION + 16];
+      snprintf(reply, sizeof(reply), "error: %s\n", err);
+      write(c->fd, reply, strlen(reply));
+      drop_client(c, "sent a bad subscription");
+      return;
+    }
+
+    write(c->fd, "ok\n", 3);
+    c->subscribed = 1;
+    num_subscribed++;
+  }
+
+  if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+    drop_client(c, "went away");
+}
+
+
+/* Send as much of a subscriber's queue as its socket will take */
+static void flush_client(client_t *c)
+{
+  struct epoll_event ev;
+  struct iovec iov[2];
+  int n, iovcnt;
+
+  while (c->len > 0) {
+    iov[0].iov_base = c->queue + c->head;
+    if (c->head + c->len <= c->size) {
+      iov[0].iov_len = c->len;
+      iovcnt = 1;
+    } else {
+      iov[0].iov_len = c->size - c->head;
+      iov[1].iov_base = c->queue;
+      iov[1].iov_len = c->len - iov[0].iov_len;
+      iovcnt = 2;
+    }
+
+    if ((n = writev(c->fd, iov, iovcnt)) < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+	/* let epoll tell us when there's room again */
+	c->blocked = 1;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLOUT;
+	ev.data.ptr = c;
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+      } else {
+	drop_client(c, "went away");
+      }
+      return;
+    }
+
+    c->head = (c->head + n) % c->size;
+    c->len -= n;
+  }
+}
+
+
+static void unblock_client(client_t *c)
+{
+  struct epoll_event ev;
+
+  c->blocked = 0;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = c;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+  flush_client(c);
+}
+
+
+/* Copy into a subscriber's queue, wrapping around the end */
+static void enqueue(client_t *c, const void *data, u_int32_t len)
+{
+  u_int32_t tail = (c->head + c->len) % c->size;
+  u_int32_t first = c->size - tail;
+
+  if (first > len)
+    first = len;
+  memcpy(c->queue + tail, data, first);
+  memcpy(c->queue, (const u_char *) data + first, len - first);
+  c->len += len;
+}
+
+
+/* Does a subscriber want this flow?  Expressions are matched against
+ * a made-up IP/TCP header carrying the flow's addresses and ports, so
+ * they can't look at anything else. */
+static int wants(client_t *c, flow_t *flow, u_int32_t length)
+{
+  struct {
+    struct ip ip;
+    struct tcphdr tcp;
+  } hdr;
+  int i;
+
+  if (c->nports) {
+    for (i = 0; i < c->nports; i++)
+      if (c->ports[i] == flow->sport || c->ports[i] == flow->dport)
+	return 1;
+    return 0;
+  }
+
+  if (!c->has_prog)
+    return 1;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.ip.ip_v = 4;
+  hdr.ip.ip_hl = sizeof(hdr.ip) / 4;
+  hdr.ip.ip_len = htons(sizeof(hdr) + length);
+  hdr.ip.ip_ttl = 64;
+  hdr.ip.ip_p = IPPROTO_TCP;
+  hdr.ip.ip_src.s_addr = htonl(flow->src);
+  hdr.ip.ip_dst.s_addr = htonl(flow->dst);
+  hdr.tcp.th_sport = htons(flow->sport);
+  hdr.tcp.th_dport = htons(flow->dport);
+  hdr.tcp.th_off = sizeof(hdr.tcp) / 4;
+
+  return bpf_filter(c->prog.bf_insns, (u_char *) &hdr,
+		    sizeof(hdr) + length, sizeof(hdr)) != 0;
+}
+
+
+/* Queue a segment for every subscriber that wants it.  Returns 0 if
+ * any of them had to miss it because its queue was full, 1 otherwise. */
+int serve_packet(flow_state_t *flow_state, const u_char *data,
+		 u_int32_t length, tcp_seq offset, struct timeval *tv)
+{
+  static const u_char zeros[FLOWRING_ALIGN];
+  struct flowring_rec rec;
+  u_int32_t space = REC_SPACE(length);
+  client_t *c;
+  int queued = 1;
+
+  if (num_subscribed == 0)
+    return 1;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.len = length;
+  rec.type = FLOWRING_DATA;
+  rec.src = flow_state->flow.src;
+  rec.dst = flow_state->flow.dst;
+  rec.sport = flow_state->flow.sport;
+  rec.dport = flow_state->flow.dport;
+  rec.offset = offset;
+  rec.ts_sec = tv->tv_sec;
+  rec.ts_usec = tv->tv_usec;
+  if (IS_SET(flow_state->flags, FLOW_FINISHED))
+    rec.flags |= FLOWRING_LAST;
+  if (IS_SET(flow_state->flags, FLOW_REPLY))
+    rec.flags |= FLOWRING_REPLY;
+
+  for (c = clients; c != NULL; c = c->next) {
+    if (!c->subscribed || !wants(c, &flow_state->flow, length))
+      continue;
+
+    if (c->size - c->len < space) {
+      c->dropped_records++;
+      c->dropped_bytes += length;
+      c->gap = 1;
+      queued = 0;
+      continue;
+    }
+
+    rec.flags &= ~FLOWRING_GAP;
+    if (c->gap)
+      rec.flags |= FLOWRING_GAP;
+    c->gap = 0;
+
+    enqueue(c, &rec, sizeof(rec));
+    enqueue(c, data, length);
+    enqueue(c, zeros, space - sizeof(rec) - length);
+    c->records++;
+    c->bytes += length;
+  }
+
+  return queued;
+}
+
+
+/* Wait up to 'timeout' msecs for something to happen on the sockets
+ * (or on the packet filter, for live captures), and deal with it.
+ * Returns 1 if there are packets waiting to be read. */
+static int serve_poll(int timeout)
+{
+  struct epoll_event events[MAX_EVENTS];
+  client_t *c, *next;
+  int i, n, packets = 0;
+
+  /* start sending whatever has been queued since last time */
+  for (c = clients; c != NULL; c = next) {
+    next = c->next;
+    if (c->len > 0 && !c->blocked)
+      flush_client(c);
+  }
+
+  if ((n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout)) < 0) {
+    if (errno != EINTR)
+      die("epoll_wait: %s", strerror(errno));
+    return 0;
+  }
+
+  for (i = 0; i < n; i++) {
+    c = (client_t *) events[i].data.ptr;
+
+    if (c == NULL) {
+      accept_clients();
+    } else if (c == (client_t *) &pcap_fd) {
+      packets = 1;
+    } else if (events[i].events & EPOLLOUT) {
+      unblock_client(c);
+    } else {
+      read_client(c);
+    }
+  }
+
+  return packets;
+}
+
+
+/* Stand in for pcap_loop() while we're serving.  Returns what
+ * pcap_dispatch() last returned, or 0 if a signal stopped us. */
+int serve_loop(pcap_t *pd, pcap_handler handler, int live)
+{
+  char errbuf[PCAP_ERRBUF_SIZE];
+  struct epoll_event ev;
+  client_t *c, *next;
+  long long queued, last_queued = -1;
+  time_t last_progress = 0;
+  int rc = 0;
+
+  /* if asked to, wait for subscribers before starting */
+  if (serve_clients)
+    DEBUG(1) ("waiting for %d subscribers on %s", serve_clients, serve_path);
+  while (num_subscribed < serve_clients && !terminate_requested)
+    serve_poll(-1);
+
+  if (live && (pcap_fd = pcap_get_selectable_fd(pd)) >= 0 &&
+      pcap_setnonblock(pd, 1, errbuf) == 0) {
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &pcap_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pcap_fd, &ev) < 0)
+      die("epoll_ctl: %s", strerror(errno));
+
+    /* a signal interrupts the wait */
+    while (!terminate_requested)
+      if (serve_poll(-1) && (rc = capture_dispatch(pd, -1, handler)) < 0)
+	break;
+  } else {
+    /* a file (or a device we can't wait on): take packets in batches,
+     * seeing to the subscribers in between */
+    while (!terminate_requested &&
+	   (rc = capture_dispatch(pd, BATCH, handler)) > 0)
+      serve_poll(0);
+  }
+
+  /* stopped by a signal, not by an error */
+  if (terminate_requested)
+    rc = 0;
+  if (rc < 0)
+    return rc;
+
+  /* give subscribers everything that's queued for them before we go,
+   * as long as they're still taking it */
+  for (;;) {
+    queued = 0;
+    for (c = clients; c != NULL; c = c->next)
+      queued += c->len;
+    if (queued == 0)
+      break;
+
+    if (queued != last_queued) {
+      last_queued = queued;
+      last_progress = time(NULL);
+    } else if (time(NULL) - last_progress >= DRAIN_SECS) {
+      for (c = clients; c != NULL; c = next) {
+	next = c->next;
+	if (c->len > 0) {
+	  DEBUG(1) ("subscriber %d stopped reading; %u bytes not sent",
+		    c->fd, c->len);
+	  drop_client(c, "stopped reading at exit");
+	}
+      }
+      break;
+    }
+    serve_poll(100);
+  }
+
+  return rc;
+}
+
+
+void close_server()
+{
+  if (listen_fd < 0)
+    return;
+
+  while (clients != NULL)
+    drop_client(clients, "disconnected at exit");
+  close(listen_fd);
+  listen_fd = -1;
+  unlink(serve_path);
+}
+
+
+void print_server_stats()
+{
+  client_t *c;
+  long long dropped = total_dropped;
+  int level;
+
+  if (listen_fd < 0)
+    return;
+
+  for (c = clients; c != NULL; c = c->next)
+    dropped += c->dropped_records;
+
+  level = dropped ? 1 : 10;
+  DEBUG(level) ("served %lld subscribers; %lld records dropped for slow "
+		"subscribers", total_clients, dropped);
+}
+
+#else /* HAVE_SYS_EPOLL_H */
+
+/* main() refuses --serve without epoll, so these never run */
+void init_server() { }
+int serve_packet(flow_state_t *flow_state, const u_char *data,
+		 u_int32_t length, tcp_seq offset, struct timeval *tv) { return 1; }
+int serve_loop(pcap_t *pd, pcap_handler handler, int live) { return -1; }
+void close_server() { }
+void print_server_stats() { }
+
+#endif /* HAVE_SYS_EPOLL_H */
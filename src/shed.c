@@ -0,0 +1,247 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * Load shedding (--shed).  When we can't keep up with a live capture,
+ * the kernel drops packets wherever they happen to fall, and every flow
+ * ends up with holes in it.  Instead, we watch for the signs of falling
+ * behind ourselves, and then turn away flows we care less about, so
+ * that the ones we care about most come through whole.
+ *
+ * We're behind when packets have been dropped (by the kernel, or by a
+ * full --capture-ring) since we last looked, or when the packet we're
+ * handling was captured more than --shed-lag seconds ago.  We look once
+ * a second of capture time, and keep shedding until SHED_HOLD seconds
+ * after the last sign of trouble.
+ *
+ * Only new flows are shed, and only those with neither port in
+ * --priority-ports.  While we're behind, the --shed policies decide
+ * what happens to them:
+ *
+ *   refuse    none are taken
+ *   flows=n   none are taken while n flows have carried data in the
+ *             last ACTIVE_SECS seconds
+ *   bytes=n   they're taken, but only their first n bytes (as with -b)
+ *
+ * A flow whose other direction was taken is always taken, with the
+ * same limit, and one whose other direction was refused never is, so
+ * connections are kept or shed whole.
+ */
+
+#include "tcpflow.h"
+
+extern int shed_lag;
+extern tcpflow_ctx *flow_table;
+
+#define SHED_HOLD	10	/* secs to carry on shedding */
+#define ACTIVE_SECS	60	/* how recent a flow's data makes it active */
+
+static int shed_policy;		/* --shed was given */
+static int shed_refuse;		/* its policies */
+static int shed_max_flows;
+static int shed_max_bytes;
+static u_char *priority;	/* bitmap of --priority-ports */
+static int shed_live;
+
+static int overloaded;
+static time_t last_check;
+static time_t shed_until;
+static long long last_drops;
+
+/* flows that last carried data in each of the last ACTIVE_SECS
+ * seconds, for flows=n */
+static struct {
+  time_t sec;
+  int flows;
+} active[ACTIVE_SECS];
+
+static long long times_overloaded;
+static long long flows_shed;
+static long long flows_limited;
+
+
+/* Parse the argument of --priority-ports: a comma-separated list of
+ * ports and port ranges */
+int parse_priority_ports(char *list)
+{
+  char *item, *end;
+  long lo, hi;
+
+  priority = MALLOC(u_char, 65536 / 8);
+  memset(priority, 0, 65536 / 8);
+
+  for (item = strtok(list, ","); item != NULL; item = strtok(NULL, ",")) {
+    lo = hi = strtol(item, &end, 10);
+    if (*end == '-')
+      hi = strtol(end + 1, &end, 10);
+    if (end == item || *end != '\0' || lo < 0 || hi > 65535 || lo > hi)
+      return -1;
+    for (; lo <= hi; lo++)
+      priority[lo >> 3] |= 1 << (lo & 7);
+  }
+
+  return 0;
+}
+
+
+/* Parse the argument of --shed: a comma-separated list of policies */
+int parse_shed_policy(char *list)
+{
+  char *item;
+
+  for (item = strtok(list, ","); item != NULL; item = strtok(NULL, ",")) {
+    if (!strcmp(item, "refuse")) {
+      shed_refuse = 1;
+    } else if (!strncmp(item, "flows=", 6)) {
+      if ((shed_max_flows = atoi(item + 6)) <= 0)
+	return -1;
+    } else if (!strncmp(item, "bytes=", 6)) {
+      if ((shed_max_bytes = parse_size(item + 6)) <= 0)
+	return -1;
+    } else {
+      return -1;
+    }
+  }
+
+  shed_policy = 1;
+  return 0;
+}
+
+
+void init_shed(int live)
+{
+  if (!shed_policy)
+    return;
+
+  /* there's no falling behind a file */
+  if (!live) {
+    DEBUG(1) ("warning: --shed only works for live captures; ignored");
+    return;
+  }
+
+  shed_live = 1;
+  DEBUG(10) ("shedding new flows when more than %d seconds behind",
+	     shed_lag);
+}
+
+
+/* Called for every packet: are we keeping up? */
+void shed_tick(struct timeval *tv)
+{
+  struct timeval now;
+  long long drops;
+  int behind;
+
+  if (!shed_live || tv->tv_sec == last_check)
+    return;
+  last_check = tv->tv_sec;
+
+  gettimeofday(&now, NULL);
+  drops = capture_drops();
+  behind = (drops > last_drops) || (now.tv_sec - tv->tv_sec > shed_lag);
+  last_drops = drops;
+
+  if (behind) {
+    if (!overloaded) {
+      DEBUG(1) ("falling behind (%ld seconds, %lld packets dropped); "
+		"shedding new flows", (long) (now.tv_sec - tv->tv_sec),
+		drops);
+      times_overloaded++;
+    }
+    overloaded = 1;
+    shed_until = now.tv_sec + SHED_HOLD;
+  } else if (overloaded && now.tv_sec >= shed_until) {
+    DEBUG(1) ("caught up; taking all new flows again");
+    overloaded = 0;
+  }
+}
+
+
+/* With flows=n: a flow is carrying data at 'now'; it last did at
+ * 'before' (0 if it's new).  Keeps the count of active flows. */
+void shed_activity(time_t before, time_t now)
+{
+  int slot;
+
+  if (shed_max_flows == 0 || before >= now)
+    return;
+
+  slot = before % ACTIVE_SECS;
+  if (before && active[slot].sec == before && active[slot].flows > 0)
+    active[slot].flows--;
+
+  slot = now % ACTIVE_SECS;
+  if (active[slot].sec != now) {
+    active[slot].sec = now;
+    active[slot].flows = 0;
+  }
+  active[slot].flows++;
+}
+
+
+static int active_flows(time_t now)
+{
+  int i, flows = 0;
+
+  for (i = 0; i < ACTIVE_SECS; i++)
+    if (now - active[i].sec < ACTIVE_SECS)
+      flows += active[i].flows;
+  return flows;
+}
+
+
+static int priority_flow(flow_t *flow)
+{
+  return priority != NULL &&
+    ((priority[flow->sport >> 3] & (1 << (flow->sport & 7))) ||
+     (priority[flow->dport >> 3] & (1 << (flow->dport & 7))));
+}
+
+
+/* A flow has just been created: decide whether we can afford it */
+void shed_new_flow(flow_state_t *flow_state, const struct timeval *tv)
+{
+  flow_state_t *other = reverse_flow_state(flow_state);
+
+  if (!shed_live)
+    return;
+
+  /* the other direction has been decided already */
+  if (other != NULL) {
+    if (IS_SET(other->flags, FLOW_SHED))
+      SET_BIT(flow_state->flags, FLOW_FINISHED | FLOW_SHED);
+    else
+      tcpflow_limit_flow(flow_table, flow_state->tcp, other->tcp->max_bytes);
+    return;
+  }
+
+  if (!overloaded || priority_flow(&flow_state->flow))
+    return;
+
+  if (shed_refuse ||
+      (shed_max_flows && active_flows(tv->tv_sec) >= shed_max_flows)) {
+    DEBUG(5) ("%s: shedding new flow", flow_filename(flow_state->flow));
+    SET_BIT(flow_state->flags, FLOW_FINISHED | FLOW_SHED);
+    flows_shed++;
+  } else if (shed_max_bytes &&
+	     (flow_state->tcp->max_bytes == 0 ||
+	      flow_state->tcp->max_bytes > shed_max_bytes)) {
+    tcpflow_limit_flow(flow_table, flow_state->tcp, shed_max_bytes);
+    flows_limited++;
+  }
+}
+
+
+void print_shed_stats()
+{
+  int level = times_overloaded ? 1 : 10;
+
+  if (!shed_live)
+    return;
+
+  DEBUG(level) ("load shedding: fell behind %lld times; %lld flows shed, "
+		"%lld limited", times_overloaded, flows_shed, flows_limited);
+}
@@ -0,0 +1,105 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * --shm-ring: instead of writing flow files, hand every segment to a
+ * local consumer through a flow ring in shared memory (see flowring.h).
+ * Segments go out as they arrive, each tagged with its flow and its
+ * offset in the flow, exactly as they would have been written to the
+ * flow's file, so a consumer can lay them out the same way.
+ */
+
+#include "tcpflow.h"
+#include "flowring.h"
+
+extern char *shm_ring_name;
+extern long long shm_ring_size;
+
+static flowring_t *ring;
+static long long gaps;		/* flows that lost data at least once */
+
+
+void init_shm_ring()
+{
+  if (shm_ring_name == NULL)
+    return;
+
+  if ((ring = flowring_create(shm_ring_name, (size_t) shm_ring_size)) == NULL)
+    die("can't create shared memory ring %s: %s", shm_ring_name,
+	strerror(errno));
+
+  DEBUG(10) ("publishing flow data to shared memory ring %s (%lld bytes)",
+	     shm_ring_name, (long long) ring->ctl->info.size);
+}
+
+
+/* Publish a segment of a flow.  If the consumer isn't keeping up the
+ * segment is dropped, and the flow's next record will say so.  Returns
+ * 1 if it went into the ring, 0 if it was dropped. */
+int publish_packet(flow_state_t *flow_state, const u_char *data,
+		   u_int32_t length, tcp_seq offset, struct timeval *tv)
+{
+  struct flowring_rec rec;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.len = length;
+  rec.src = flow_state->flow.src;
+  rec.dst = flow_state->flow.dst;
+  rec.sport = flow_state->flow.sport;
+  rec.dport = flow_state->flow.dport;
+  rec.offset = offset;
+  rec.ts_sec = tv->tv_sec;
+  rec.ts_usec = tv->tv_usec;
+  if (IS_SET(flow_state->flags, FLOW_RING_GAP))
+    rec.flags |= FLOWRING_GAP;
+  if (IS_SET(flow_state->flags, FLOW_FINISHED))
+    rec.flags |= FLOWRING_LAST;
+  if (IS_SET(flow_state->flags, FLOW_REPLY))
+    rec.flags |= FLOWRING_REPLY;
+
+  if (flowring_publish(ring, &rec, data) < 0) {
+    if (!IS_SET(flow_state->flags, FLOW_RING_GAP))
+      gaps++;
+    SET_BIT(flow_state->flags, FLOW_RING_GAP);
+    DEBUG(20) ("%s: ring full, dropped %u bytes @%u",
+	       flow_filename(flow_state->flow), length, offset);
+    return 0;
+  }
+
+  flow_state->flags &= ~FLOW_RING_GAP;
+  return 1;
+}
+
+
+/* Tell the consumer there's nothing more coming */
+void close_shm_ring()
+{
+  if (ring == NULL)
+    return;
+
+  flowring_close(ring);
+  ring = NULL;
+}
+
+
+void print_ring_stats()
+{
+  struct flowring_info *info;
+  int level;
+
+  if (ring == NULL)
+    return;
+
+  /* only bother people if the consumer lost data */
+  info = &ring->ctl->info;
+  level = info->dropped_records ? 1 : 10;
+  DEBUG(level) ("ring %s: published %llu records (%llu bytes), "
+		"dropped %llu (%llu bytes) in %lld flows", shm_ring_name,
+		(unsigned long long) info->records,
+		(unsigned long long) info->bytes,
+		(unsigned long long) info->dropped_records,
+		(unsigned long long) info->dropped_bytes, gaps);
+}
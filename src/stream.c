@@ -0,0 +1,161 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * --stream-binary: instead of writing flow files, write every segment
+ * to standard output (or a file or fifo) as a binary record, for
+ * piping into other programs.  Unlike -c, nothing is converted or
+ * printed as text.
+ *
+ * The records are laid out exactly as in a flow ring or on a --serve
+ * socket: a struct flowring_rec header (see flowring.h), giving the
+ * flow, the direction (FLOWRING_REPLY), the offset of the segment in
+ * its flow and its capture time, followed by the payload, padded to
+ * FLOWRING_ALIGN.  Header fields are in host byte order.
+ *
+ * Records are collected in a big buffer and written out when it fills
+ * up, or when a second of packet time has gone by since the last
+ * write, so a slow trickle of packets doesn't sit in the buffer.  The
+ * reader is never skipped: if it can't keep up, we wait for it.
+ */
+
+#include "tcpflow.h"
+#include "flowring.h"
+
+extern char *stream_path;
+
+#define STREAM_BUFFER	(1024 * 1024)	/* bytes collected per write */
+
+#define REC_SPACE(len) \
+  ((sizeof(struct flowring_rec) + (len) + FLOWRING_ALIGN - 1) & \
+   ~((u_int32_t) FLOWRING_ALIGN - 1))
+
+static int stream_fd = -1;
+static u_char *buffer;
+static u_int32_t buffer_used;
+static time_t last_flush;
+
+static long long records;
+static long long bytes;
+static long long writes;
+
+
+void init_stream()
+{
+  if (stream_path == NULL)
+    return;
+
+  if (!strcmp(stream_path, "-")) {
+    stream_fd = 1;
+  } else {
+    /* a fifo blocks here until its reader shows up */
+    DEBUG(10) ("opening %s for the binary stream", stream_path);
+    if ((stream_fd = open(stream_path, O_WRONLY | O_CREAT | O_TRUNC,
+			  0666)) < 0)
+      die("can't open %s: %s", stream_path, strerror(errno));
+  }
+
+  /* a reader that goes away is an error, not a reason to die quietly */
+  portable_signal(SIGPIPE, SIG_IGN);
+
+  buffer = MALLOC(u_char, STREAM_BUFFER);
+  buffer_used = 0;
+
+  DEBUG(10) ("streaming flow data to %s",
+	     stream_fd == 1 ? "standard output" : stream_path);
+}
+
+
+/* Write out everything in the buffer */
+static void flush_stream()
+{
+  u_int32_t done = 0;
+  ssize_t n;
+
+  while (done < buffer_used) {
+    if ((n = write(stream_fd, buffer + done, buffer_used - done)) < 0) {
+      if (errno == EINTR)
+	continue;
+      die("error writing binary stream: %s", strerror(errno));
+    }
+    done += n;
+  }
+
+  if (buffer_used)
+    writes++;
+  buffer_used = 0;
+}
+
+
+static void append(const void *data, u_int32_t length)
+{
+  memcpy(buffer + buffer_used, data, length);
+  buffer_used += length;
+}
+
+
+/* Add a segment to the stream */
+void stream_packet(flow_state_t *flow_state, const u_char *data,
+		   u_int32_t length, tcp_seq offset, struct timeval *tv)
+{
+  static const u_char zeros[FLOWRING_ALIGN];
+  struct flowring_rec rec;
+  u_int32_t space = REC_SPACE(length);
+
+  /* a record is never bigger than the buffer (see SNAPLEN) */
+  if (space > STREAM_BUFFER - buffer_used)
+    flush_stream();
+
+  memset(&rec, 0, sizeof(rec));
+  rec.len = length;
+  rec.type = FLOWRING_DATA;
+  rec.src = flow_state->flow.src;
+  rec.dst = flow_state->flow.dst;
+  rec.sport = flow_state->flow.sport;
+  rec.dport = flow_state->flow.dport;
+  rec.offset = offset;
+  rec.ts_sec = tv->tv_sec;
+  rec.ts_usec = tv->tv_usec;
+  if (IS_SET(flow_state->flags, FLOW_FINISHED))
+    rec.flags |= FLOWRING_LAST;
+  if (IS_SET(flow_state->flags, FLOW_REPLY))
+    rec.flags |= FLOWRING_REPLY;
+
+  append(&rec, sizeof(rec));
+  append(data, length);
+  append(zeros, space - sizeof(rec) - length);
+  records++;
+  bytes += length;
+
+  if (tv->tv_sec != last_flush) {
+    if (last_flush != 0)
+      flush_stream();
+    last_flush = tv->tv_sec;
+  }
+}
+
+
+/* Write out what's left; the reader sees end of file */
+void close_stream()
+{
+  if (stream_fd < 0)
+    return;
+
+  flush_stream();
+  if (stream_fd != 1)
+    close(stream_fd);
+  stream_fd = -1;
+}
+
+
+void print_stream_stats()
+{
+  if (stream_path == NULL)
+    return;
+
+  DEBUG(10) ("binary stream: %lld records (%lld bytes of flow data) "
+	     "in %lld writes", records, bytes, writes);
+}
@@ -0,0 +1,329 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * tcpflow-search: find the flow files with a string in them, using
+ * tcpflow's --ngram-index to pick out the ones that might before
+ * reading any of them.
+ *
+ * A file might have the string in it if it has every trigram of the
+ * string, or if the index says it has to be read anyway (NGRAM_ALL).
+ * A file can be listed in more than one segment, each with some of its
+ * trigrams, so what the segments say is put together by file name
+ * before deciding.  By default those files are then read, and the ones
+ * that do have it are printed, once each, in the order they first
+ * appear in the index; with -l, they're printed without being read.
+ *
+ * It only uses ngram.h, and is meant as a starting point for real
+ * consumers.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "conf.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ngram.h"
+
+/* What the segments have said about a file so far */
+struct file {
+  const char *name;
+  struct file *next;		/* in the same hash bucket */
+  struct file *next_listed;	/* in order of first appearance */
+  int all;			/* NGRAM_ALL in some segment */
+  uint8_t found[1];		/* bit i: the string's trigram i is in
+				 * the file; really as long as needed */
+};
+
+static struct file **table;
+static size_t table_size;	/* a power of two */
+static size_t num_files;
+static struct file *first_file, *last_file;
+static size_t found_len;	/* bytes of found[] */
+
+
+static void usage(char *progname)
+{
+  fprintf(stderr, "usage: %s [-l] [-d dir] index string\n\n", progname);
+  fprintf(stderr, "        -d: the flow files are in dir (tcpflow's --output-dir)\n");
+  fprintf(stderr, "        -l: list the files that might have the string, without\n");
+  fprintf(stderr, "            reading them\n");
+  exit(1);
+}
+
+
+static void *map_file(char *path, size_t *length)
+{
+  struct stat st;
+  void *map;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return NULL;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    close(fd);
+    *length = 0;
+    return NULL;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+  *length = st.st_size;
+  return map;
+}
+
+
+/* Does the file have the string in it? */
+static int file_has(char *dir, char *name, const char *str, size_t len)
+{
+  char path[4096];
+  const char *map, *p;
+  size_t length;
+  int found = 0;
+
+  snprintf(path, sizeof(path), "%s%s%s", dir ? dir : "", dir ? "/" : "",
+	   name);
+  if ((map = map_file(path, &length)) == NULL)
+    return 0;
+
+  /* look for the first byte, then check the rest */
+  for (p = map; length - (p - map) >= len; p++) {
+    if ((p = memchr(p, str[0], length - (p - map) - len + 1)) == NULL)
+      break;
+    if (!memcmp(p, str, len)) {
+      found = 1;
+      break;
+    }
+  }
+
+  munmap((void *) map, length);
+  return found;
+}
+
+
+static void *check_malloc(size_t size)
+{
+  void *p = malloc(size);
+
+  if (p == NULL) {
+    fprintf(stderr, "tcpflow-search: out of memory\n");
+    exit(1);
+  }
+  return p;
+}
+
+
+static size_t hash_name(const char *name)
+{
+  size_t h = 2166136261U;
+
+  while (*name)
+    h = (h ^ (uint8_t) *name++) * 16777619U;
+  return h;
+}
+
+
+/* Make the table twice as big */
+static void grow_table()
+{
+  size_t size = table_size ? table_size * 2 : 1024, i, index;
+  struct file **bigger = check_malloc(size * sizeof(*bigger));
+  struct file *file, *next;
+
+  memset(bigger, 0, size * sizeof(*bigger));
+  for (i = 0; i < table_size; i++)
+    for (file = table[i]; file != NULL; file = next) {
+      next = file->next;
+      index = hash_name(file->name) & (size - 1);
+      file->next = bigger[index];
+      bigger[index] = file;
+    }
+
+  free(table);
+  table = bigger;
+  table_size = size;
+}
+
+
+/* The file of this name, the first time we've seen it if need be */
+static struct file *find_file(const char *name)
+{
+  struct file *file;
+  size_t index;
+
+  if (num_files >= table_size)
+    grow_table();
+
+  index = hash_name(name) & (table_size - 1);
+  for (file = table[index]; file != NULL; file = file->next)
+    if (!strcmp(file->name, name))
+      return file;
+
+  file = check_malloc(sizeof(*file) + found_len);
+  memset(file, 0, sizeof(*file) + found_len);
+  file->name = name;
+  file->next = table[index];
+  table[index] = file;
+  if (last_file != NULL)
+    last_file->next_listed = file;
+  else
+    first_file = file;
+  last_file = file;
+  num_files++;
+  return file;
+}
+
+
+/* Has the file got all of the string's trigrams? */
+static int found_all(const struct file *file, size_t grams)
+{
+  size_t i;
+
+  for (i = 0; i < grams / 8; i++)
+    if (file->found[i] != 0xff)
+      return 0;
+  return grams % 8 == 0 ||
+    file->found[i] == (uint8_t) ((1 << (grams % 8)) - 1);
+}
+
+
+/* The entry for a trigram, or NULL if no flow in the segment has it */
+static const struct ngram_entry *find_gram(const struct ngram_entry *entries,
+					   uint32_t count, uint32_t gram)
+{
+  uint32_t lo = 0, hi = count;
+
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+
+    if (entries[mid].gram < gram)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < count && entries[lo].gram == gram ? &entries[lo] : NULL;
+}
+
+
+int main(int argc, char *argv[])
+{
+  const struct ngram_header *hdr;
+  const struct ngram_segment *seg;
+  const struct ngram_entry *entries, *e;
+  const uint16_t *postings;
+  const uint8_t *flags;
+  const char *map, *p, *name;
+  char *dir = NULL, *str;
+  struct file **files, *file;
+  size_t map_len, len, grams, round;
+  uint32_t f, gram;
+  uint64_t k;
+  unsigned long long segments = 0, candidates = 0, matches = 0;
+  int arg, list_only = 0;
+
+  while ((arg = getopt(argc, argv, "d:l")) != EOF) {
+    switch (arg) {
+    case 'd':
+      dir = optarg;
+      break;
+    case 'l':
+      list_only = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (optind != argc - 2 || argv[optind + 1][0] == '\0')
+    usage(argv[0]);
+  str = argv[optind + 1];
+  len = strlen(str);
+  grams = len > 2 ? len - 2 : 0;
+
+  if ((map = map_file(argv[optind], &map_len)) == NULL ||
+      map_len < sizeof(*hdr)) {
+    fprintf(stderr, "%s: can't read %s: %s\n", argv[0], argv[optind],
+	    map ? "too short" : strerror(errno));
+    exit(1);
+  }
+  hdr = (const struct ngram_header *) map;
+  if (hdr->magic != NGRAM_MAGIC || hdr->version != NGRAM_VERSION) {
+    fprintf(stderr, "%s: %s isn't a tcpflow search index\n", argv[0],
+	    argv[optind]);
+    exit(1);
+  }
+
+  found_len = grams > sizeof(file->found) * 8 ?
+    (grams + 7) / 8 - sizeof(file->found) : 0;
+  files = check_malloc(NGRAM_SEGMENT_FLOWS * sizeof(*files));
+
+  for (p = map + sizeof(*hdr); p < map + map_len; p += seg->length) {
+    seg = (const struct ngram_segment *) p;
+    if (map + map_len - p < (long) sizeof(*seg) ||
+	seg->magic != NGRAM_SEGMENT_MAGIC || seg->flows > NGRAM_SEGMENT_FLOWS ||
+	seg->length > (uint64_t) (map + map_len - p)) {
+      fprintf(stderr, "%s: %s is damaged or cut short\n", argv[0],
+	      argv[optind]);
+      break;
+    }
+    segments++;
+
+    flags = (const uint8_t *) (seg + 1);
+    name = (const char *) flags + NGRAM_PAD(seg->flows);
+    entries = (const struct ngram_entry *) (name + NGRAM_PAD(seg->names_len));
+    postings = (const uint16_t *) ((const char *) entries +
+      NGRAM_PAD((seg->grams + 1) * sizeof(*entries)));
+
+    for (f = 0; f < seg->flows; f++) {
+      files[f] = find_file(name);
+      if (flags[f] & NGRAM_ALL)
+	files[f]->all = 1;
+      name += strlen(name) + 1;
+    }
+
+    /* the rest of a file's trigrams may be in other segments */
+    for (round = 0; round < grams; round++) {
+      gram = NGRAM((uint8_t) str[round], (uint8_t) str[round + 1],
+		   (uint8_t) str[round + 2]);
+      if ((e = find_gram(entries, seg->grams, gram)) == NULL)
+	continue;
+      for (k = e[0].first; k < e[1].first; k++)
+	files[postings[k]]->found[round / 8] |= 1 << (round % 8);
+    }
+  }
+
+  for (file = first_file; file != NULL; file = file->next_listed) {
+    if (!file->all && !found_all(file, grams))
+      continue;
+    candidates++;
+    if (list_only || file_has(dir, (char *) file->name, str, len)) {
+      printf("%s\n", file->name);
+      matches++;
+    }
+  }
+
+  if (list_only)
+    fprintf(stderr, "%s: %llu of %llu files in %llu segments might have "
+	    "it\n", argv[0], candidates, (unsigned long long) num_files,
+	    segments);
+  else
+    fprintf(stderr, "%s: read %llu of %llu files in %llu segments; %llu have "
+	    "it\n", argv[0], candidates, (unsigned long long) num_files,
+	    segments, matches);
+
+  munmap((void *) map, map_len);
+  return matches ? 0 : 1;
+}
@@ -0,0 +1,142 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * tcpflow-shmcat: reference reader for tcpflow's --shm-ring.
+ *
+ * By default it prints one line per record.  With -w it puts the data
+ * back together into flow files named the way tcpflow names them,
+ * which should come out identical to what tcpflow would have written
+ * itself (as long as nothing was dropped).
+ *
+ * It only uses flowring.h and flowring.c, and is meant as a starting
+ * point for real consumers.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "conf.h"
+#endif
+
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "flowring.h"
+
+#define IDLE_SLEEP 1000		/* usecs to sleep when the ring is empty */
+
+static void usage(char *progname)
+{
+  fprintf(stderr, "usage: %s [-uw] ring-name\n\n", progname);
+  fprintf(stderr, "        -u: remove the ring when the producer is done with it\n");
+  fprintf(stderr, "        -w: write flow files instead of printing records\n");
+  exit(1);
+}
+
+
+static char *flow_name(const struct flowring_rec *rec)
+{
+  static char buf[48];
+
+  sprintf(buf, "%03d.%03d.%03d.%03d.%05d-%03d.%03d.%03d.%03d.%05d",
+	  (rec->src >> 24) & 0xff, (rec->src >> 16) & 0xff,
+	  (rec->src >> 8) & 0xff, rec->src & 0xff, rec->sport,
+	  (rec->dst >> 24) & 0xff, (rec->dst >> 16) & 0xff,
+	  (rec->dst >> 8) & 0xff, rec->dst & 0xff, rec->dport);
+  return buf;
+}
+
+
+/* Put a record's payload where it belongs in its flow file.  Files are
+ * opened and closed around every write; this is an example, not a
+ * replacement for tcpflow's own file handling. */
+static void write_record(const struct flowring_rec *rec, const void *payload)
+{
+  char *name = flow_name(rec);
+  int fd;
+
+  if ((fd = open(name, O_WRONLY | O_CREAT, 0666)) < 0) {
+    perror(name);
+    return;
+  }
+  if (pwrite(fd, payload, rec->len, (off_t) rec->offset) != (ssize_t) rec->len)
+    perror(name);
+  close(fd);
+}
+
+
+int main(int argc, char *argv[])
+{
+  const struct flowring_rec *rec;
+  const void *payload;
+  flowring_t *ring;
+  unsigned long long records = 0, bytes = 0, gaps = 0;
+  int arg, rc, unlink_ring = 0, write_files = 0;
+
+  while ((arg = getopt(argc, argv, "uw")) != EOF) {
+    switch (arg) {
+    case 'u':
+      unlink_ring = 1;
+      break;
+    case 'w':
+      write_files = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (optind != argc - 1)
+    usage(argv[0]);
+
+  /* wait for tcpflow to set the ring up */
+  while ((ring = flowring_open(argv[optind])) == NULL) {
+    if (errno != ENOENT && errno != EAGAIN) {
+      fprintf(stderr, "%s: %s: %s\n", argv[0], argv[optind], strerror(errno));
+      exit(1);
+    }
+    usleep(IDLE_SLEEP * 100);
+  }
+
+  while ((rc = flowring_next(ring, &rec, &payload)) >= 0) {
+    if (rc == 0) {
+      usleep(IDLE_SLEEP);
+      continue;
+    }
+
+    records++;
+    bytes += rec->len;
+    if (rec->flags & FLOWRING_GAP)
+      gaps++;
+
+    if (write_files) {
+      write_record(rec, payload);
+    } else {
+      printf("%lu.%06u %s @%llu %u%s%s\n", (unsigned long) rec->ts_sec,
+	     rec->ts_usec, flow_name(rec), (unsigned long long) rec->offset,
+	     rec->len, rec->flags & FLOWRING_GAP ? " gap" : "",
+	     rec->flags & FLOWRING_LAST ? " last" : "");
+    }
+
+    flowring_done(ring);
+  }
+
+  fprintf(stderr, "%s: read %llu records (%llu bytes), %llu after gaps; "
+	  "producer dropped %llu records (%llu bytes)\n", argv[0],
+	  records, bytes, gaps,
+	  (unsigned long long) ring->ctl->info.dropped_records,
+	  (unsigned long long) ring->ctl->info.dropped_bytes);
+
+  flowring_close(ring);
+  if (unlink_ring)
+    flowring_unlink(argv[optind]);
+
+  return 0;
+}
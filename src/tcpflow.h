@@ -41,6 +41,8 @@
 #endif
 
 #include "sysdep.h"
+#include "libtcpflow.h"
+#include "probes.h"
 
 
 #ifndef __SYSDEP_H__
@@ -52,8 +54,9 @@
 #define DEFAULT_DEBUG_LEVEL 1
 #define MAX_FD_GUESS        64
 #define NUM_RESERVED_FDS    5     /* number of FDs to set aside */
-#define HASH_SIZE           1009  /* prime number near 1000 */
 #define SNAPLEN             65536 /* largest possible MTU we'll see */
+#define REFILTER_INTERVAL   10    /* seconds between --refilter passes */
+#define MAX_SOURCES         16    /* interfaces or files to capture from */
 
 
 /**************************** Structures **********************************/
@@ -66,21 +69,80 @@ typedef struct {
 } flow_t;
 
 
+/* What --stats-only counts for each direction of a connection */
+struct flow_stats {
+  long long segments;		/* packets, with or without data */
+  u_int32_t retransmissions;
+  u_int32_t out_of_order;
+  u_int32_t zero_windows;	/* times the window was closed */
+  int window_closed;		/* and whether it is now */
+  struct timeval furthest;	/* when the furthest data so far came */
+  struct timeval syn;		/* when the SYN (or SYN/ACK) came */
+  u_int32_t syn_rtt;		/* the connection's, in usecs: SYN to */
+  u_int32_t ack_rtt;		/* SYN/ACK, and from there to the ACK */
+};
+
+
 typedef struct flow_state_struct {
-  struct flow_state_struct *next; /* Link to next one */
+  const struct tcpflow_flow *tcp; /* libtcpflow's side of the flow */
   flow_t flow;			/* Description of this flow */
-  tcp_seq isn;			/* Initial sequence number we've seen */
   FILE *fp;			/* Pointer to file storing this flow's data */
   long pos;			/* Current write position in fp */
+  long size;			/* Bytes this flow's file holds on disk */
+  long allocated;		/* Bytes preallocated for the file */
+  struct direct_buffer *direct;	/* Staging area for O_DIRECT writes */
   int flags;			/* Don't save any more data from this flow */
   int last_access;		/* "Time" of last access */
+  char *filename;		/* Path of the flow's file, once rendered */
+  long shard;			/* Output subdirectory, or -1 for none */
+  struct flow_state_struct *next_done; /* Next finished flow, oldest first */
+  long long late_bytes;		/* Bytes seen after the flow finished */
+  struct flow_state_struct *combined; /* --combined: the connection's file */
+  struct ngram_flow *ngrams;	/* What --ngram-index has found so far */
+  struct flow_stats *stats;	/* --stats-only: what we've counted */
 } flow_state_struct;
 
 #define FLOW_FINISHED		(1 << 0)
 #define FLOW_FILE_EXISTS	(1 << 1)
+#define FLOW_FILE_DELETED	(1 << 2)
+#define FLOW_RESTORED		(1 << 3)  /* loaded from a checkpoint */
+#define FLOW_RING_GAP		(1 << 4)  /* lost data to a full --shm-ring */
+#define FLOW_REPLY		(1 << 5)  /* the other direction came first */
+#define FLOW_LISTED		(1 << 6)  /* in the --manifest already */
+#define FLOW_SAW_FIN		(1 << 8)
+#define FLOW_SAW_RST		(1 << 9)
+#define FLOW_BYTE_LIMIT		(1 << 10) /* finished by -b */
+#define FLOW_CONTINUED		(1 << 11) /* FLOW_RESTORED, for good */
+#define FLOW_SHED		(1 << 12) /* turned away by --shed */
+
+/* What to do when the disk budget or the write rate ceiling is hit */
+#define LIMIT_STOP		0  /* refuse new flows, drop what doesn't fit */
+#define LIMIT_TRUNCATE		1  /* finish the flow, as if -b was reached */
+#define LIMIT_DELETE		2  /* delete the oldest finished flows */
+
+/* How flow files are spread over subdirectories of the output root */
+#define SHARD_NONE		0
+#define SHARD_HASH		1  /* by a hash of addresses and ports */
+#define SHARD_TIME		2  /* by the time the flow started */
+
+/* --fanout flags */
+#define FANOUT_ROLLOVER		(1 << 0)  /* go to another socket when full */
+#define FANOUT_DEFRAG		(1 << 1)  /* reassemble IP fragments first */
 
 typedef struct flow_state_struct flow_state_t;
 
+/* A TCP segment we've decoded but not handled yet */
+typedef struct {
+  flow_t flow;
+  tcp_seq seq;
+  u_int16_t ip_id;		/* IP identification, for --dedup */
+  u_int8_t tcp_flags;		/* TCPFLOW_FIN etc. */
+  u_int16_t window;		/* advertised, for --stats-only */
+  const u_char *data;		/* payload */
+  u_int32_t length;
+  struct timeval tv;
+} packet_t;
+
   
 /***************************** Macros *************************************/
 
@@ -92,22 +154,21 @@ extern int debug_level;
 
 #define DEBUG(message_level) if (debug_level >= message_level) debug_real
 
-#define HASH_FLOW(flow) ( \
-( (flow.sport & 0xff) | ((flow.dport & 0xff) << 8) | \
-  ((flow.src & 0xff) << 16) | ((flow.dst & 0xff) << 24) \
-) % HASH_SIZE)
-
 #define IS_SET(vector, flag) ((vector) & (flag))
 #define SET_BIT(vector, flag) ((vector) |= (flag))
 
 
 /************************* Function prototypes ****************************/
 
+/* main.c */
+void print_stats();
+
 /* util.c */
 char *copy_argv(char *argv[]);
 void init_debug(char *argv[]);
 void *check_malloc(size_t size);
 char *flow_filename(flow_t flow);
+long long parse_size(const char *str);
 int get_max_fds(void);
 void format_timestamp(char* tm_buffer, int tm_buffer_length, struct timeval* tv, int f_datetime);
 RETSIGTYPE (*portable_signal(int signo, RETSIGTYPE (*func)(int)))(int);
@@ -127,20 +188,173 @@ pcap_handler find_handler(int datalink_type, char *device);
 
 /* tcpip.c */
 void process_ip(const u_char *data, u_int32_t length, struct timeval* tv);
-void process_tcp(const u_char *data, u_int32_t length, u_int32_t src, u_int32_t dst, struct timeval* tv);
+int decode_ip(const u_char *data, u_int32_t caplen, struct timeval *tv, packet_t *packet);
+void handle_packet(packet_t *packet);
+void handle_batch(packet_t *packets, int count);
+void start_flow(void *user, const struct tcpflow_flow *flow, void **flow_user);
+u_int32_t store_segment(void *user, const struct tcpflow_flow *flow,
+			void *flow_user, const u_char *data, u_int32_t length,
+			u_int64_t offset, const struct timeval *tv);
+void finish_flow(void *user, const struct tcpflow_flow *flow,
+		 void *flow_user, int reason);
+u_int32_t write_packet(flow_state_t *state, const u_char *data,
+		       u_int32_t length, tcp_seq offset, struct timeval *tv);
+void store_packet(flow_state_t *state, packet_t *packet, const u_char *data,
+		  u_int32_t length);
+
+/* console.c */
+const u_char *format_payload(packet_t *packet, u_int32_t *length);
+int console_packet(packet_t *packet);
 void print_packet(flow_t flow, const u_char *data, u_int32_t length, const char* tm_buffer);
-void store_packet(flow_t flow, const u_char *data, u_int32_t length, u_int32_t seq);
 u_char *do_formatting(const u_char *data, u_int32_t length, u_int32_t *b_length, const char* tm_buffer);
 u_char *print_time(const u_char *data, u_int32_t length, u_int32_t *b_length, const char* tm_buffer);
 
 /* flow.c */
 void init_flow_state();
+flow_state_t *new_flow_state(const struct tcpflow_flow *tcp);
 flow_state_t *find_flow_state(flow_t flow);
-flow_state_t *create_flow_state(flow_t flow, tcp_seq isn);
+void prefetch_flow_bucket(flow_t flow);
+void prefetch_flow_state(flow_t flow);
+void for_each_flow_state(void (*fn)(flow_state_t *, void *), void *arg);
+flow_state_t *create_flow_state(flow_t flow, tcp_seq isn, struct timeval *tv);
+flow_state_t *reverse_flow_state(flow_state_t *flow_state);
+flow_state_t *combined_flow_state(flow_state_t *flow_state);
+void feed_packet(packet_t *packet, const u_char *data, u_int32_t length);
+void print_flow_stats();
 FILE *open_file(flow_state_t *flow_state);
 int close_file(flow_state_t *flow_state);
 void sort_fds();
 void contract_fd_ring();
+void close_all_files();
+void for_each_open_file(void (*fn)(flow_state_t *));
+
+/* accounting.c */
+void start_counting(void *user, const struct tcpflow_flow *flow,
+		    void **flow_user);
+u_int32_t count_segment(void *user, const struct tcpflow_flow *flow,
+			void *flow_user, const u_char *data, u_int32_t length,
+			u_int64_t offset, const struct timeval *tv);
+void account_packet(packet_t *packet);
+void print_accounting_stats();
+
+/* batch.c */
+void init_batch();
+void batch_ip(const u_char *data, u_int32_t caplen, struct timeval *tv);
+void flush_batch();
+int capture_dispatch(pcap_t *pd, int count, pcap_handler handler);
+
+/* outdir.c */
+void init_output_dir();
+int reserve_dir_fds(int available);
+char *flow_path(flow_state_t *flow_state);
+int open_flow_file(flow_state_t *flow_state, int flags);
+int unlink_flow_file(flow_state_t *flow_state);
+
+/* writer.c */
+void init_writer();
+int admit_new_flow(flow_state_t *flow_state);
+u_int32_t write_flow_data(flow_state_t *flow_state, const u_char *data,
+			  u_int32_t length, tcp_seq offset);
+void retire_flow(flow_state_t *flow_state);
+void prepare_flow_file(flow_state_t *flow_state);
+void release_flow_file(flow_state_t *flow_state);
+void adopt_flow(flow_state_t *flow_state);
+void print_writer_stats();
+
+/* shmring.c */
+void init_shm_ring();
+int publish_packet(flow_state_t *flow_state, const u_char *data,
+		   u_int32_t length, tcp_seq offset, struct timeval *tv);
+void close_shm_ring();
+void print_ring_stats();
+
+/* server.c */
+void init_server();
+int serve_packet(flow_state_t *flow_state, const u_char *data,
+		 u_int32_t length, tcp_seq offset, struct timeval *tv);
+int serve_loop(pcap_t *pd, pcap_handler handler, int live);
+void close_server();
+void print_server_stats();
+
+/* checkpoint.c */
+void load_checkpoint();
+void checkpoint_tick(struct timeval *tv);
+void save_checkpoint();
+
+/* capture.c */
+void add_capture_source(pcap_t *pd, char *name, pcap_handler handler, int filterable);
+void join_fanout(pcap_t *pd, char *name, int group);
+void init_capture_ring();
+void capture_loop(int live);
+void stop_capture();
+int set_capture_filter(char *expression);
+long long capture_drops();
+void print_capture_stats();
+
+/* filter.c */
+void init_refilter(char *expression);
+void count_late_packet(flow_state_t *flow_state, u_int32_t length);
+void refilter_tick(struct timeval *tv);
+void print_filter_stats();
+
+/* dedup.c */
+void init_dedup();
+int duplicate_packet(packet_t *packet);
+void print_dedup_stats();
+
+/* decompress.c */
+FILE *open_compressed(char *path);
+void print_decompress_stats();
+
+/* fastfilter.c */
+int init_fast_filter(char *expression);
+int fast_filter_wants(flow_t *flow);
+int fast_filter_match(flow_t *flow);
+void print_fast_filter_stats();
+
+/* manifest.c */
+void init_manifest();
+void list_flow(flow_state_t *flow_state);
+void close_manifest();
+void print_manifest_stats();
+
+/* ngram.c */
+void init_ngram_index();
+void index_ngrams(flow_state_t *flow_state, const u_char *data,
+		  u_int32_t length, tcp_seq offset);
+void index_flow_done(flow_state_t *flow_state);
+void close_ngram_index();
+void print_ngram_stats();
+
+/* pace.c */
+int parse_pace(char *arg);
+void init_pace(int live);
+void pace_packet(struct timeval *tv, u_int32_t caplen);
+void print_pace_stats();
+
+/* pcapindex.c */
+void build_index(char *path);
+int have_index(char *path);
+void select_from_index(pcap_t *pd, char *path, int use_flows);
+int index_dispatch(pcap_t *pd, int count, pcap_handler handler, u_char *user);
+void index_packet(packet_t *packet);
+void print_index_stats();
+
+/* shed.c */
+int parse_shed_policy(char *list);
+int parse_priority_ports(char *list);
+void init_shed(int live);
+void shed_tick(struct timeval *tv);
+void shed_activity(time_t before, time_t now);
+void shed_new_flow(flow_state_t *flow_state, const struct timeval *tv);
+void print_shed_stats();
+
+/* stream.c */
+void init_stream();
+void stream_packet(flow_state_t *flow_state, const u_char *data,
+		   u_int32_t length, tcp_seq offset, struct timeval *tv);
+void close_stream();
+void print_stream_stats();
 
 
 #endif /* __TCPFLOW_H__ */
@@ -49,280 +49,451 @@
 
 #include "tcpflow.h"
 
-extern int console_only;
-extern int bytes_per_flow;
-extern int strip_nonprint;
-extern int print_time_per_line;
-extern int print_datetime_per_line;
-extern int strip_nr;
-
-#define TM_BUFFER_LENGTH 40
+extern volatile sig_atomic_t stats_requested;
+extern volatile sig_atomic_t terminate_requested;
+extern char *checkpoint_file;
+extern char *shm_ring_name;
+extern char *serve_path;
+extern char *stream_path;
+extern int batch_size;
+extern int refilter_flows;
+extern int combined_output;
+extern long dedup_window;
+extern int fast_filter;
+extern char *manifest_path;
+extern char *manifest_csv_path;
+extern char *ngram_index_path;
+extern time_t time_range_from;
+extern time_t time_range_to;
+extern int building_index;
+extern int stats_only;
+extern tcpflow_ctx *flow_table;
 
 /*************************************************************************/
 
 
-/* This is called when we receive an IP datagram.  We make sure that
- * it's valid and contains a TCP segment; if so, we pass it to
- * process_tcp() for further processing.
- *
- * Note: we currently don't know how to handle IP fragments. */
+/* Things that want a look at every packet as it's handled */
+static void packet_hooks(struct timeval *tv)
+{
+  /* someone sent us SIGUSR1 */
+  if (stats_requested) {
+    stats_requested = 0;
+    print_stats();
+  }
+
+  if (checkpoint_file != NULL)
+    checkpoint_tick(tv);
+
+  if (refilter_flows)
+    refilter_tick(tv);
+
+  shed_tick(tv);
+}
+
+
+/* This is called when we receive an IP datagram.  If we're batching,
+ * it goes into the current batch; otherwise it's decoded and handled
+ * right away. */
 void process_ip(const u_char *data, u_int32_t caplen, struct timeval* tv)
 {
-  const struct ip *ip_header = (struct ip *) data;
-  u_int ip_header_len;
-  u_int ip_total_len;
+  packet_t packet;
 
-  /* make sure that the packet is at least as long as the min IP header */
-  if (caplen < sizeof(struct ip)) {
-    DEBUG(6) ("received truncated IP datagram!");
+  /* we've been told to stop; the capture loop will see to it that no
+   * more packets come */
+  if (terminate_requested) {
+    stop_capture();
     return;
   }
 
-  /* for now we're only looking for TCP; throw away everything else */
-  if (ip_header->ip_p != IPPROTO_TCP) {
-    DEBUG(50) ("got non-TCP frame -- IP proto %d", ip_header->ip_p);
+  /* --build-index only wants to know where each flow's packets are */
+  if (building_index) {
+    if (decode_ip(data, caplen, tv, &packet))
+      index_packet(&packet);
     return;
   }
 
-  /* check and see if we got everything.  NOTE: we must use
-   * ip_total_len after this, because we may have captured bytes
-   * beyond the end of the packet (e.g. ethernet padding). */
-  ip_total_len = ntohs(ip_header->ip_len);
-  if (caplen < ip_total_len) {
-    DEBUG(6) ("warning: captured only %ld bytes of %ld-byte IP datagram",
-	 (long) caplen, (long) ip_total_len);
-  }
-
-  /* XXX - throw away everything but fragment 0; this version doesn't
-   * know how to do fragment reassembly. */
-  if (ntohs(ip_header->ip_off) & 0x1fff) {
-    DEBUG(2) ("warning: throwing away IP fragment from X to X");
+  /* --time-range */
+  if ((time_range_from && tv->tv_sec < time_range_from) ||
+      (time_range_to && tv->tv_sec >= time_range_to))
     return;
-  }
 
-  /* figure out where the IP header ends */
-  ip_header_len = ip_header->ip_hl * 4;
+  /* --pace: not before it would have arrived */
+  pace_packet(tv, caplen);
 
-  /* make sure there's some data */
-  if (ip_header_len > ip_total_len) {
-    DEBUG(6) ("received truncated IP datagram!");
+  if (batch_size > 1) {
+    batch_ip(data, caplen, tv);
     return;
   }
 
-  /* do TCP processing */
-  process_tcp(data + ip_header_len, ip_total_len - ip_header_len,
-	      ntohl(ip_header->ip_src.s_addr),
-	      ntohl(ip_header->ip_dst.s_addr), tv);
+  packet_hooks(tv);
+  if (decode_ip(data, caplen, tv, &packet) &&
+      !(dedup_window && duplicate_packet(&packet)))
+    handle_packet(&packet);
 }
 
 
-void process_tcp(const u_char *data, u_int32_t length, u_int32_t src,
-		 u_int32_t dst, struct timeval* tv)
+/* Make sure an IP datagram is valid and contains a TCP segment with
+ * some data in it; if so, fill in 'packet' and return 1.  The headers
+ * are taken apart by libtcpflow; we just say what we think of them.
+ *
+ * Note: we currently don't know how to handle IP fragments. */
+int decode_ip(const u_char *data, u_int32_t caplen, struct timeval *tv,
+	      packet_t *packet)
 {
-  struct tcphdr *tcp_header = (struct tcphdr *) data;
-  flow_t this_flow;
-  u_int tcp_header_len;
-  tcp_seq seq;
+  struct tcpflow_segment seg;
 
-  if (length < sizeof(struct tcphdr)) {
+  switch (tcpflow_decode_ip(data, caplen, &seg)) {
+  case TCPFLOW_OK:
+    break;
+  case TCPFLOW_SHORT_IP:
+  case TCPFLOW_BAD_IP_HEADER:
+    DEBUG(6) ("received truncated IP datagram!");
+    return 0;
+  case TCPFLOW_NOT_IPV4:
+    /* without a packet filter, anything might turn up */
+    DEBUG(50) ("got non-IPv4 packet -- IP version %d",
+	       ((struct ip *) data)->ip_v);
+    return 0;
+  case TCPFLOW_NOT_TCP:
+    /* for now we're only looking for TCP; throw away everything else */
+    DEBUG(50) ("got non-TCP frame -- IP proto %d",
+	       ((struct ip *) data)->ip_p);
+    return 0;
+  case TCPFLOW_FRAGMENT:
+    /* XXX - throw away everything but fragment 0; this version
+     * doesn't know how to do fragment reassembly. */
+    DEBUG(2) ("warning: throwing away IP fragment from X to X");
+    return 0;
+  case TCPFLOW_SHORT_TCP:
     DEBUG(6) ("received truncated TCP segment!");
-    return;
+    return 0;
   }
 
-  /* calculate the total length of the TCP header including options */
-  tcp_header_len = tcp_header->th_off * 4;
+  if (seg.partial) {
+    DEBUG(6) ("warning: captured only %ld bytes of %ld-byte IP datagram",
+	 (long) caplen, (long) seg.ip_len);
+  }
 
-  /* return if this packet doesn't have any data (e.g., just an ACK) */
-  if (length <= tcp_header_len) {
+  /* return if this packet doesn't have any data (e.g., just an ACK),
+   * unless it ends a flow that's going in the manifest or an index, or
+   * we're counting every packet */
+  if (seg.length == 0 && !stats_only &&
+      ((manifest_path == NULL && manifest_csv_path == NULL &&
+	ngram_index_path == NULL && !refilter_flows && !building_index) ||
+       !(seg.flags & (TCPFLOW_FIN | TCPFLOW_RST)))) {
     DEBUG(50) ("got TCP segment with no data");
-    return;
+    return 0;
   }
 
   /* fill in the flow_t structure with info that identifies this flow */
-  this_flow.src = src;
-  this_flow.dst = dst;
-  this_flow.sport = ntohs(tcp_header->th_sport);
-  this_flow.dport = ntohs(tcp_header->th_dport);
-  seq = ntohl(tcp_header->th_seq);
-
-  /* recalculate the beginning of data and its length, moving past the
-   * TCP header */
-  data += tcp_header_len;
-  length -= tcp_header_len;
-
-  static char tm_buffer[TM_BUFFER_LENGTH];
-  if (print_time_per_line) {
-    format_timestamp(tm_buffer, TM_BUFFER_LENGTH, tv, 0);
-  }
-  else if (print_datetime_per_line) {
-    format_timestamp(tm_buffer, TM_BUFFER_LENGTH, tv, 1);
+  packet->flow.src = seg.src;
+  packet->flow.dst = seg.dst;
+  packet->flow.sport = seg.sport;
+  packet->flow.dport = seg.dport;
+  packet->seq = seg.seq;
+  packet->ip_id = seg.ip_id;
+  packet->tcp_flags = seg.flags;
+  packet->window = seg.window;
+  packet->data = seg.data;
+  packet->length = seg.length;
+  packet->tv = *tv;
+
+  /* with --fast-filter, libpcap left the filtering to us */
+  return !fast_filter || fast_filter_match(&packet->flow);
+}
+
+
+/* A connection is over: list both directions in the manifest and
+ * index what's in their files, as for a finished flow.  Unlike a
+ * finished flow, they still take data, since a FIN can overtake the
+ * segments before it, so we hold on to what's been written to keep
+ * telling retransmissions apart. */
+static void end_connection(flow_state_t *state)
+{
+  flow_state_t *other = reverse_flow_state(state);
+
+  PROBE_FLOW_FINISH(state->flow, state->tcp->packets, state->tcp->bytes,
+		    state->flags);
+  list_flow(state);
+  index_flow_done(state);
+
+  if (other != NULL && !IS_SET(other->flags, FLOW_LISTED)) {
+    PROBE_FLOW_FINISH(other->flow, other->tcp->packets, other->tcp->bytes,
+		      other->flags);
+    list_flow(other);
+    index_flow_done(other);
   }
+}
+
 
-  /* store the length of the data */
-  u_int32_t buffer_length = length;
-  data = do_formatting(data, length, &buffer_length, tm_buffer);
+/* For --manifest, --ngram-index and --refilter: the packet's flow is
+ * coming to an end.  The connection is over once both directions have
+ * sent a FIN (or we've only seen this one), or either has sent a RST,
+ * as with --stats-only.  A FIN or RST with no data only gets this far
+ * with one of those. */
+static void note_flow_end(flow_state_t *state, packet_t *packet)
+{
+  flow_state_t *other;
+
+  if (state == NULL || !(packet->tcp_flags & (TCPFLOW_FIN | TCPFLOW_RST)))
+    return;
+  if (packet->tcp_flags & TCPFLOW_RST)
+    SET_BIT(state->flags, FLOW_SAW_RST);
+  else
+    SET_BIT(state->flags, FLOW_SAW_FIN);
+  if (IS_SET(state->flags, FLOW_LISTED))
+    return;
 
-  /* store or print the output */
-  if (console_only) {
-    print_packet(this_flow, data, buffer_length, tm_buffer);
+  if (packet->tcp_flags & TCPFLOW_RST) {
+    end_connection(state);
   } else {
-    store_packet(this_flow, data, buffer_length, seq);
+    other = reverse_flow_state(state);
+    if (other == NULL || IS_SET(other->flags, FLOW_SAW_FIN | FLOW_LISTED))
+      end_connection(state);
   }
 }
 
 
-/* convert all non-printable characters to '.' (period).  not
- * thread-safe, obviously, but neither is most of the rest of this. */
-u_char *do_formatting(const u_char *data, u_int32_t length, u_int32_t* b_length, const char* tm_buffer)
+/* Print or store a decoded packet */
+void handle_packet(packet_t *packet)
 {
-  u_int32_t tmp_length = 0;
-  u_int32_t size_of_tm_buffer = strlen(tm_buffer);
+  u_int32_t buffer_length;
+  const u_char *data;
+  flow_state_t *state;
 
-  static u_char buf[SNAPLEN];
-  u_char *write_ptr;
+  PROBE_PACKET(packet->flow, packet->seq, packet->length, packet->tcp_flags);
 
-  write_ptr = buf;
-  while (length) {
-    if ((strip_nonprint && !(isprint(*data) || *data == '\n' || *data == '\r'))
-      || (strip_nr && (*data == '\n' || *data == '\r'))) {
-      *write_ptr = '.';
-    }
-    else {
-      *write_ptr = *data;
-    }
-    write_ptr++;
-    tmp_length++;
-    if (!strip_nr && ((print_time_per_line || print_datetime_per_line) && (*data == '\n'))) {
-      memcpy(write_ptr, tm_buffer,size_of_tm_buffer);
-      write_ptr += size_of_tm_buffer;
-      tmp_length += size_of_tm_buffer;
-    }
-    data++;
-    length--;
+  /* --stats-only: the payload doesn't matter */
+  if (stats_only) {
+    account_packet(packet);
+    return;
   }
 
-  *b_length = tmp_length;
+  /* -c: it's printed, and that's all */
+  if (console_packet(packet))
+    return;
+
+  /* if we're done with this flow, there's no point in doing anything
+   * with the payload; find out before we start */
+  state = find_flow_state(packet->flow);
+  if (packet->length == 0) {
+    note_flow_end(state, packet);
+    return;
+  }
+  if (state != NULL && IS_SET(state->flags, FLOW_FINISHED)) {
+    PROBE_DROP(packet->flow, packet->seq, packet->length,
+	       PROBE_DROP_FINISHED);
+    count_late_packet(state, packet->length);
+    note_flow_end(state, packet);
+    return;
+  }
 
-  return buf;
+  data = format_payload(packet, &buffer_length);
+  store_packet(state, packet, data, buffer_length);
+  if (packet->tcp_flags & (TCPFLOW_FIN | TCPFLOW_RST))
+    note_flow_end(state ? state : find_flow_state(packet->flow), packet);
 }
 
-/* added timestamp. */
-u_char *print_time(const u_char *data, u_int32_t length, u_int32_t* b_length, const char* tm_buffer)
+
+/* Handle a batch of decoded packets, in order.  Before touching any
+ * flow state, we get the hash buckets and then the first flow in each
+ * one on their way into the cache, so that the lookups that follow
+ * don't each stall on a cache miss in turn. */
+void handle_batch(packet_t *packets, int count)
 {
-  static u_char buf[SNAPLEN];
-  u_char *write_ptr;
-  u_int32_t tmp_length = 0;
-  u_int32_t size_of_tm_buffer = strlen(tm_buffer);
-  write_ptr = buf;
-  while (length) {
-    *write_ptr = *data;
-    write_ptr++;
-    tmp_length++;
-    if (*data == '\n') {
-      memcpy(write_ptr, tm_buffer,size_of_tm_buffer);
-      write_ptr += size_of_tm_buffer;
-      tmp_length += size_of_tm_buffer;
-    }
-    data++;
-    length--;
-  }
+  int i;
 
-  *b_length = tmp_length;
+  for (i = 0; i < count; i++)
+    prefetch_flow_bucket(packets[i].flow);
+  for (i = 0; i < count; i++)
+    prefetch_flow_state(packets[i].flow);
 
-  return buf;
+  for (i = 0; i < count; i++) {
+    packet_hooks(&packets[i].tv);
+    handle_packet(&packets[i]);
+  }
 }
 
-/* print the contents of this packet to the console */
-void print_packet(flow_t flow, const u_char *data, u_int32_t length, const char* tm_buffer)
+
+/* libtcpflow's open callback: a flow we haven't seen before.  If
+ * we've already seen the other direction, this one is the reply.
+ * --shed may turn it away, in which case it's finished from the
+ * start, and none of its packets get past handle_packet(). */
+void start_flow(void *user, const struct tcpflow_flow *flow,
+		void **flow_user)
 {
-  if (print_time_per_line || print_datetime_per_line) {
-    printf("%s", tm_buffer);
-  }
-  printf("%s: ", flow_filename(flow));
-  fwrite(data, length, 1, stdout);
-  putchar('\n');
-  fflush(stdout);
+  flow_state_t *state = new_flow_state(flow);
+
+  *flow_user = state;
+  if (flow->reply)
+    SET_BIT(state->flags, FLOW_REPLY);
+  shed_new_flow(state, &flow->start);
+  shed_activity(0, flow->start.tv_sec);
 }
 
 
-/* store the contents of this packet to its place in its file */
-void store_packet(flow_t flow, const u_char *data, u_int32_t length,
-		  u_int32_t seq)
+/* With --combined, append this packet to its connection's file as a
+ * record: a line naming the direction, the packet's time, its offset
+ * in that direction and its length, then the data itself.  Returns
+ * how much of the data went in. */
+static u_int32_t write_combined(flow_state_t *state, const u_char *data,
+				u_int32_t length, tcp_seq offset,
+				struct timeval *tv)
 {
-  flow_state_t *state;
-  tcp_seq offset;
-  long fpos;
+  static u_char record[SNAPLEN + 128];
+  flow_state_t *file = combined_flow_state(state);
+  flow_state_t *other;
+  int header;
 
-  /* see if we have state about this flow; if not, create it */
-  if ((state = find_flow_state(flow)) == NULL) {
-    state = create_flow_state(flow, seq);
+  if (IS_SET(file->flags, FLOW_FINISHED)) {
+    SET_BIT(state->flags, FLOW_FINISHED);
+    return 0;
   }
 
-  /* if we're done collecting for this flow, return now */
-  if (IS_SET(state->flags, FLOW_FINISHED))
-    return;
+  if (file->fp == NULL) {
+    if (!IS_SET(file->flags, FLOW_FILE_EXISTS) && !admit_new_flow(file))
+      return 0;
+    if (open_file(file) == NULL)
+      return 0;
+  }
 
-  /* calculate the offset into this flow -- should handle seq num
-   * wrapping correctly because tcp_seq is the right size */
-  offset = seq - state->isn;
+  if (length > SNAPLEN)
+    length = SNAPLEN;
+  header = sprintf((char *) record, "%s %lu.%06u %u %u\n",
+		   flow_filename(state->flow), (unsigned long) tv->tv_sec,
+		   (unsigned) tv->tv_usec, (unsigned) offset, length);
+  memcpy(record + header, data, length);
+
+  /* a record the writer cuts short ends the file */
+  if (write_flow_data(file, record, header + length, file->size) <
+      header + length) {
+    SET_BIT(file->flags, FLOW_FINISHED);
+    length = 0;
+  } else {
+    PROBE_WRITE(state->flow, offset, length);
+  }
 
-  /* I want to guard against receiving a packet with a sequence number
-   * slightly less than what we consider the ISN to be; the max
-   * (though admittedly non-scaled) window of 64K should be enough */
-  if (offset >= 0xffff0000) {
-    DEBUG(2) ("dropped packet with seq < isn on %s", flow_filename(flow));
-    return;
+  /* the file is done once both directions are */
+  other = reverse_flow_state(state);
+  if (IS_SET(state->flags, FLOW_FINISHED) && other != NULL &&
+      IS_SET(other->flags, FLOW_FINISHED))
+    SET_BIT(file->flags, FLOW_FINISHED);
+
+  if (IS_SET(file->flags, FLOW_FINISHED)) {
+    SET_BIT(state->flags, FLOW_FINISHED);
+    if (other != NULL)
+      SET_BIT(other->flags, FLOW_FINISHED);
+    DEBUG(5) ("%s: stopping capture", flow_path(file));
+    close_file(file);
+    retire_flow(file);
   }
 
-  /* reject this packet if it falls entirely outside of the range of
-   * bytes we want to receive for the flow */
-  if (bytes_per_flow && (offset > bytes_per_flow))
-    return;
+  return length;
+}
+
+
+/* write the contents of this packet to its place in its file, and
+ * return how much of it got there */
+u_int32_t write_packet(flow_state_t *state, const u_char *data,
+		       u_int32_t length, tcp_seq offset, struct timeval *tv)
+{
+  if (combined_output)
+    return write_combined(state, data, length, offset, tv);
 
   /* if we don't have a file open for this flow, try to open it.
    * return if the open fails.  Note that we don't have to explicitly
    * save the return value because open_file() puts the file pointer
-   * into the structure for us. */
+   * into the structure for us.  Brand new flows have to get past the
+   * disk budget first. */
   if (state->fp == NULL) {
+    if (!IS_SET(state->flags, FLOW_FILE_EXISTS) && !admit_new_flow(state))
+      return 0;
     if (open_file(state) == NULL) {
-      return;
+      return 0;
     }
   }
 
   /* We are go for launch!  Everything's ready for us to do a write. */
 
-  /* reduce length if it goes beyond the number of bytes per flow */
-  if (bytes_per_flow && (offset + length > bytes_per_flow)) {
-    SET_BIT(state->flags, FLOW_FINISHED);
-    length = bytes_per_flow - offset;
-  }
+  /* the writer takes care of seeking, the disk budget and the rate
+   * ceiling; it may decide to finish the flow early, or write less
+   * than we asked, in which case a retransmission can fill in the rest */
+  length = write_flow_data(state, data, length, offset);
+  PROBE_WRITE(state->flow, offset, length);
 
-  /* if we're not at the correct point in the file, seek there */
-  if (offset != state->pos) {
-    fpos = offset;
-    FSETPOS(state->fp, &fpos);
+  if (IS_SET(state->flags, FLOW_FINISHED)) {
+    DEBUG(5) ("%s: stopping capture", flow_path(state));
+    close_file(state);
+    retire_flow(state);
   }
 
-  /* write the data into the file */
-  DEBUG(25) ("%s: writing %ld bytes @%ld", flow_filename(state->flow),
-	  (long) length, (long) offset);
-
-  if (fwrite(data, length, 1, state->fp) != 1) {
-    /* sigh... this should be a nice, plain DEBUG statement that
-     * passes strerrror() as an argument, but SunOS 4.1.3 doesn't seem
-     * to have strerror. */
-    if (debug_level >= 1) {
-      DEBUG(1) ("write to %s failed: ", flow_filename(state->flow));
-      perror("");
-    }
-  }
-  fflush(state->fp);
+  return length;
+}
 
-  /* remember the position for next time */
-  state->pos = offset + length;
 
-  if (IS_SET(state->flags, FLOW_FINISHED)) {
-    DEBUG(5) ("%s: stopping capture", flow_filename(state->flow));
-    close_file(state);
+/* Hand a packet's payload, as formatted, to the flow table, which
+ * passes on whatever part of it it hasn't passed on before to
+ * store_segment().  'state' is the flow's state if it has one. */
+void store_packet(flow_state_t *state, packet_t *packet, const u_char *data,
+		  u_int32_t length)
+{
+  /* a new flow is counted as active by start_flow() */
+  if (state != NULL)
+    shed_activity(state->tcp->last.tv_sec, packet->tv.tv_sec);
+
+  feed_packet(packet, data, length);
+}
+
+
+/* libtcpflow's data callback: hand a segment to wherever flow data is
+ * going: the shared memory ring, the subscribers of --serve and/or the
+ * binary stream if we have them, the flow files otherwise.  Returns
+ * how much of it got there.  The segment that takes the flow to -b
+ * finishes it, even if there's nothing left of it. */
+u_int32_t store_segment(void *user, const struct tcpflow_flow *flow,
+			void *flow_user, const u_char *data, u_int32_t length,
+			u_int64_t offset, const struct timeval *tv)
+{
+  flow_state_t *state = flow_user;
+  struct timeval when = *tv;
+  tcp_seq at = (tcp_seq) offset;	/* files have 32-bit offsets */
+  u_int32_t taken;
+
+  if (flow->max_bytes && offset + length >= flow->max_bytes)
+    SET_BIT(state->flags, FLOW_FINISHED | FLOW_BYTE_LIMIT);
+
+  if (shm_ring_name == NULL && serve_path == NULL && stream_path == NULL) {
+    index_ngrams(state, data, length, at);
+    taken = write_packet(state, data, length, at, &when);
+  } else {
+    /* only what got through counts as passed on; a retransmission
+     * can fill in what was dropped */
+    int passed = 1;
+
+    if (shm_ring_name != NULL)
+      passed &= publish_packet(state, data, length, at, &when);
+    if (serve_path != NULL)
+      passed &= serve_packet(state, data, length, at, &when);
+    if (stream_path != NULL)
+      stream_packet(state, data, length, at, &when);
+    taken = passed ? length : 0;
   }
+
+  if (IS_SET(state->flags, FLOW_FINISHED))
+    tcpflow_close_flow(flow_table, flow);
+
+  return taken;
+}
+
+
+/* libtcpflow's close callback: the flow has reached -b, or
+ * store_segment() has finished it for some other reason */
+void finish_flow(void *user, const struct tcpflow_flow *flow,
+		 void *flow_user, int reason)
+{
+  flow_state_t *state = flow_user;
+
+  PROBE_FLOW_FINISH(state->flow, flow->packets, flow->bytes, state->flags);
+  list_flow(state);
+  index_flow_done(state);
 }
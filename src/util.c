@@ -136,6 +136,34 @@ char *copy_argv(char *argv[])
 }
 
 
+/* Parse a byte count such as "512", "64k", "100M" or "2G".  Returns
+ * -1 if the string isn't a valid size. */
+long long parse_size(const char *str)
+{
+  char *end;
+  long long size;
+
+  errno = 0;
+  size = strtoll(str, &end, 10);
+  if (errno != 0 || end == str || size < 0)
+    return -1;
+
+  switch (*end) {
+  case 't': case 'T': size *= 1024;  /* fall through */
+  case 'g': case 'G': size *= 1024;  /* fall through */
+  case 'm': case 'M': size *= 1024;  /* fall through */
+  case 'k': case 'K': size *= 1024;
+    end++;
+    break;
+  }
+
+  if (*end != '\0')
+    return -1;
+
+  return size;
+}
+
+
 #define RING_SIZE 6
 
 char *flow_filename(flow_t flow)
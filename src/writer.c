@@ -0,0 +1,684 @@
+/*
+ * This file is part of tcpflow by Jeremy Elson <jelson@circlemud.org>
+ * Initial Release: 7 April 1999.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ *
+ * The writer sits underneath store_segment().  Every byte that goes to
+ * a flow file passes through here, so this is where we enforce the
+ * global disk budget (--max-disk) and the write rate ceiling
+ * (--max-rate), and where we decide what to give up when either one
+ * is hit (--limit-policy).
+ *
+ * It also knows how to preallocate flow files (--prealloc) so they
+ * don't fragment as they grow, and how to write them with O_DIRECT
+ * (--direct-io) so that write-once capture data doesn't push
+ * everything else out of the page cache.
+ */
+
+#include "tcpflow.h"
+
+extern long long max_disk_bytes;
+extern long long max_write_rate;
+extern int limit_policy;
+extern long long prealloc_extent;
+extern int direct_io;
+
+#define DIRECT_ALIGN	    4096		/* what O_DIRECT wants */
+#define DIRECT_BUF_SIZE	    (16 * DIRECT_ALIGN)	/* staged per open flow */
+#define MAX_PREALLOC_EXTENT (64 * 1024 * 1024)
+
+#define DISK_FULL_RETRY	    5	/* secs before trying a full disk again */
+
+#define ROUND_UP(x)	(((x) + DIRECT_ALIGN - 1) & ~((long) DIRECT_ALIGN - 1))
+
+/* With --direct-io, in-order data for an open flow is staged here
+ * until we have whole aligned blocks to hand to the kernel.  Anything
+ * that lands before 'base' (retransmissions, late segments filling a
+ * hole) bypasses the buffer and goes through the page cache. */
+struct direct_buffer {
+  u_char *raw;			/* what malloc gave us */
+  u_char *buf;			/* raw, aligned to DIRECT_ALIGN */
+  long base;			/* file offset of buf[0]; always aligned */
+  u_int32_t len;		/* bytes of buf in use */
+};
+
+static long long disk_usage;	  /* bytes held by all flow files */
+static long long bytes_written;	  /* payload bytes handed to the OS */
+static long long bytes_dropped;	  /* payload bytes we had to discard */
+static long long bytes_reclaimed; /* bytes freed by deleting flows */
+static int flows_refused;
+static int flows_truncated;
+static int files_deleted;
+static int write_errors;
+static int disk_full;		  /* the OS told us ENOSPC */
+static time_t disk_full_at;	  /* when it last did, until a write works */
+static long long bytes_preallocated;
+static int reservations;	  /* an open file may have space reserved */
+static long long bytes_direct;	  /* written with O_DIRECT */
+
+/* Token bucket for the rate ceiling.  The bucket holds at most one
+ * second's worth of writes. */
+static double tokens;
+static struct timeval last_refill;
+
+/* Finished flows whose files are still on disk, oldest first.  These
+ * are the candidates for deletion under LIMIT_DELETE. */
+static flow_state_t *done_head;
+static flow_state_t *done_tail;
+
+
+void init_writer()
+{
+  disk_usage = bytes_written = bytes_dropped = bytes_reclaimed = 0;
+  flows_refused = flows_truncated = files_deleted = write_errors = 0;
+  disk_full = 0;
+  disk_full_at = 0;
+  bytes_preallocated = bytes_direct = 0;
+  reservations = 0;
+  done_head = done_tail = NULL;
+
+  tokens = (double) max_write_rate;
+  gettimeofday(&last_refill, NULL);
+}
+
+
+/* Add tokens for the time that has passed since the last refill */
+static void refill_tokens()
+{
+  struct timeval now;
+  double elapsed;
+
+  gettimeofday(&now, NULL);
+  elapsed = (now.tv_sec - last_refill.tv_sec) +
+    (now.tv_usec - last_refill.tv_usec) / 1000000.0;
+  last_refill = now;
+
+  if (elapsed <= 0)
+    return;
+
+  tokens += elapsed * max_write_rate;
+  if (tokens > max_write_rate)
+    tokens = (double) max_write_rate;
+}
+
+
+/* Delete the oldest finished flow's file.  Returns 1 if something was
+ * deleted, 0 if there is nothing left to delete. */
+static int delete_oldest_flow()
+{
+  flow_state_t *victim;
+  char *filename;
+
+  while ((victim = done_head) != NULL) {
+    done_head = victim->next_done;
+    if (done_head == NULL)
+      done_tail = NULL;
+    victim->next_done = NULL;
+
+    /* the file might have been reopened, or might never have made it
+     * to disk; either way there's nothing to reclaim */
+    if (victim->fp != NULL || victim->size == 0)
+      continue;
+
+    filename = flow_path(victim);
+    if (unlink_flow_file(victim) < 0) {
+      DEBUG(1) ("couldn't delete %s to make room: %s", filename,
+		strerror(errno));
+      continue;
+    }
+
+    DEBUG(5) ("%s: deleted to stay within disk budget (%ld bytes)",
+	      filename, victim->size);
+    SET_BIT(victim->flags, FLOW_FILE_DELETED);
+    disk_usage -= victim->size;
+    bytes_reclaimed += victim->size;
+    victim->size = 0;
+    files_deleted++;
+    disk_full = 0;
+    return 1;
+  }
+
+  return 0;
+}
+
+
+/* What a flow's file counts for against the disk budget: its size, or
+ * what we've reserved for it if that's more */
+static long charged_size(flow_state_t *flow_state)
+{
+  return flow_state->allocated > flow_state->size ?
+    flow_state->allocated : flow_state->size;
+}
+
+
+static int flush_direct(flow_state_t *flow_state, int all);
+
+/* Give back the space reserved for a flow's file that it hasn't used.
+ * Data staged for direct I/O is written out first: until it is, the
+ * file doesn't reach 'size', and truncating it up to there wouldn't
+ * free anything. */
+static void trim_reservation(flow_state_t *flow_state)
+{
+  if (flow_state->allocated <= flow_state->size)
+    return;
+  if (flow_state->direct != NULL && flow_state->direct->len > 0 &&
+      flush_direct(flow_state, 1) < 0)
+    return;
+  if (ftruncate(fileno(flow_state->fp), flow_state->size) < 0)
+    DEBUG(1) ("couldn't trim %s: %s", flow_path(flow_state),
+	      strerror(errno));
+  disk_usage -= flow_state->allocated - flow_state->size;
+  flow_state->allocated = flow_state->size;
+}
+
+
+/* Returns the number of bytes of a write of 'growth' new bytes that
+ * the disk budget can take, deleting old flows first if the policy
+ * allows it. */
+static long long budget_allows(long long growth)
+{
+  /* something else may have made room on a full disk since; give it
+   * another try now and then */
+  if (disk_full && time(NULL) - disk_full_at >= DISK_FULL_RETRY)
+    disk_full = 0;
+
+  if (max_disk_bytes == 0 && !disk_full)
+    return growth;
+
+  /* space reserved for open files goes first, then (if the policy
+   * allows it) the files of old flows */
+  while (disk_full || disk_usage + growth > max_disk_bytes) {
+    if (reservations) {
+      for_each_open_file(trim_reservation);
+      reservations = 0;
+      continue;
+    }
+    if (limit_policy != LIMIT_DELETE || !delete_oldest_flow())
+      break;
+  }
+
+  if (disk_full)
+    return 0;
+  if (max_disk_bytes == 0 || disk_usage + growth <= max_disk_bytes)
+    return growth;
+  if (disk_usage >= max_disk_bytes)
+    return 0;
+  return max_disk_bytes - disk_usage;
+}
+
+
+/* Reserve disk space for a flow's file through at least 'end'.  With
+ * -b we know the most the file will ever hold, so we reserve that in
+ * one go; otherwise (or once a --combined file, which holds both
+ * directions and their record headers, outgrows it) we reserve
+ * extents that double in size as the file grows.  What's reserved
+ * counts against the disk budget, and is cut down to fit it; the
+ * caller has already made sure there's room up to 'end'. */
+static void preallocate(flow_state_t *flow_state, long end)
+{
+  long want, extent, charged = charged_size(flow_state);
+  int fd = fileno(flow_state->fp);
+  int rc;
+
+  if (flow_state->tcp->max_bytes && end <= flow_state->tcp->max_bytes) {
+    want = flow_state->tcp->max_bytes;
+  } else {
+    extent = flow_state->allocated;
+    if (extent < prealloc_extent)
+      extent = (long) prealloc_extent;
+    if (extent > MAX_PREALLOC_EXTENT)
+      extent = MAX_PREALLOC_EXTENT;
+    want = flow_state->allocated + extent;
+  }
+  if (want < end)
+    want = end;
+  if (max_disk_bytes && want - charged > max_disk_bytes - disk_usage)
+    want = charged + (long) (max_disk_bytes - disk_usage);
+  if (want < end)
+    want = end;
+  if (want <= flow_state->allocated)
+    return;
+
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+  /* don't change the file size; readers only ever see real data */
+  rc = fallocate(fd, FALLOC_FL_KEEP_SIZE, flow_state->allocated,
+		 want - flow_state->allocated) < 0 ? errno : 0;
+#elif defined(HAVE_POSIX_FALLOCATE)
+  /* this one extends the file; release_flow_file() trims it back */
+  rc = posix_fallocate(fd, flow_state->allocated,
+		       want - flow_state->allocated);
+#else
+  rc = EOPNOTSUPP;
+#endif
+
+  if (rc != 0) {
+    if (rc != ENOSPC) {
+      DEBUG(1) ("warning: can't preallocate flow files (%s); "
+		"turning --prealloc off", strerror(rc));
+      prealloc_extent = 0;
+    }
+    return;
+  }
+
+  bytes_preallocated += want - flow_state->allocated;
+  if (want > charged)
+    disk_usage += want - charged;
+  flow_state->allocated = want;
+  reservations = 1;
+}
+
+
+/* pwrite() all of a buffer, through the page cache even if the file
+ * was opened for direct I/O */
+static int buffered_pwrite(int fd, const u_char *data, u_int32_t length,
+			   long offset)
+{
+  ssize_t n;
+#ifdef O_DIRECT
+  int fl = fcntl(fd, F_GETFL);
+
+  if (fl != -1 && (fl & O_DIRECT))
+    fcntl(fd, F_SETFL, fl & ~O_DIRECT);
+#endif
+
+  while (length > 0) {
+    if ((n = pwrite(fd, data, length, offset)) < 0) {
+      if (errno == EINTR)
+	continue;
+      break;
+    }
+    data += n;
+    offset += n;
+    length -= n;
+  }
+
+#ifdef O_DIRECT
+  if (fl != -1 && (fl & O_DIRECT))
+    fcntl(fd, F_SETFL, fl);
+#endif
+
+  return length == 0 ? 0 : -1;
+}
+
+
+/* Stop doing direct I/O for this flow.  The caller has to make sure
+ * whatever is in the buffer has been written. */
+static void drop_direct_buffer(flow_state_t *flow_state)
+{
+#ifdef O_DIRECT
+  int fd = fileno(flow_state->fp);
+  int fl = fcntl(fd, F_GETFL);
+
+  if (fl != -1)
+    fcntl(fd, F_SETFL, fl & ~O_DIRECT);
+#endif
+  free(flow_state->direct->raw);
+  free(flow_state->direct);
+  flow_state->direct = NULL;
+  flow_state->pos = -1;		/* stdio's idea of the position is stale */
+}
+
+
+/* Write the whole blocks in the direct buffer to disk.  If 'all' is
+ * set, the partial block at the end goes out too (through the page
+ * cache), and the buffer restarts at the next block boundary. */
+static int flush_direct(flow_state_t *flow_state, int all)
+{
+  struct direct_buffer *d = flow_state->direct;
+  int fd = fileno(flow_state->fp);
+  u_int32_t whole = d->len & ~(DIRECT_ALIGN - 1);
+  u_int32_t done = 0;
+  ssize_t n;
+
+  while (done < whole) {
+    n = pwrite(fd, d->buf + done, whole - done, d->base + done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      /* some filesystems accept O_DIRECT at open time and then refuse
+       * it on write; finish through the page cache and give up on it */
+      if (n < 0 && errno == EINVAL) {
+	DEBUG(1) ("warning: direct I/O isn't working here; "
+		  "turning --direct-io off");
+	direct_io = 0;
+	if (buffered_pwrite(fd, d->buf + done, d->len - done,
+			    d->base + done) < 0)
+	  return -1;
+	drop_direct_buffer(flow_state);
+	return 0;
+      }
+      return -1;
+    }
+    done += n;
+    bytes_direct += n;
+  }
+
+  if (all) {
+    if (d->len > whole &&
+	buffered_pwrite(fd, d->buf + whole, d->len - whole, d->base + whole) < 0)
+      return -1;
+    d->base = ROUND_UP(d->base + d->len);
+    d->len = 0;
+  } else {
+    memmove(d->buf, d->buf + whole, d->len - whole);
+    d->base += whole;
+    d->len -= whole;
+  }
+
+  return 0;
+}
+
+
+/* Write data at 'offset' through the direct buffer */
+static int direct_write(flow_state_t *flow_state, const u_char *data,
+			u_int32_t length, long offset)
+{
+  struct direct_buffer *d = flow_state->direct;
+  int fd = fileno(flow_state->fp);
+  long end = offset + length;
+  u_int32_t n, at;
+
+  /* whatever falls before the buffer has been seen before, or is
+   * filling in a hole; send it through the page cache */
+  if (offset < d->base) {
+    n = (u_int32_t) ((end < d->base ? end : d->base) - offset);
+    if (buffered_pwrite(fd, data, n, offset) < 0)
+      return -1;
+    data += n;
+    offset += n;
+    length -= n;
+  }
+
+  /* a gap is opening up ahead of the stream; drain the buffer and
+   * wait for the next block boundary before going direct again */
+  if (length > 0 && offset > d->base + d->len) {
+    if (flush_direct(flow_state, 1) < 0 ||
+	buffered_pwrite(fd, data, length, offset) < 0)
+      return -1;
+    if (flow_state->direct != NULL && d->base < ROUND_UP(end))
+      d->base = ROUND_UP(end);
+    return 0;
+  }
+
+  /* in order, or overlapping what we already hold: stage it */
+  while (length > 0 && flow_state->direct != NULL) {
+    at = (u_int32_t) (offset - d->base);
+    n = DIRECT_BUF_SIZE - at;
+    if (n > length)
+      n = length;
+    memcpy(d->buf + at, data, n);
+    if (at + n > d->len)
+      d->len = at + n;
+    data += n;
+    offset += n;
+    length -= n;
+
+    if (d->len == DIRECT_BUF_SIZE && flush_direct(flow_state, 0) < 0)
+      return -1;
+  }
+
+  /* direct I/O was switched off underneath us */
+  if (length > 0 && buffered_pwrite(fd, data, length, offset) < 0)
+    return -1;
+
+  return 0;
+}
+
+
+/* Called by open_file() once a flow's file is open */
+void prepare_flow_file(flow_state_t *flow_state)
+{
+  /* A checkpoint can be a little behind the file it describes (or the
+   * file may have gone away since); believe the file. */
+  if (IS_SET(flow_state->flags, FLOW_RESTORED)) {
+    struct stat st;
+
+    if (fstat(fileno(flow_state->fp), &st) == 0) {
+      disk_usage += (long) st.st_size - flow_state->size;
+      flow_state->size = st.st_size;
+    }
+    flow_state->flags &= ~FLOW_RESTORED;
+  }
+
+  /* whatever we had reserved was trimmed when the file was closed */
+  flow_state->allocated = flow_state->size;
+
+#ifdef O_DIRECT
+  if (direct_io) {
+    int fd = fileno(flow_state->fp);
+    int fl = fcntl(fd, F_GETFL);
+    struct direct_buffer *d;
+
+    if (fl == -1 || fcntl(fd, F_SETFL, fl | O_DIRECT) < 0) {
+      DEBUG(1) ("warning: can't use direct I/O on %s (%s); "
+		"turning --direct-io off", flow_path(flow_state),
+		strerror(errno));
+      direct_io = 0;
+      return;
+    }
+
+    d = MALLOC(struct direct_buffer, 1);
+    d->raw = MALLOC(u_char, DIRECT_BUF_SIZE + DIRECT_ALIGN);
+    d->buf = (u_char *) ROUND_UP((unsigned long) d->raw);
+    d->base = ROUND_UP(flow_state->size);
+    d->len = 0;
+    flow_state->direct = d;
+  }
+#endif
+}
+
+
+/* Called by close_file() just before a flow's file is closed: write
+ * out anything still staged and give back space we reserved but
+ * didn't use. */
+void release_flow_file(flow_state_t *flow_state)
+{
+  if (flow_state->direct != NULL) {
+    if (flush_direct(flow_state, 1) < 0) {
+      DEBUG(1) ("write to %s failed: %s", flow_path(flow_state),
+		strerror(errno));
+      write_errors++;
+    }
+    if (flow_state->direct != NULL)
+      drop_direct_buffer(flow_state);
+  }
+
+  trim_reservation(flow_state);
+}
+
+
+/* Decide whether a flow we haven't created a file for yet may have
+ * one.  Returns 1 if the flow is admitted; otherwise the flow is
+ * marked finished so we don't keep asking, and 0 is returned. */
+int admit_new_flow(flow_state_t *flow_state)
+{
+  int refuse = 0;
+
+  if (max_disk_bytes || disk_full) {
+    if (budget_allows(1) == 0)
+      refuse = 1;
+  }
+
+  if (!refuse && max_write_rate && limit_policy == LIMIT_STOP) {
+    refill_tokens();
+    if (tokens < 1)
+      refuse = 1;
+  }
+
+  if (refuse) {
+    DEBUG(5) ("%s: refusing new flow, output limit reached",
+	      flow_path(flow_state));
+    SET_BIT(flow_state->flags, FLOW_FINISHED);
+    flows_refused++;
+    return 0;
+  }
+
+  return 1;
+}
+
+
+/* Write 'length' bytes at 'offset' into the flow's (open) file,
+ * subject to the budget and rate ceiling.  Returns the number of
+ * bytes actually written.  If the flow has to be cut short, it is
+ * marked FLOW_FINISHED; the caller is responsible for closing it. */
+u_int32_t write_flow_data(flow_state_t *flow_state, const u_char *data,
+			  u_int32_t length, tcp_seq offset)
+{
+  u_int32_t allowed = length;
+  long long growth;
+  long fpos;
+  int failed;
+
+  /* only bytes past the current end of the file (or of the space
+   * reserved for it) cost us disk space */
+  growth = (long long) offset + length - charged_size(flow_state);
+  if (growth > 0) {
+    long long room = budget_allows(growth);
+
+    /* making room may have given back what this file had reserved */
+    if ((long long) offset + length - charged_size(flow_state) > growth) {
+      growth = (long long) offset + length - charged_size(flow_state);
+      room = budget_allows(growth);
+    }
+    if (growth - room >= length)
+      allowed = 0;
+    else if (room < growth)
+      allowed = length - (u_int32_t) (growth - room);
+  }
+
+  if (max_write_rate) {
+    refill_tokens();
+    if (tokens < allowed)
+      allowed = tokens > 0 ? (u_int32_t) tokens : 0;
+  }
+
+  if (allowed < length) {
+    bytes_dropped += length - allowed;
+    if (limit_policy != LIMIT_STOP) {
+      DEBUG(5) ("%s: truncating flow, output limit reached",
+		flow_path(flow_state));
+      SET_BIT(flow_state->flags, FLOW_FINISHED);
+      flows_truncated++;
+    }
+    length = allowed;
+  }
+
+  if (length == 0)
+    return 0;
+
+  /* make sure the space is there before we need it */
+  if (prealloc_extent && (long) offset + length > flow_state->allocated)
+    preallocate(flow_state, (long) offset + length);
+
+  DEBUG(25) ("%s: writing %ld bytes @%ld", flow_path(flow_state),
+	     (long) length, (long) offset);
+
+  if (flow_state->direct != NULL) {
+    failed = direct_write(flow_state, data, length, offset) < 0;
+    flow_state->pos = -1;	/* stdio never sees these writes */
+  } else {
+    /* if we're not at the correct point in the file, seek there */
+    if (offset != flow_state->pos) {
+      fpos = offset;
+      FSETPOS(flow_state->fp, &fpos);
+    }
+
+    /* write the data into the file */
+    failed = fwrite(data, length, 1, flow_state->fp) != 1 ||
+      fflush(flow_state->fp) != 0;
+
+    /* remember the position for next time */
+    if (!failed)
+      flow_state->pos = offset + length;
+  }
+
+  if (failed) {
+    /* Don't keep failing on every packet of this flow.  If the disk
+     * filled up, treat it like hitting the budget for everyone. */
+    write_errors++;
+    bytes_dropped += length;
+    if (errno == ENOSPC) {
+      if (disk_full_at == 0)
+	DEBUG(1) ("output disk is full; applying limit policy");
+      disk_full = 1;
+      disk_full_at = time(NULL);
+    } else {
+      DEBUG(1) ("write to %s failed: %s", flow_path(flow_state),
+		strerror(errno));
+    }
+    SET_BIT(flow_state->flags, FLOW_FINISHED);
+    clearerr(flow_state->fp);
+    flow_state->pos = -1; /* unknown; force a seek next time */
+    return 0;
+  }
+
+  if (disk_full_at) {
+    DEBUG(1) ("output disk has room again");
+    disk_full_at = 0;
+  }
+
+  if ((long) offset + length > flow_state->size) {
+    if ((long) offset + length > charged_size(flow_state))
+      disk_usage += (long) offset + length - charged_size(flow_state);
+    flow_state->size = (long) offset + length;
+  }
+  bytes_written += length;
+  if (max_write_rate)
+    tokens -= length;
+
+  return length;
+}
+
+
+/* A flow has finished for good; remember it so that its file can be
+ * reclaimed later if we run out of room. */
+void retire_flow(flow_state_t *flow_state)
+{
+  if (flow_state->size == 0 || IS_SET(flow_state->flags, FLOW_FILE_DELETED))
+    return;
+
+  flow_state->next_done = NULL;
+  if (done_tail != NULL)
+    done_tail->next_done = flow_state;
+  else
+    done_head = flow_state;
+  done_tail = flow_state;
+}
+
+
+/* A flow restored from a checkpoint already has a file on disk; count
+ * it against the budget, and make it reclaimable if it's finished. */
+void adopt_flow(flow_state_t *flow_state)
+{
+  disk_usage += flow_state->size;
+  if (IS_SET(flow_state->flags, FLOW_FINISHED))
+    retire_flow(flow_state);
+}
+
+
+void print_writer_stats()
+{
+  /* only bother people who asked for limits, or who lost data */
+  int level = (max_disk_bytes || max_write_rate || bytes_dropped) ? 1 : 10;
+
+  if (max_disk_bytes) {
+    DEBUG(level) ("disk usage: %lld of %lld bytes", disk_usage,
+		  max_disk_bytes);
+  } else {
+    DEBUG(level) ("disk usage: %lld bytes", disk_usage);
+  }
+  if (max_write_rate)
+    DEBUG(level) ("write rate ceiling: %lld bytes/sec", max_write_rate);
+  DEBUG(level) ("bytes written: %lld, dropped: %lld", bytes_written,
+		bytes_dropped);
+  if (bytes_preallocated || bytes_direct)
+    DEBUG(level) ("bytes preallocated: %lld, written with direct I/O: %lld",
+		  bytes_preallocated, bytes_direct);
+  if (flows_refused || flows_truncated || files_deleted || write_errors)
+    DEBUG(level) ("flows refused: %d, truncated: %d, deleted: %d "
+		  "(%lld bytes reclaimed), write errors: %d",
+		  flows_refused, flows_truncated, files_deleted,
+		  bytes_reclaimed, write_errors);
+}